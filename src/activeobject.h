@@ -49,6 +49,10 @@ class ActiveObject
 		m_id(id)
 	{
 	}
+
+	virtual ~ActiveObject()
+	{
+	}
 	
 	u16 getId()
 	{
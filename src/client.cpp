@@ -1164,6 +1164,31 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		*/
 		addUpdateMeshTaskWithEdge(p, true);
 	}
+	else if(command == TOCLIENT_BLOCKDELTA)
+	{
+		// Ignore too small packet
+		if(datasize < 8)
+			return;
+
+		v3s16 p;
+		p.X = readS16(&data[2]);
+		p.Y = readS16(&data[4]);
+		p.Z = readS16(&data[6]);
+
+		// The block was deleted after the server sent this; the server
+		// learns that from TOSERVER_DELETEDBLOCKS and sends it whole
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+		if(block == NULL)
+			return;
+
+		std::string datastring((char*)&data[8], datasize-8);
+		std::istringstream istr(datastring, std::ios_base::binary);
+
+		block->deSerializeNetworkDelta(istr, ser_version);
+		block->deSerializeNetworkSpecific(istr);
+
+		addUpdateMeshTaskWithEdge(p, true);
+	}
 	else if(command == TOCLIENT_INVENTORY)
 	{
 		if(datasize < 3)
@@ -2619,6 +2644,10 @@ void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 	infostream<<"- Updating node aliases"<<std::endl;
 	m_nodedef->updateAliases(m_itemdef);
 
+	// Precompute node collision boxes
+	infostream<<"- Updating node collision boxes"<<std::endl;
+	m_nodedef->updateCollisionBoxes();
+
 	// Update node textures
 	infostream<<"- Updating node textures"<<std::endl;
 	m_nodedef->updateTextures(m_tsrc);
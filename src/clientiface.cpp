@@ -53,9 +53,21 @@ void RemoteClient::GetNextBlocks(
 	if(player == NULL)
 		return;
 
+	// Let the emerge queue give priority to blocks near the player
+	emerge->setPeerPosition(peer_id,
+			getNodeBlockPos(floatToInt(player->getPosition(), BS)));
+
+	static CachedSetting<u16> max_simul_sends_per_client(g_settings,
+			"max_simultaneous_block_sends_per_client");
+	static CachedSetting<float> full_block_send_min_time(g_settings,
+			"full_block_send_enable_min_time_from_building");
+	static CachedSetting<s16> max_block_send_distance(g_settings,
+			"max_block_send_distance");
+	static CachedSetting<s16> max_block_generate_distance(g_settings,
+			"max_block_generate_distance");
+
 	// Won't send anything if already sending
-	if(m_blocks_sending.size() >= g_settings->getU16
-			("max_simultaneous_block_sends_per_client"))
+	if(m_blocks_sending.size() >= max_simul_sends_per_client.get())
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
 		return;
@@ -109,8 +121,7 @@ void RemoteClient::GetNextBlocks(
 
 	//infostream<<"d_start="<<d_start<<std::endl;
 
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
+	u16 max_simul_sends_setting = max_simul_sends_per_client.get();
 	u16 max_simul_sends_usually = max_simul_sends_setting;
 
 	/*
@@ -119,8 +130,7 @@ void RemoteClient::GetNextBlocks(
 		Decrease send rate if player is building stuff.
 	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
+	if(m_time_from_building < full_block_send_min_time.get())
 	{
 		max_simul_sends_usually
 			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
@@ -140,8 +150,8 @@ void RemoteClient::GetNextBlocks(
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	s16 d_max = g_settings->getS16("max_block_send_distance");
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+	s16 d_max = max_block_send_distance.get();
+	s16 d_max_gen = max_block_generate_distance.get();
 
 	// Don't loop very much at a time
 	s16 max_d_increment_at_time = 2;
@@ -332,7 +342,7 @@ void RemoteClient::GetNextBlocks(
 	} else if(nearest_emergefull_d != -1){
 		new_nearest_unsent_d = nearest_emergefull_d;
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
+		if(d > max_block_send_distance.get()){
 			new_nearest_unsent_d = 0;
 			m_nothing_to_send_pause_timer = 2.0;
 		} else {
@@ -367,7 +377,27 @@ void RemoteClient::SentBlock(v3s16 p)
 				" already in m_blocks_sending"<<std::endl;
 }
 
+void RemoteClient::SetBlockVersion(v3s16 p, u32 version)
+{
+	m_blocks_version[p] = version;
+}
+
+bool RemoteClient::GetBlockVersion(v3s16 p, u32 &version)
+{
+	std::map<v3s16, u32>::iterator i = m_blocks_version.find(p);
+	if(i == m_blocks_version.end())
+		return false;
+	version = i->second;
+	return true;
+}
+
 void RemoteClient::SetBlockNotSent(v3s16 p)
+{
+	SetBlockChanged(p);
+	m_blocks_version.erase(p);
+}
+
+void RemoteClient::SetBlockChanged(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
 
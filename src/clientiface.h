@@ -126,7 +126,21 @@ class RemoteClient
 
 	void SentBlock(v3s16 p);
 
+	/*
+		Network version (MapBlock::getNetworkVersion()) of the block the
+		client holds at p, as of the last BLOCKDATA or BLOCKDELTA sent.
+	*/
+	void SetBlockVersion(v3s16 p, u32 version);
+	bool GetBlockVersion(v3s16 p, u32 &version);
+
+	/*
+		SetBlockNotSent() is for when the client's copy of the block is
+		gone or wrong, it is sent in whole again. The others are for
+		blocks that changed on the server, the client's copy is kept as
+		a base for a delta.
+	*/
 	void SetBlockNotSent(v3s16 p);
+	void SetBlockChanged(v3s16 p);
 	void SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks);
 
 	s32 SendingCount()
@@ -209,6 +223,11 @@ class RemoteClient
 	*/
 	std::map<v3s16, float> m_blocks_sending;
 
+	/*
+		See GetBlockVersion(). Cleared by SetBlockNotSent().
+	*/
+	std::map<v3s16, u32> m_blocks_version;
+
 	/*
 		Count of excess GotBlocks().
 		There is an excess amount because the client sometimes
@@ -100,9 +100,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		version, heat and humidity transfer in MapBock
 		automatic_face_movement_dir and automatic_face_movement_dir_offset
 			added to object properties
+	PROTOCOL_VERSION 22:
+		keep_metadata added to TOCLIENT_ADDNODE
+	PROTOCOL_VERSION 23:
+		TOCLIENT_BLOCKDELTA
 */
 
-#define LATEST_PROTOCOL_VERSION 22
+#define LATEST_PROTOCOL_VERSION 23
 
 // Server's supported network protocol range
 #define SERVER_PROTOCOL_VERSION_MIN 13
@@ -526,6 +530,25 @@ enum ToClientCommand
 		u8 do_override (boolean)
 		u16 day-night ratio 0...65535
 	*/
+
+	TOCLIENT_BLOCKDELTA = 0x51,
+	/*
+		Updates a block the client already has; acknowledged with
+		TOSERVER_GOTBLOCKS like TOCLIENT_BLOCKDATA. Ignored if the client
+		doesn't have the block.
+
+		u16 command
+		v3s16 blockpos
+		u8 flags (as in the block serialization)
+		zlib-compressed {
+			u16 count
+			foreach count:
+				u16 node index (z*256 + y*16 + x)
+				serialized MapNode
+		}
+		zlib-compressed node metadata list (as in the block serialization)
+		network specific block data (as in TOCLIENT_BLOCKDATA)
+	*/
 };
 
 enum ToServerCommand
@@ -27,9 +27,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverobject.h"
 #include <vector>
 #include <set>
+#include <list>
 #include "util/timetaker.h"
 #include "main.h" // g_profiler
 #include "profiler.h"
+#include "porting.h"
 
 // float error is 10 - 9.96875 = 0.03125
 //#define COLL_ZERO 0.032 // broken unit tests
@@ -192,6 +194,226 @@ bool wouldCollideWithCeiling(
 	return false;
 }
 
+/*
+	ObjectCollisionGrid
+*/
+
+v3s16 ObjectCollisionGrid::getCell(const v3f &pos)
+{
+	// Keep far away positions from overflowing
+	const f32 limit = (MAP_GENERATION_LIMIT + MAP_BLOCKSIZE) * BS;
+	return v3s16(
+		floor(rangelim(pos.X, -limit, limit) / OBJECT_COLLISION_GRID_CELL),
+		floor(rangelim(pos.Y, -limit, limit) / OBJECT_COLLISION_GRID_CELL),
+		floor(rangelim(pos.Z, -limit, limit) / OBJECT_COLLISION_GRID_CELL));
+}
+
+void ObjectCollisionGrid::update(ActiveObject *obj)
+{
+	aabb3f box;
+	if(!obj->getCollisionBox(&box) || !obj->collideWithObjects()){
+		remove(obj->getId());
+		return;
+	}
+
+	v3s16 cmin = getCell(box.MinEdge);
+	v3s16 cmax = getCell(box.MaxEdge);
+
+	std::map<u16, Entry>::iterator n = m_entries.find(obj->getId());
+	if(n != m_entries.end()){
+		Entry *entry = &n->second;
+		entry->obj = obj;
+		entry->box = box;
+		if(entry->cmin == cmin && entry->cmax == cmax)
+			return;
+		removeFromCells(entry);
+		entry->cmin = cmin;
+		entry->cmax = cmax;
+		addToCells(entry);
+		return;
+	}
+
+	Entry *entry = &m_entries[obj->getId()];
+	entry->obj = obj;
+	entry->box = box;
+	entry->cmin = cmin;
+	entry->cmax = cmax;
+	addToCells(entry);
+}
+
+void ObjectCollisionGrid::remove(u16 id)
+{
+	std::map<u16, Entry>::iterator n = m_entries.find(id);
+	if(n == m_entries.end())
+		return;
+	removeFromCells(&n->second);
+	m_entries.erase(n);
+}
+
+void ObjectCollisionGrid::clear()
+{
+	m_entries.clear();
+	m_cells.clear();
+	m_large.clear();
+}
+
+void ObjectCollisionGrid::addToCells(Entry *entry)
+{
+	v3s16 cmin = entry->cmin;
+	v3s16 cmax = entry->cmax;
+	s32 volume = (s32)(cmax.X - cmin.X + 1) * (cmax.Y - cmin.Y + 1)
+			* (cmax.Z - cmin.Z + 1);
+	entry->large = (volume > OBJECT_COLLISION_GRID_MAX_CELLS);
+	if(entry->large){
+		m_large.push_back(entry);
+		return;
+	}
+
+	for(s16 z=cmin.Z; z<=cmax.Z; z++)
+	for(s16 y=cmin.Y; y<=cmax.Y; y++)
+	for(s16 x=cmin.X; x<=cmax.X; x++)
+		m_cells[v3s16(x,y,z)].push_back(entry);
+}
+
+template<typename T>
+static void eraseUnordered(std::vector<T> &list, const T &value)
+{
+	for(u32 i = 0; i < list.size(); i++){
+		if(list[i] == value){
+			list[i] = list.back();
+			list.pop_back();
+			return;
+		}
+	}
+}
+
+void ObjectCollisionGrid::removeFromCells(Entry *entry)
+{
+	if(entry->large){
+		eraseUnordered(m_large, entry);
+		return;
+	}
+
+	v3s16 cmin = entry->cmin;
+	v3s16 cmax = entry->cmax;
+	for(s16 z=cmin.Z; z<=cmax.Z; z++)
+	for(s16 y=cmin.Y; y<=cmax.Y; y++)
+	for(s16 x=cmin.X; x<=cmax.X; x++)
+	{
+		std::map<v3s16, std::vector<Entry*> >::iterator n =
+				m_cells.find(v3s16(x,y,z));
+		if(n == m_cells.end())
+			continue;
+		eraseUnordered(n->second, entry);
+		if(n->second.empty())
+			m_cells.erase(n);
+	}
+}
+
+static inline bool boxesTouch(const aabb3f &a, const aabb3f &b)
+{
+	return a.MinEdge.X <= b.MaxEdge.X && a.MaxEdge.X >= b.MinEdge.X &&
+			a.MinEdge.Y <= b.MaxEdge.Y && a.MaxEdge.Y >= b.MinEdge.Y &&
+			a.MinEdge.Z <= b.MaxEdge.Z && a.MaxEdge.Z >= b.MinEdge.Z;
+}
+
+void ObjectCollisionGrid::getObjectsInBox(const aabb3f &box,
+		std::vector<ActiveObject*> &dst) const
+{
+	for(std::vector<Entry*>::const_iterator
+			i = m_large.begin(); i != m_large.end(); ++i)
+	{
+		if(boxesTouch((*i)->box, box))
+			dst.push_back((*i)->obj);
+	}
+
+	v3s16 qmin = getCell(box.MinEdge);
+	v3s16 qmax = getCell(box.MaxEdge);
+
+	// Look up the cells in the area, or go through the occupied cells if
+	// there are fewer of them
+	s64 volume = (s64)(qmax.X - qmin.X + 1) * (qmax.Y - qmin.Y + 1)
+			* (qmax.Z - qmin.Z + 1);
+	if(volume > (s64)m_cells.size())
+	{
+		for(std::map<v3s16, std::vector<Entry*> >::const_iterator
+				i = m_cells.begin(); i != m_cells.end(); ++i)
+		{
+			v3s16 c = i->first;
+			if(c.X < qmin.X || c.X > qmax.X || c.Y < qmin.Y ||
+					c.Y > qmax.Y || c.Z < qmin.Z || c.Z > qmax.Z)
+				continue;
+			getObjectsInCell(c, i->second, qmin, box, dst);
+		}
+		return;
+	}
+
+	for(s16 z=qmin.Z; z<=qmax.Z; z++)
+	for(s16 y=qmin.Y; y<=qmax.Y; y++)
+	for(s16 x=qmin.X; x<=qmax.X; x++)
+	{
+		v3s16 c(x,y,z);
+		std::map<v3s16, std::vector<Entry*> >::const_iterator i =
+				m_cells.find(c);
+		if(i == m_cells.end())
+			continue;
+		getObjectsInCell(c, i->second, qmin, box, dst);
+	}
+}
+
+void ObjectCollisionGrid::getObjectsInCell(const v3s16 &c,
+		const std::vector<Entry*> &list, const v3s16 &qmin,
+		const aabb3f &box, std::vector<ActiveObject*> &dst) const
+{
+	for(u32 j = 0; j < list.size(); j++)
+	{
+		const Entry *entry = list[j];
+		// An entry in several cells is only reported from the first one
+		// that the query covers too
+		if(c.X != MYMAX(qmin.X, entry->cmin.X) ||
+				c.Y != MYMAX(qmin.Y, entry->cmin.Y) ||
+				c.Z != MYMAX(qmin.Z, entry->cmin.Z))
+			continue;
+		if(boxesTouch(entry->box, box))
+			dst.push_back(entry->obj);
+	}
+}
+
+/*
+	Buffers of collisionMoveSimple, kept between calls so that their
+	memory can be reused. One per thread.
+*/
+struct CollisionScratch
+{
+	std::vector<aabb3f> cboxes;
+	std::vector<bool> is_unloaded;
+	std::vector<bool> is_step_up;
+	std::vector<bool> is_object;
+	std::vector<int> bouncy_values;
+	std::vector<v3s16> node_positions;
+	std::vector<aabb3f> nodeboxes;
+	std::list<ActiveObject*> objects;
+	std::vector<ActiveObject*> server_objects;
+
+	void clear()
+	{
+		cboxes.clear();
+		is_unloaded.clear();
+		is_step_up.clear();
+		is_object.clear();
+		bouncy_values.clear();
+		node_positions.clear();
+		objects.clear();
+	}
+};
+
+static void deleteCollisionScratch(void *p)
+{
+	delete (CollisionScratch*)p;
+}
+
+// The CollisionScratch of the current thread, freed when the thread exits
+static porting::ThreadLocalKey t_collision_scratch(deleteCollisionScratch);
 
 collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		f32 pos_max_d, const aabb3f &box_0,
@@ -202,7 +424,8 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 {
 	Map *map = &env->getMap();
 	//TimeTaker tt("collisionMoveSimple");
-    ScopeProfiler sp(g_profiler, "collisionMoveSimple avg", SPT_AVG);
+    static ProbeId probe = g_probes.registerProbe("collisionMoveSimple (us)");
+    ScopeProbe sp(probe);
 
 	collisionMoveResult result;
 
@@ -227,15 +450,24 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	/*
 		Collect node boxes in movement range
 	*/
-	std::vector<aabb3f> cboxes;
-	std::vector<bool> is_unloaded;
-	std::vector<bool> is_step_up;
-	std::vector<bool> is_object;
-	std::vector<int> bouncy_values;
-	std::vector<v3s16> node_positions;
+	CollisionScratch *scratch_p =
+			(CollisionScratch*)t_collision_scratch.get();
+	if(scratch_p == NULL){
+		scratch_p = new CollisionScratch;
+		t_collision_scratch.set(scratch_p);
+	}
+	CollisionScratch &scratch = *scratch_p;
+	scratch.clear();
+	std::vector<aabb3f> &cboxes = scratch.cboxes;
+	std::vector<bool> &is_unloaded = scratch.is_unloaded;
+	std::vector<bool> &is_step_up = scratch.is_step_up;
+	std::vector<bool> &is_object = scratch.is_object;
+	std::vector<int> &bouncy_values = scratch.bouncy_values;
+	std::vector<v3s16> &node_positions = scratch.node_positions;
 	{
 	//TimeTaker tt2("collisionMoveSimple collect boxes");
-    ScopeProfiler sp(g_profiler, "collisionMoveSimple collect boxes avg", SPT_AVG);
+    static ProbeId probe = g_probes.registerProbe("collisionMoveSimple collect boxes (us)");
+    ScopeProbe sp(probe);
 
 	v3s16 oldpos_i = floatToInt(pos_f, BS);
 	v3s16 newpos_i = floatToInt(pos_f + speed_f * dtime, BS);
@@ -246,36 +478,25 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	s16 max_y = MYMAX(oldpos_i.Y, newpos_i.Y) + (box_0.MaxEdge.Y / BS) + 1;
 	s16 max_z = MYMAX(oldpos_i.Z, newpos_i.Z) + (box_0.MaxEdge.Z / BS) + 1;
 
+	INodeDefManager *ndef = gamedef->ndef();
+
+	// The last block looked up; the sweep volume rarely spans more than two
+	v3s16 cached_blockpos(-32768,-32768,-32768);
+	MapBlock *cached_block = NULL;
+
 	for(s16 x = min_x; x <= max_x; x++)
 	for(s16 y = min_y; y <= max_y; y++)
 	for(s16 z = min_z; z <= max_z; z++)
 	{
 		v3s16 p(x,y,z);
-		try{
-			// Object collides into walkable nodes
-			MapNode n = map->getNode(p);
-			const ContentFeatures &f = gamedef->getNodeDefManager()->get(n);
-			if(f.walkable == false)
-				continue;
-			int n_bouncy_value = itemgroup_get(f.groups, "bouncy");
-
-			std::vector<aabb3f> nodeboxes = n.getNodeBoxes(gamedef->ndef());
-			for(std::vector<aabb3f>::iterator
-					i = nodeboxes.begin();
-					i != nodeboxes.end(); i++)
-			{
-				aabb3f box = *i;
-				box.MinEdge += v3f(x, y, z)*BS;
-				box.MaxEdge += v3f(x, y, z)*BS;
-				cboxes.push_back(box);
-				is_unloaded.push_back(false);
-				is_step_up.push_back(false);
-				bouncy_values.push_back(n_bouncy_value);
-				node_positions.push_back(p);
-				is_object.push_back(false);
-			}
+		v3s16 blockpos = getNodeBlockPos(p);
+		if(blockpos != cached_blockpos)
+		{
+			cached_block = map->getBlockNoCreateNoEx(blockpos);
+			cached_blockpos = blockpos;
 		}
-		catch(InvalidPositionException &e)
+
+		if(cached_block == NULL || cached_block->isDummy())
 		{
 			// Collide with unloaded nodes
 			aabb3f box = getNodeBox(p, BS);
@@ -285,19 +506,53 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			bouncy_values.push_back(0);
 			node_positions.push_back(p);
 			is_object.push_back(false);
+			continue;
+		}
+
+		// Object collides into walkable nodes
+		MapNode n = cached_block->getNodeNoCheck(p - blockpos*MAP_BLOCKSIZE);
+		const ContentFeatures &f = ndef->get(n);
+		if(f.walkable == false)
+			continue;
+
+		const std::vector<aabb3f> *nodeboxes =
+				f.getCollisionBoxes(n.getParam2());
+		int n_bouncy_value = f.collision_bouncy;
+		if(nodeboxes == NULL)
+		{
+			// Not precomputed
+			scratch.nodeboxes = n.getNodeBoxes(ndef);
+			nodeboxes = &scratch.nodeboxes;
+			n_bouncy_value = itemgroup_get(f.groups, "bouncy");
+		}
+
+		for(std::vector<aabb3f>::const_iterator
+				i = nodeboxes->begin();
+				i != nodeboxes->end(); i++)
+		{
+			aabb3f box = *i;
+			box.MinEdge += v3f(x, y, z)*BS;
+			box.MaxEdge += v3f(x, y, z)*BS;
+			cboxes.push_back(box);
+			is_unloaded.push_back(false);
+			is_step_up.push_back(false);
+			bouncy_values.push_back(n_bouncy_value);
+			node_positions.push_back(p);
+			is_object.push_back(false);
 		}
 	}
 	} // tt2
 
 	if(collideWithObjects)
 	{
-		ScopeProfiler sp(g_profiler, "collisionMoveSimple objects avg", SPT_AVG);
+		static ProbeId probe = g_probes.registerProbe("collisionMoveSimple objects (us)");
+		ScopeProbe sp(probe);
 		//TimeTaker tt3("collisionMoveSimple collect object boxes");
 
 		/* add object boxes to cboxes */
 
 
-		std::list<ActiveObject*> objects;
+		std::list<ActiveObject*> &objects = scratch.objects;
 #ifndef SERVER
 		ClientEnvironment *c_env = dynamic_cast<ClientEnvironment*>(env);
 		if (c_env != 0)
@@ -318,13 +573,22 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			ServerEnvironment *s_env = dynamic_cast<ServerEnvironment*>(env);
 			if (s_env != 0)
 			{
-				f32 distance = speed_f.getLength();
-				std::set<u16> s_objects = s_env->getObjectsInsideRadius(pos_f,distance * 1.5);
-				for (std::set<u16>::iterator iter = s_objects.begin(); iter != s_objects.end(); iter++)
+				// The space the box can move in, in any direction as it may
+				// bounce back, with room for the collision uncertainty, for
+				// stepping up and for finding the ground
+				f32 distance = speed_f.getLength() * dtime
+						+ pos_max_d * 1.1 + stepheight + 0.15*BS;
+				aabb3f sweepbox = box_0;
+				sweepbox.MinEdge += pos_f - v3f(distance, distance, distance);
+				sweepbox.MaxEdge += pos_f + v3f(distance, distance, distance);
+
+				std::vector<ActiveObject*> &s_objects = scratch.server_objects;
+				s_objects.clear();
+				s_env->getCollidingObjects(sweepbox, s_objects);
+				for (size_t i=0; i < s_objects.size(); i++)
 				{
-					ServerActiveObject *current = s_env->getActiveObject(*iter);
-					if ((self == 0) || (self != current)) {
-						objects.push_back((ActiveObject*)current);
+					if ((self == 0) || (self != s_objects[i])) {
+						objects.push_back(s_objects[i]);
 					}
 				}
 			}
@@ -377,7 +641,8 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	while(dtime > BS*1e-10)
 	{
 		//TimeTaker tt3("collisionMoveSimple dtime loop");
-        ScopeProfiler sp(g_profiler, "collisionMoveSimple dtime loop avg", SPT_AVG);
+        static ProbeId probe = g_probes.registerProbe("collisionMoveSimple dtime loop (us)");
+        ScopeProbe sp(probe);
 
 		// Avoid infinite loop
 		loopcount++;
@@ -573,7 +838,8 @@ collisionMoveResult collisionMovePrecise(Map *map, IGameDef *gamedef,
 		v3f &pos_f, v3f &speed_f, v3f &accel_f)
 {
 	//TimeTaker tt("collisionMovePrecise");
-    ScopeProfiler sp(g_profiler, "collisionMovePrecise avg", SPT_AVG);
+    static ProbeId probe = g_probes.registerProbe("collisionMovePrecise (us)");
+    ScopeProbe sp(probe);
 	
 	collisionMoveResult final_result;
 
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes_bloated.h"
 #include <vector>
+#include <map>
 
 class Map;
 class IGameDef;
@@ -99,6 +100,64 @@ bool wouldCollideWithCeiling(
 		const aabb3f &movingbox,
 		f32 y_increase, f32 d);
 
+// Edge length of the cells of ObjectCollisionGrid
+#define OBJECT_COLLISION_GRID_CELL (2.0*BS)
+// Objects covering more cells are kept in a separate list
+#define OBJECT_COLLISION_GRID_MAX_CELLS 64
+
+/*
+	Broadphase for collisions between active objects.
+
+	Objects that collide with other objects are kept in the cells of a
+	uniform grid that their collision boxes touch, so that only the
+	objects near a movement have to be tested against it.
+*/
+class ObjectCollisionGrid
+{
+public:
+	/*
+		Moves the object to the cells of its current collision box,
+		adding it if needed, or removes it if it doesn't collide with
+		other objects.
+	*/
+	void update(ActiveObject *obj);
+	void remove(u16 id);
+	void clear();
+
+	/*
+		Adds to dst the objects whose collision boxes, as of their last
+		update(), touch box. Each object is added once.
+	*/
+	void getObjectsInBox(const aabb3f &box,
+			std::vector<ActiveObject*> &dst) const;
+
+	u32 size() const
+		{ return m_entries.size(); }
+
+	static v3s16 getCell(const v3f &pos);
+
+private:
+	struct Entry
+	{
+		ActiveObject *obj;
+		aabb3f box;
+		v3s16 cmin;
+		v3s16 cmax;
+		bool large;
+	};
+
+	void addToCells(Entry *entry);
+	void removeFromCells(Entry *entry);
+	void getObjectsInCell(const v3s16 &c, const std::vector<Entry*> &list,
+			const v3s16 &qmin, const aabb3f &box,
+			std::vector<ActiveObject*> &dst) const;
+
+	std::map<u16, Entry> m_entries;
+	std::map<v3s16, std::vector<Entry*> > m_cells;
+	// Entries covering more than OBJECT_COLLISION_GRID_MAX_CELLS
+	std::vector<Entry*> m_large;
+};
+
 
 #endif
 
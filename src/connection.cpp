@@ -72,6 +72,22 @@ static inline float CALC_DTIME(unsigned int lasttime, unsigned int curtime) {
 
 #define PING_TIMEOUT 5.0
 
+/* datagrams given to or read from the socket with one call */
+#define SEND_BATCH_SIZE 64
+#define RECEIVE_BATCH_SIZE 32
+
+/* congestion control: loss ratio within one round trip that halves the window */
+#define CC_LOSS_THRESHOLD 0.05
+/* round trip time growth over the path minimum that is read as queueing */
+#define CC_DELAY_FACTOR 2.0
+#define CC_DELAY_MARGIN 0.02
+/* window growth per round trip once slow start is over */
+#define CC_ADDITIVE_INCREASE 0x20
+/* bounds of the interval the window is adjusted in, and of the rtt used for pacing */
+#define CC_MIN_INTERVAL 0.05
+#define CC_MAX_INTERVAL 1.0
+#define CC_MIN_RTT 0.005
+
 static u16 readPeerId(u8 *packetdata)
 {
 	return readU16(&packetdata[4]);
@@ -212,107 +228,131 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0),writeptr(0) {}
+/* initial number of slots of a ReliablePacketBuffer */
+#define RPB_MIN_SLOTS 16
+/* an empty buffer with more slots than this gives them back */
+#define RPB_KEEP_SLOTS 256
+
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_empty_slot(0),
+	m_list_size(0),
+	m_oldest_non_answered_ack(0),
+	m_newest(0)
+{}
 
 void ReliablePacketBuffer::print()
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
+	if (m_list_size == 0)
+		return;
 	unsigned int index = 0;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
+	for (u16 s = m_oldest_non_answered_ack; ; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		LOG(dout_con<<index<< ":" << s << std::endl);
-		index++;
+		if (slotUsed(s)) {
+			LOG(dout_con<<index<< ":" << s << std::endl);
+			index++;
+		}
+		if (s == m_newest)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_list_size == 0;
 }
 
 u32 ReliablePacketBuffer::size()
 {
+	JMutexAutoLock listlock(m_list_mutex);
 	return m_list_size;
 }
 
 bool ReliablePacketBuffer::containsPacket(u16 seqnum)
 {
-	return !(findPacket(seqnum) == m_list.end());
+	JMutexAutoLock listlock(m_list_mutex);
+	return m_list_size != 0 && slotUsed(seqnum) &&
+			readU16(&(slot(seqnum).data[BASE_HEADER_SIZE+1])) == seqnum;
 }
 
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
-{
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
-}
-RPBSearchResult ReliablePacketBuffer::notFound()
-{
-	return m_list.end();
-}
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if(m_list.empty())
+	if(m_list_size == 0)
 		return false;
-	BufferedPacket p = *m_list.begin();
-	result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	result = m_oldest_non_answered_ack;
 	return true;
 }
 
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	if(m_list.empty())
+	if(m_list_size == 0)
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
-	return p;
+	return remove(m_oldest_non_answered_ack);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	if(m_list_size == 0 || !slotUsed(seqnum) ||
+			readU16(&(slot(seqnum).data[BASE_HEADER_SIZE+1])) != seqnum){
 		LOG(dout_con<<"Sequence number: " << seqnum << " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
+	return remove(seqnum);
+}
 
+BufferedPacket ReliablePacketBuffer::remove(u16 seqnum)
+{
+	BufferedPacket &s = slot(seqnum);
+	BufferedPacket p = s;
+	s = m_empty_slot;
+	--m_list_size;
 
-	RPBSearchResult next = r;
-	next++;
-	if (next != notFound()) {
-		u16 s = readU16(&(next->data[BASE_HEADER_SIZE+1]));
-		m_oldest_non_answered_ack = s;
+	if (m_list_size == 0) {
+		m_oldest_non_answered_ack = 0;
+		m_newest = 0;
+		if (m_slots.size() > RPB_KEEP_SLOTS)
+			std::vector<BufferedPacket>().swap(m_slots);
+		return p;
 	}
 
-	m_list.erase(r);
-	--m_list_size;
-
-	if (m_list_size == 0)
-	{ m_oldest_non_answered_ack = 0; }
-	else
-	{ m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);	}
+	// All packets are between the oldest and the newest one
+	if (seqnum == m_oldest_non_answered_ack) {
+		do {
+			m_oldest_non_answered_ack++;
+		} while (!slotUsed(m_oldest_non_answered_ack));
+	} else if (seqnum == m_newest) {
+		do {
+			m_newest--;
+		} while (!slotUsed(m_newest));
+	}
 	return p;
 }
+
+void ReliablePacketBuffer::reserve(u32 span)
+{
+	u32 capacity = m_slots.size();
+	if (span <= capacity)
+		return;
+	if (capacity < RPB_MIN_SLOTS)
+		capacity = RPB_MIN_SLOTS;
+	while (capacity < span)
+		capacity *= 2;
+
+	std::vector<BufferedPacket> slots(capacity, m_empty_slot);
+	if (m_list_size != 0) {
+		for (u16 s = m_oldest_non_answered_ack; ; s++) {
+			if (slotUsed(s))
+				slots[s & (capacity - 1)] = slot(s);
+			if (s == m_newest)
+				break;
+		}
+	}
+	m_slots.swap(slots);
+}
+
 void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 {
 	JMutexAutoLock listlock(m_list_mutex);
@@ -324,87 +364,73 @@ void ReliablePacketBuffer::insert(BufferedPacket &p,u16 next_expected)
 	assert(seqnum_in_window(seqnum,next_expected,MAX_RELIABLE_WINDOW_SIZE));
 	assert(seqnum != next_expected);
 
-	++m_list_size;
-	assert(m_list_size <= SEQNUM_MAX+1);
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if(m_list.empty())
+	// If buffer is empty, just add it
+	if(m_list_size == 0)
 	{
-		m_list.push_back(p);
+		reserve(1);
+		slot(seqnum) = p;
+		m_list_size = 1;
 		m_oldest_non_answered_ack = seqnum;
+		m_newest = seqnum;
 		// Done.
 		return;
 	}
 
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (i != m_list.end())) {
-			i++;
-			if (i != m_list.end())
-				s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		}
-	}
+	/* packets are ordered by their distance from next_expected */
+	u16 offset = seqnum - next_expected;
+	u16 oldest = m_oldest_non_answered_ack;
+	u16 newest = m_newest;
+	if (offset < (u16)(oldest - next_expected))
+		oldest = seqnum;
+	else if (offset > (u16)(newest - next_expected))
+		newest = seqnum;
+	reserve((u32)(u16)(newest - oldest) + 1);
 
-	if (s == seqnum) {
+	BufferedPacket &s = slot(seqnum);
+	if (s.data.getSize() != 0) {
 		if (
-			(readU16(&(i->data[BASE_HEADER_SIZE+1])) != seqnum) ||
-			(i->data.getSize() != p.data.getSize()) ||
-			(i->address != p.address)
+			(readU16(&(s.data[BASE_HEADER_SIZE+1])) != seqnum) ||
+			(s.data.getSize() != p.data.getSize()) ||
+			(s.address != p.address)
 			)
 		{
 			/* if this happens your maximum transfer window may be to big */
 			fprintf(stderr, "Duplicated seqnum %d non matching packet detected:\n",seqnum);
 			fprintf(stderr, "Old: seqnum: %05d size: %04d, address: %s\n",
-					readU16(&(i->data[BASE_HEADER_SIZE+1])),i->data.getSize(), i->address.serializeString().c_str());
+					readU16(&(s.data[BASE_HEADER_SIZE+1])),s.data.getSize(), s.address.serializeString().c_str());
 			fprintf(stderr, "New: seqnum: %05d size: %04d, address: %s\n",
 					readU16(&(p.data[BASE_HEADER_SIZE+1])),p.data.getSize(), p.address.serializeString().c_str());
 			throw IncomingDataCorruption("duplicated packet isn't same as original one");
 		}
 
-		assert(readU16(&(i->data[BASE_HEADER_SIZE+1])) == seqnum);
-		assert(i->data.getSize() == p.data.getSize());
-		assert(i->address == p.address);
-
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		--m_list_size;
-	}
-	/* insert or push back */
-	else if (i != m_list.end()) {
-		m_list.insert(i, p);
-	}
-	else {
-		m_list.push_back(p);
+		return;
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = readU16(&(*m_list.begin()).data[BASE_HEADER_SIZE+1]);
+	s = p;
+	++m_list_size;
+	assert(m_list_size <= SEQNUM_MAX+1);
+
+	/* update first and last packet number */
+	m_oldest_non_answered_ack = oldest;
+	m_newest = newest;
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	JMutexAutoLock listlock(m_list_mutex);
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if (m_list_size == 0)
+		return;
+	for (u16 s = m_oldest_non_answered_ack; ; s++)
 	{
-		i->time += dtime;
-		i->totaltime += dtime;
+		if (slotUsed(s)) {
+			BufferedPacket &p = slot(s);
+			p.time += dtime;
+			p.totaltime += dtime;
+		}
+		if (s == m_newest)
+			break;
 	}
 }
 
@@ -413,17 +439,22 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 {
 	JMutexAutoLock listlock(m_list_mutex);
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if (m_list_size == 0)
+		return timed_outs;
+	for (u16 s = m_oldest_non_answered_ack; ; s++)
 	{
-		if(i->time >= timeout) {
-			timed_outs.push_back(*i);
+		if (slotUsed(s) && slot(s).time >= timeout) {
+			BufferedPacket &p = slot(s);
+			timed_outs.push_back(p);
 
 			//this packet will be sent right afterwards reset timeout here
-			i->time = 0.0;
+			p.time = 0.0;
+			p.resend_count++;
 			if (timed_outs.size() >= max_packets)
 				break;
 		}
+		if (s == m_newest)
+			break;
 	}
 	return timed_outs;
 }
@@ -560,7 +591,13 @@ Channel::Channel() :
 		next_outgoing_split_seqnum(SEQNUM_INITIAL),
 		current_packet_loss(0),
 		current_packet_too_late(0),
-		packet_loss_counter(0),
+		current_packet_successfull(0),
+		slow_start_threshold(MAX_RELIABLE_WINDOW_SIZE),
+		congestion_counter(0.0),
+		smoothed_rtt(-1.0),
+		rtt_min(FLT_MAX),
+		rtt_min_previous(FLT_MAX),
+		send_credit(MIN_RELIABLE_WINDOW_SIZE),
 		current_bytes_transfered(0),
 		current_bytes_lost(0),
 		max_kbps(0.0),
@@ -687,81 +724,68 @@ void Channel::UpdatePacketTooLateCounter()
 void Channel::UpdateTimers(float dtime)
 {
 	bpm_counter += dtime;
-	packet_loss_counter += dtime;
+	congestion_counter += dtime;
 
-	if (packet_loss_counter > 1.0)
+	float rtt;
+	float path_rtt;
 	{
-		packet_loss_counter -= 1.0;
+		JMutexAutoLock internal(m_internal_mutex);
+		rtt = smoothed_rtt;
+		path_rtt = MYMIN(rtt_min, rtt_min_previous);
+	}
 
-		unsigned int packet_loss = 11; /* use a neutral value for initialization */
-		unsigned int packets_successfull = 0;
-		unsigned int packet_too_late = 0;
+	/* adjust the window about once per round trip, the acks counted within
+	 * one round trip are what the window actually carried */
+	float interval = CC_MAX_INTERVAL;
+	if (rtt > 0)
+		interval = MYMAX(MYMIN(rtt, CC_MAX_INTERVAL), CC_MIN_INTERVAL);
 
-		bool reasonable_amount_of_data_transmitted = false;
+	if (congestion_counter >= interval)
+	{
+		congestion_counter = 0.0;
+
+		unsigned int packet_loss = 0;
+		unsigned int packets_successfull = 0;
 
 		{
 			JMutexAutoLock internal(m_internal_mutex);
 			packet_loss = current_packet_loss;
-			packet_too_late = current_packet_too_late;
 			packets_successfull = current_packet_successfull;
-
-			if (current_bytes_transfered > (window_size*512/2))
-			{
-				reasonable_amount_of_data_transmitted = true;
-			}
 			current_packet_loss = 0;
 			current_packet_too_late = 0;
 			current_packet_successfull = 0;
 		}
 
-		float successfull_to_lost_ratio = 0.0;
-		bool done = false;
+		float loss_ratio = 0.0;
+		if (packet_loss > 0)
+			loss_ratio = (float)packet_loss /
+					(float)(packet_loss + packets_successfull);
 
-		if (packets_successfull > 0) {
-			successfull_to_lost_ratio = packet_loss/packets_successfull;
-		}
-		else if (packet_loss > 0)
+		if (loss_ratio > CC_LOSS_THRESHOLD)
 		{
-			window_size = MYMAX(
-										(window_size - 10),
-										MIN_RELIABLE_WINDOW_SIZE);
-			done = true;
+			/* multiplicative decrease, stop probing above this point */
+			window_size = MYMAX(window_size / 2, MIN_RELIABLE_WINDOW_SIZE);
+			slow_start_threshold = window_size;
 		}
-
-		if (!done)
+		else if ((rtt > 0) && (path_rtt < FLT_MAX) &&
+				(rtt > path_rtt * CC_DELAY_FACTOR + CC_DELAY_MARGIN))
 		{
-			if ((successfull_to_lost_ratio < 0.01) &&
-				(window_size < MAX_RELIABLE_WINDOW_SIZE))
-			{
-				/* don't even think about increasing if we didn't even
-				 * use major parts of our window */
-				if (reasonable_amount_of_data_transmitted)
-					window_size = MYMIN(
-											(window_size + 100),
-											MAX_RELIABLE_WINDOW_SIZE);
-			}
-			else if ((successfull_to_lost_ratio < 0.05) &&
-					(window_size < MAX_RELIABLE_WINDOW_SIZE))
-			{
-				/* don't even think about increasing if we didn't even
-				 * use major parts of our window */
-				if (reasonable_amount_of_data_transmitted)
-					window_size = MYMIN(
-											(window_size + 50),
-											MAX_RELIABLE_WINDOW_SIZE);
-			}
-			else if (successfull_to_lost_ratio > 0.15)
-			{
-				window_size = MYMAX(
-											(window_size - 100),
-											MIN_RELIABLE_WINDOW_SIZE);
-			}
-			else if (successfull_to_lost_ratio > 0.1)
-			{
-				window_size = MYMAX(
-											(window_size - 50),
-											MIN_RELIABLE_WINDOW_SIZE);
-			}
+			/* acks come back late, some queue on the path is filling up:
+			 * back off gently before it starts dropping */
+			window_size = MYMAX(window_size - window_size / 8,
+					MIN_RELIABLE_WINDOW_SIZE);
+			slow_start_threshold = window_size;
+		}
+		/* don't even think about increasing if we didn't even
+		 * use major parts of our window */
+		else if (packets_successfull * 2 >= window_size)
+		{
+			if (window_size < slow_start_threshold)
+				window_size = MYMIN(window_size * 2,
+						MAX_RELIABLE_WINDOW_SIZE);
+			else
+				window_size = MYMIN(window_size + CC_ADDITIVE_INCREASE,
+						MAX_RELIABLE_WINDOW_SIZE);
 		}
 	}
 
@@ -774,6 +798,10 @@ void Channel::UpdateTimers(float dtime)
 			cur_kbps_lost = (current_bytes_lost/bpm_counter)/1024;
 			current_bytes_lost = 0;
 			bpm_counter = 0;
+
+			/* forget path minimums older than two periods, routes change */
+			rtt_min_previous = rtt_min;
+			rtt_min = FLT_MAX;
 		}
 
 		if (cur_kbps > max_kbps)
@@ -791,6 +819,46 @@ void Channel::UpdateTimers(float dtime)
 	}
 }
 
+void Channel::UpdateRTT(float rtt)
+{
+	JMutexAutoLock internal(m_internal_mutex);
+	if (smoothed_rtt < 0)
+		smoothed_rtt = rtt;
+	else
+		smoothed_rtt = smoothed_rtt * 0.875 + rtt * 0.125;
+
+	if (rtt < rtt_min)
+		rtt_min = rtt;
+}
+
+float Channel::getSendRate()
+{
+	JMutexAutoLock internal(m_internal_mutex);
+	if (smoothed_rtt < 0)
+		return -1;
+	return window_size / MYMAX(smoothed_rtt, CC_MIN_RTT);
+}
+
+void Channel::UpdateSendCredit(float dtime)
+{
+	float rate = getSendRate();
+
+	/* nothing measured yet, the window is the only limit */
+	if (rate < 0) {
+		send_credit = window_size;
+		return;
+	}
+	send_credit = MYMIN(send_credit + rate * dtime, (float)window_size);
+}
+
+bool Channel::takeSendCredit()
+{
+	if (send_credit < 1.0)
+		return false;
+	send_credit -= 1.0;
+	return true;
+}
+
 
 /*
 	Peer
@@ -894,8 +962,8 @@ void Peer::RTTStatistics(float rtt,
 		if(m_rtt.avg_rtt < 0.0)
 			m_rtt.avg_rtt  = rtt;
 		else
-			m_rtt.avg_rtt  = m_rtt.avg_rtt * (num_samples/(num_samples-1)) +
-								rtt * (1/num_samples);
+			m_rtt.avg_rtt  = m_rtt.avg_rtt * ((num_samples-1)/(float)num_samples) +
+								rtt * (1/(float)num_samples);
 
 		/* do jitter calculation */
 
@@ -916,8 +984,8 @@ void Peer::RTTStatistics(float rtt,
 		if(m_rtt.jitter_avg < 0.0)
 			m_rtt.jitter_avg  = jitter;
 		else
-			m_rtt.jitter_avg  = m_rtt.jitter_avg * (num_samples/(num_samples-1)) +
-								jitter * (1/num_samples);
+			m_rtt.jitter_avg  = m_rtt.jitter_avg * ((num_samples-1)/(float)num_samples) +
+								jitter * (1/(float)num_samples);
 
 		if (profiler_id != "")
 		{
@@ -985,7 +1053,7 @@ void UDPPeer::setNonLegacyPeer()
 	m_legacy_peer = false;
 	for(unsigned int i=0; i< CHANNEL_COUNT; i++)
 	{
-		channels->setWindowSize(g_settings->getU16("max_packets_per_iteration"));
+		channels[i].setWindowSize(g_settings->getU16("max_packets_per_iteration"));
 	}
 }
 
@@ -994,7 +1062,7 @@ void UDPPeer::reportRTT(float rtt)
 	if (rtt < 0.0) {
 		return;
 	}
-	RTTStatistics(rtt,"rudp",MAX_RELIABLE_WINDOW_SIZE*10);
+	RTTStatistics(rtt,"rudp",MIN_RELIABLE_WINDOW_SIZE);
 
 	float timeout = getStat(AVG_RTT) * RESEND_TIMEOUT_FACTOR;
 	if(timeout < RESEND_TIMEOUT_MIN)
@@ -1263,6 +1331,9 @@ void * ConnectionSendThread::Thread()
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* hand everything of this iteration to the socket */
+		flushSendBatch();
+
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
 
@@ -1433,15 +1504,38 @@ void ConnectionSendThread::runTimeouts(float dtime)
 
 void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 {
-	try{
-		m_connection->m_udpSocket.Send(packet.address, *packet.data, packet.data.getSize());
-		LOG(dout_con <<m_connection->getDesc()
-				<< " rawSend: " << packet.data.getSize() << " bytes sent" << std::endl);
-	} catch(SendFailedException &e){
-		LOG(derr_con<<m_connection->getDesc()
-				<<"Connection::rawSend(): SendFailedException: "
-				<<packet.address.serializeString()<<std::endl);
+	m_send_batch.push_back(packet);
+	if (m_send_batch.size() >= SEND_BATCH_SIZE)
+		flushSendBatch();
+}
+
+void ConnectionSendThread::flushSendBatch()
+{
+	if (m_send_batch.empty())
+		return;
+
+	UDPPacket packets[SEND_BATCH_SIZE];
+	u32 count = 0;
+	for (u32 i = 0; i < m_send_batch.size(); i++) {
+		BufferedPacket &packet = m_send_batch[i];
+		packets[count].address = packet.address;
+		packets[count].data = *packet.data;
+		packets[count].size = packet.data.getSize();
+		count++;
+
+		if (count == SEND_BATCH_SIZE || i == m_send_batch.size() - 1) {
+			int sent = m_connection->m_udpSocket.SendBatch(packets, count);
+			LOG(dout_con <<m_connection->getDesc()
+					<< " rawSend: " << sent << " packets sent" << std::endl);
+			if (sent != (int)count) {
+				LOG(derr_con<<m_connection->getDesc()
+						<<"Connection::rawSend(): failed to send "
+						<<(count - sent)<<" packets"<<std::endl);
+			}
+			count = 0;
+		}
 	}
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
@@ -1856,20 +1950,25 @@ void ConnectionSendThread::sendPackets(float dtime)
 						<< dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_commands.size()
 						<< std::endl);
 
-			while ((dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.size() > 0) &&
-					(dynamic_cast<UDPPeer*>(&peer)->channels[i].outgoing_reliables_sent.size()
-							< dynamic_cast<UDPPeer*>(&peer)->channels[i].getWindowSize())&&
-							(peer->m_increment_packets_remaining > 0))
+			/* reliables are paced by the channel's congestion window spread
+			 * over one round trip instead of the per peer packet quota */
+			Channel* channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[i]);
+			channel->UpdateSendCredit(dtime);
+
+			while ((channel->queued_reliables.size() > 0) &&
+					(channel->outgoing_reliables_sent.size()
+							< channel->getWindowSize()) &&
+					channel->takeSendCredit())
 			{
-				BufferedPacket p = dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.pop_front();
-				Channel* channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[i]);
+				BufferedPacket p = channel->queued_reliables.pop_front();
 				LOG(dout_con<<m_connection->getDesc()
 						<<" INFO: sending a queued reliable packet "
 						<<" channel: " << i
 						<<", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE+1])
 						<< std::endl);
 				sendAsPacketReliable(p,channel);
-				peer->m_increment_packets_remaining--;
+				if (peer->m_increment_packets_remaining > 0)
+					peer->m_increment_packets_remaining--;
 			}
 		}
 	}
@@ -1942,6 +2041,11 @@ ConnectionReceiveThread::ConnectionReceiveThread(Connection* parent,
 	m_connection(parent),
 	m_max_packet_size(max_packet_size)
 {
+	// use IPv6 minimum allowed MTU as receive buffer size as this is
+	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
+	// infrastructure
+	for (u32 i = 0; i < RECEIVE_BATCH_SIZE; i++)
+		m_receive_buffers.push_back(SharedBuffer<u8>(1500));
 }
 
 void * ConnectionReceiveThread::Thread()
@@ -2019,6 +2123,8 @@ void * ConnectionReceiveThread::Thread()
 						<< " AVG: " << std::setw(6) << peer->channels[j].getAvgLossRateKB() <<"kb/s"
 						<< " MAX: " << std::setw(6) << peer->channels[j].getMaxLossRateKB() <<"kb/s"
 						<< " / WS: " << peer->channels[j].getWindowSize()
+						<< " SRTT: " << peer->channels[j].getSmoothedRTT()
+						<< " RATE: " << peer->channels[j].getSendRate() << "pkt/s"
 						<< std::endl;
 				}
 
@@ -2035,11 +2141,7 @@ void * ConnectionReceiveThread::Thread()
 // Receive packets from the network and buffers and create ConnectionEvents
 void ConnectionReceiveThread::receive()
 {
-	// use IPv6 minimum allowed MTU as receive buffer size as this is
-	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
-	// infrastructure
-	unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
+	UDPPacket packets[RECEIVE_BATCH_SIZE];
 	
 	bool packet_queued = true;
 
@@ -2051,7 +2153,6 @@ void ConnectionReceiveThread::receive()
 			(m_connection->m_udpSocket.WaitData(50)))
 	{
 		loop_count++;
-	try{
 		if (packet_queued)
 		{
 			bool no_data_left = false;
@@ -2074,120 +2175,135 @@ void ConnectionReceiveThread::receive()
 			packet_queued = false;
 		}
 
-		Address sender;
-		s32 received_size = m_connection->m_udpSocket.Receive(sender, *packetdata, packet_maxsize);
-
-		if ((received_size < 0) ||
-			(received_size < BASE_HEADER_SIZE) ||
-			(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
-		{
-			LOG(derr_con<<m_connection->getDesc()
-					<<"Receive(): Invalid incoming packet, "
-					<<"size: " << received_size
-					<<", protocol: " << readU32(&packetdata[0]) <<std::endl);
-			continue;
+		/* read everything that is waiting, up to a batch */
+		for (u32 i = 0; i < RECEIVE_BATCH_SIZE; i++) {
+			packets[i].data = *m_receive_buffers[i];
+			packets[i].size = m_receive_buffers[i].getSize();
 		}
+		int count = m_connection->m_udpSocket.ReceiveBatch(packets,
+				RECEIVE_BATCH_SIZE);
 
-		u16 peer_id          = readPeerId(*packetdata);
-		u8 channelnum        = readChannel(*packetdata);
-		
-		if(channelnum > CHANNEL_COUNT-1){
-			LOG(derr_con<<m_connection->getDesc()
-					<<"Receive(): Invalid channel "<<channelnum<<std::endl);
-			throw InvalidIncomingDataException("Channel doesn't exist");
+		for (int i = 0; i < count; i++) {
+			try{
+				processReceived(packets[i].address, m_receive_buffers[i],
+						packets[i].size, packet_queued);
+			}catch(InvalidIncomingDataException &e){
+			}
+			catch(ProcessedSilentlyException &e){
+			}
 		}
-		
-		/* preserve original peer_id for later usage */
-		u16 packet_peer_id   = peer_id;
+	}
+}
 
-		/* Try to identify peer by sender address (may happen on join) */
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			peer_id = m_connection->lookupPeer(sender);
-		}
+void ConnectionReceiveThread::processReceived(Address &sender,
+		SharedBuffer<u8> &packetdata, s32 received_size, bool &packet_queued)
+{
+	if ((received_size < 0) ||
+		(received_size < BASE_HEADER_SIZE) ||
+		(readU32(&packetdata[0]) != m_connection->GetProtocolID()))
+	{
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid incoming packet, "
+				<<"size: " << received_size
+				<<", protocol: " << readU32(&packetdata[0]) <<std::endl);
+		return;
+	}
 
-		/* The peer was not found in our lists. Add it. */
-		if(peer_id == PEER_ID_INEXISTENT)
-		{
-			peer_id = m_connection->createPeer(sender,MINETEST_RELIABLE_UDP,0);
-		}
+	u16 peer_id          = readPeerId(*packetdata);
+	u8 channelnum        = readChannel(*packetdata);
+	
+	if(channelnum > CHANNEL_COUNT-1){
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Receive(): Invalid channel "<<channelnum<<std::endl);
+		throw InvalidIncomingDataException("Channel doesn't exist");
+	}
+	
+	/* preserve original peer_id for later usage */
+	u16 packet_peer_id   = peer_id;
 
-		PeerHelper peer = m_connection->getPeerNoEx(peer_id);
+	/* Try to identify peer by sender address (may happen on join) */
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		peer_id = m_connection->lookupPeer(sender);
+	}
 
-		if (!peer) {
-			LOG(dout_con<<m_connection->getDesc()
-					<<" got packet from unknown peer_id: "
-					<<peer_id<<" Ignoring."<<std::endl);
-			continue;
-		}
+	/* The peer was not found in our lists. Add it. */
+	if(peer_id == PEER_ID_INEXISTENT)
+	{
+		peer_id = m_connection->createPeer(sender,MINETEST_RELIABLE_UDP,0);
+	}
 
-		// Validate peer address
+	PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 
-		Address peer_address;
+	if (!peer) {
+		LOG(dout_con<<m_connection->getDesc()
+				<<" got packet from unknown peer_id: "
+				<<peer_id<<" Ignoring."<<std::endl);
+		return;
+	}
 
-		if (peer->getAddress(UDP,peer_address)) {
-			if (peer_address != sender) {
-				LOG(derr_con<<m_connection->getDesc()
-						<<m_connection->getDesc()
-						<<" Peer "<<peer_id<<" sending from different address."
-						" Ignoring."<<std::endl);
-				continue;
-			}
+	// Validate peer address
+
+	Address peer_address;
+
+	if (peer->getAddress(UDP,peer_address)) {
+		if (peer_address != sender) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" sending from different address."
+					" Ignoring."<<std::endl);
+			return;
 		}
-		else {
+	}
+	else {
 
-			bool invalid_address = true;
-			if (invalid_address) {
-				LOG(derr_con<<m_connection->getDesc()
-						<<m_connection->getDesc()
-						<<" Peer "<<peer_id<<" unknown."
-						" Ignoring."<<std::endl);
-				continue;
-			}
+		bool invalid_address = true;
+		if (invalid_address) {
+			LOG(derr_con<<m_connection->getDesc()
+					<<m_connection->getDesc()
+					<<" Peer "<<peer_id<<" unknown."
+					" Ignoring."<<std::endl);
+			return;
 		}
+	}
 
-		
-		/* mark peer as seen with id */
-		if (!(packet_peer_id == PEER_ID_INEXISTENT))
-			peer->setSentWithID();
+	
+	/* mark peer as seen with id */
+	if (!(packet_peer_id == PEER_ID_INEXISTENT))
+		peer->setSentWithID();
 
-		peer->ResetTimeout();
+	peer->ResetTimeout();
 
-		Channel *channel = 0;
+	Channel *channel = 0;
 
-		if (dynamic_cast<UDPPeer*>(&peer) != 0)
-		{
-			channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
-		}
-		
-		// Throw the received packet to channel->processPacket()
+	if (dynamic_cast<UDPPeer*>(&peer) != 0)
+	{
+		channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[channelnum]);
+	}
+	
+	// Throw the received packet to channel->processPacket()
 
-		// Make a new SharedBuffer from the data without the base headers
-		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-				strippeddata.getSize());
+	// Make a new SharedBuffer from the data without the base headers
+	SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
+	memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
+			strippeddata.getSize());
+	
+	try{
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata = processPacket
+				(channel, strippeddata, peer_id, channelnum, false);
 		
-		try{
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
-			
-			LOG(dout_con<<m_connection->getDesc()
-					<<" ProcessPacket from peer_id: " << peer_id
-					<< ",channel: " << (channelnum & 0xFF) << ", returned "
-					<< resultdata.getSize() << " bytes" <<std::endl);
-			
-			ConnectionEvent e;
-			e.dataReceived(peer_id, resultdata);
-			m_connection->putEvent(e);
-		}catch(ProcessedSilentlyException &e){
-		}catch(ProcessedQueued &e){
-			packet_queued = true;
-		}
-	}catch(InvalidIncomingDataException &e){
-	}
-	catch(ProcessedSilentlyException &e){
-	}
+		LOG(dout_con<<m_connection->getDesc()
+				<<" ProcessPacket from peer_id: " << peer_id
+				<< ",channel: " << (channelnum & 0xFF) << ", returned "
+				<< resultdata.getSize() << " bytes" <<std::endl);
+		
+		ConnectionEvent e;
+		e.dataReceived(peer_id, resultdata);
+		m_connection->putEvent(e);
+	}catch(ProcessedSilentlyException &e){
+	}catch(ProcessedQueued &e){
+		packet_queued = true;
 	}
 }
 
@@ -2299,6 +2415,11 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,
 					// Let peer calculate stuff according to it
 					// (avg_rtt and resend_timeout)
 					dynamic_cast<UDPPeer*>(&peer)->reportRTT(rtt);
+
+					// an ack for a re-sent packet may belong to any of
+					// its copies, only clean samples drive the window
+					if (p.resend_count == 0)
+						channel->UpdateRTT(rtt);
 				}
 				else if (p.totaltime > 0)
 				{
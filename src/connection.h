@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
 
 namespace con
 {
@@ -162,15 +163,18 @@ inline bool seqnum_in_window(u16 seqnum, u16 next,u16 window_size)
 struct BufferedPacket
 {
 	BufferedPacket(u8 *a_data, u32 a_size):
-		data(a_data, a_size), time(0.0), totaltime(0.0), absolute_send_time(-1)
+		data(a_data, a_size), time(0.0), totaltime(0.0), absolute_send_time(-1),
+		resend_count(0)
 	{}
 	BufferedPacket(u32 a_size):
-		data(a_size), time(0.0), totaltime(0.0), absolute_send_time(-1)
+		data(a_size), time(0.0), totaltime(0.0), absolute_send_time(-1),
+		resend_count(0)
 	{}
 	SharedBuffer<u8> data; // Data of the packet, including headers
 	float time; // Seconds from buffering the packet or re-sending
 	float totaltime; // Seconds from buffering the packet
 	unsigned int absolute_send_time;
+	unsigned int resend_count; // Number of times the packet was re-sent
 	Address address; // Sender or destination
 };
 
@@ -309,9 +313,11 @@ with a buffer in the receiving and transmitting end.
 /*
 	A buffer which stores reliable packets and sorts them internally
 	for fast access to the smallest one.
-*/
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+	The packets are kept in a ring indexed by seqnum modulo its capacity,
+	which grows to cover the seqnums between the oldest and the newest
+	packet. Looking a seqnum up, inserting and removing are O(1).
+*/
 
 class ReliablePacketBuffer
 {
@@ -331,21 +337,29 @@ class ReliablePacketBuffer
 	void print();
 	bool empty();
 	bool containsPacket(u16 seqnum);
-	RPBSearchResult notFound();
 	u32 size();
 
 
 private:
-	RPBSearchResult findPacket(u16 seqnum);
-
-	std::list<BufferedPacket> m_list;
-	u16 m_list_size;
-
+	BufferedPacket &slot(u16 seqnum)
+	{ return m_slots[seqnum & (m_slots.size() - 1)]; }
+	bool slotUsed(u16 seqnum)
+	{ return !m_slots.empty() && slot(seqnum).data.getSize() != 0; }
+	// Removes the packet of seqnum, which must be in the buffer
+	BufferedPacket remove(u16 seqnum);
+	// Makes the ring big enough for span seqnums
+	void reserve(u32 span);
+
+	// Size is a power of two; unused slots hold a packet of size 0
+	std::vector<BufferedPacket> m_slots;
+	BufferedPacket m_empty_slot;
+	u32 m_list_size;
+
+	// Oldest and newest seqnum in the buffer, if it is not empty
 	u16 m_oldest_non_answered_ack;
+	u16 m_newest;
 
 	JMutex m_list_mutex;
-
-	unsigned int writeptr;
 };
 
 /*
@@ -520,6 +534,23 @@ class Channel
 
 	void UpdateTimers(float dtime);
 
+	/*
+		Congestion control: feed a round trip time measured on a packet
+		that was never re-sent (Karn's rule)
+	*/
+	void UpdateRTT(float rtt);
+	/*
+		Pacing: accumulate send credit for dtime seconds at the current
+		send rate; takeSendCredit() returns false if no packet may be
+		sent right now
+	*/
+	void UpdateSendCredit(float dtime);
+	bool takeSendCredit();
+	// Packets per second the congestion window allows
+	float getSendRate();
+	float getSmoothedRTT()
+		{ JMutexAutoLock lock(m_internal_mutex); return smoothed_rtt; };
+
 	const float getCurrentDownloadRateKB()
 		{ JMutexAutoLock lock(m_internal_mutex); return cur_kbps; };
 	const float getMaxDownloadRateKB()
@@ -550,7 +581,14 @@ class Channel
 	unsigned int current_packet_loss;
 	unsigned int current_packet_too_late;
 	unsigned int current_packet_successfull;
-	float packet_loss_counter;
+
+	// congestion control state
+	unsigned int slow_start_threshold;
+	float congestion_counter;
+	float smoothed_rtt;
+	float rtt_min;
+	float rtt_min_previous;
+	float send_credit;
 
 	unsigned int current_bytes_transfered;
 	unsigned int current_bytes_lost;
@@ -791,7 +829,6 @@ class UDPPeer : public Peer
 									BufferedPacket toadd,
 									bool reliable);
 
-
 protected:
 	/*
 		Calculates avg_rtt and resend_timeout.
@@ -905,7 +942,9 @@ class ConnectionSendThread : public JThread {
 
 private:
 	void runTimeouts    (float dtime);
+	// Queues the packet into m_send_batch; sent by flushSendBatch()
 	void rawSend        (const BufferedPacket &packet);
+	void flushSendBatch ();
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data, bool reliable);
 
@@ -941,6 +980,9 @@ class ConnectionSendThread : public JThread {
 	unsigned int          m_max_commands_per_iteration;
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued;
+
+	// Packets waiting to be given to the socket at once
+	std::vector<BufferedPacket> m_send_batch;
 };
 
 class ConnectionReceiveThread : public JThread {
@@ -952,6 +994,9 @@ class ConnectionReceiveThread : public JThread {
 
 private:
 	void receive        ();
+	// Handles one datagram read from the socket
+	void processReceived(Address &sender, SharedBuffer<u8> &packetdata,
+							s32 received_size, bool &packet_queued);
 
 	// Returns next data from a buffer if possible
 	// If found, returns true; if not, false.
@@ -976,6 +1021,9 @@ class ConnectionReceiveThread : public JThread {
 
 	Connection*           m_connection;
 	unsigned int          m_max_packet_size;
+
+	// Datagrams are read from the socket into these
+	std::vector<SharedBuffer<u8> > m_receive_buffers;
 };
 
 class Connection
@@ -114,9 +114,11 @@ class TestSAO : public ServerActiveObject
 			return;
 		}
 
-		m_base_position.Y += dtime * BS * 2;
-		if(m_base_position.Y > 8*BS)
-			m_base_position.Y = 2*BS;
+		v3f pos = m_base_position;
+		pos.Y += dtime * BS * 2;
+		if(pos.Y > 8*BS)
+			pos.Y = 2*BS;
+		setBasePosition(pos);
 
 		if(send_recommended == false)
 			return;
@@ -384,7 +386,8 @@ LuaEntitySAO::LuaEntitySAO(ServerEnvironment *env, v3f pos,
 	m_animation_sent(false),
 	m_bone_position_sent(false),
 	m_attachment_parent_id(0),
-	m_attachment_sent(false)
+	m_attachment_sent(false),
+	m_physics_stepped(false)
 {
 	// Only register type if no environment supplied
 	if(env == NULL){
@@ -497,33 +500,25 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 	if(isAttached())
 	{
 		v3f pos = m_env->getActiveObject(m_attachment_parent_id)->getBasePosition();
-		m_base_position = pos;
+		setBasePosition(pos);
 		m_velocity = v3f(0,0,0);
 		m_acceleration = v3f(0,0,0);
 	}
 	else
 	{
 		if(m_prop.physical){
-			core::aabbox3d<f32> box = m_prop.collisionbox;
-			box.MinEdge *= BS;
-			box.MaxEdge *= BS;
-			collisionMoveResult moveresult;
-			f32 pos_max_d = BS*0.25; // Distance per iteration
-			v3f p_pos = m_base_position;
-			v3f p_velocity = m_velocity;
-			v3f p_acceleration = m_acceleration;
-			moveresult = collisionMoveSimple(m_env,m_env->getGameDef(),
-					pos_max_d, box, m_prop.stepheight, dtime,
-					p_pos, p_velocity, p_acceleration,
-					this, m_prop.collideWithObjects);
+			// Usually done beforehand on the object step threads
+			if(!m_physics_stepped)
+				stepPhysics(dtime);
+			m_physics_stepped = false;
 
 			// Apply results
-			m_base_position = p_pos;
-			m_velocity = p_velocity;
-			m_acceleration = p_acceleration;
+			setBasePosition(m_physics_position);
+			m_velocity = m_physics_velocity;
+			m_acceleration = m_physics_acceleration;
 		} else {
-			m_base_position += dtime * m_velocity + 0.5 * dtime
-					* dtime * m_acceleration;
+			setBasePosition(m_base_position + dtime * m_velocity + 0.5 * dtime
+					* dtime * m_acceleration);
 			m_velocity += dtime * m_acceleration;
 		}
 
@@ -594,6 +589,27 @@ void LuaEntitySAO::step(float dtime, bool send_recommended)
 	}
 }
 
+bool LuaEntitySAO::stepPhysics(float dtime)
+{
+	m_physics_stepped = false;
+	if(!m_prop.physical || isAttached())
+		return false;
+
+	core::aabbox3d<f32> box = m_prop.collisionbox;
+	box.MinEdge *= BS;
+	box.MaxEdge *= BS;
+	f32 pos_max_d = BS*0.25; // Distance per iteration
+	m_physics_position = m_base_position;
+	m_physics_velocity = m_velocity;
+	m_physics_acceleration = m_acceleration;
+	collisionMoveSimple(m_env,m_env->getGameDef(),
+			pos_max_d, box, m_prop.stepheight, dtime,
+			m_physics_position, m_physics_velocity, m_physics_acceleration,
+			this, m_prop.collideWithObjects);
+	m_physics_stepped = true;
+	return true;
+}
+
 std::string LuaEntitySAO::getClientInitializationData(u16 protocol_version)
 {
 	std::ostringstream os(std::ios::binary);
@@ -732,7 +748,8 @@ void LuaEntitySAO::setPos(v3f pos)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	m_physics_stepped = false;
+	setBasePosition(pos);
 	sendPosition(false, true);
 }
 
@@ -740,7 +757,8 @@ void LuaEntitySAO::moveTo(v3f pos, bool continuous)
 {
 	if(isAttached())
 		return;
-	m_base_position = pos;
+	m_physics_stepped = false;
+	setBasePosition(pos);
 	if(!continuous)
 		sendPosition(true, true);
 }
@@ -807,6 +825,7 @@ void LuaEntitySAO::setAttachment(int parent_id, std::string bone, v3f position,
 	m_attachment_position = position;
 	m_attachment_rotation = rotation;
 	m_attachment_sent = false;
+	m_physics_stepped = false;
 }
 
 ObjectProperties* LuaEntitySAO::accessObjectProperties()
@@ -817,11 +836,13 @@ ObjectProperties* LuaEntitySAO::accessObjectProperties()
 void LuaEntitySAO::notifyObjectPropertiesModified()
 {
 	m_properties_sent = false;
+	m_physics_stepped = false;
 }
 
 void LuaEntitySAO::setVelocity(v3f velocity)
 {
 	m_velocity = velocity;
+	m_physics_stepped = false;
 }
 
 v3f LuaEntitySAO::getVelocity()
@@ -832,6 +853,7 @@ v3f LuaEntitySAO::getVelocity()
 void LuaEntitySAO::setAcceleration(v3f acceleration)
 {
 	m_acceleration = acceleration;
+	m_physics_stepped = false;
 }
 
 v3f LuaEntitySAO::getAcceleration()
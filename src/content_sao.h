@@ -48,6 +48,7 @@ class LuaEntitySAO : public ServerActiveObject
 			const std::string &data);
 	bool isAttached();
 	void step(float dtime, bool send_recommended);
+	bool stepPhysics(float dtime);
 	std::string getClientInitializationData(u16 protocol_version);
 	std::string getStaticData();
 	int punch(v3f dir,
@@ -116,6 +117,13 @@ class LuaEntitySAO : public ServerActiveObject
 	v3f m_attachment_position;
 	v3f m_attachment_rotation;
 	bool m_attachment_sent;
+
+	// Result of stepPhysics(), valid until step() or until the state it
+	// was calculated from is changed
+	bool m_physics_stepped;
+	v3f m_physics_position;
+	v3f m_physics_velocity;
+	v3f m_physics_acceleration;
 };
 
 /*
@@ -31,6 +31,7 @@ Dummy "database" class
 #include "main.h"
 #include "settings.h"
 #include "log.h"
+#include "jthread/jmutexautolock.h"
 
 Database_Dummy::Database_Dummy(ServerMap *map)
 {
@@ -73,80 +74,22 @@ void Database_Dummy::saveBlock(MapBlock *block)
 	// Write block to database
 	std::string tmp = o.str();
 
-	m_database[getBlockAsInteger(p3d)] = tmp;
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_database[getBlockAsInteger(p3d)] = tmp;
+	}
 	// We just wrote it to the disk so clear modified flag
 	block->resetModified();
 }
 
-MapBlock* Database_Dummy::loadBlock(v3s16 blockpos)
+std::string Database_Dummy::loadBlock(v3s16 blockpos)
 {
-	v2s16 p2d(blockpos.X, blockpos.Z);
-
-        if(m_database.count(getBlockAsInteger(blockpos))) {
-                /*
-                        Make sure sector is loaded
-                */
-                MapSector *sector = srvmap->createSector(p2d);
-                /*
-                        Load block
-                */
-                std::string datastr = m_database[getBlockAsInteger(blockpos)];
-//                srvmap->loadBlock(&datastr, blockpos, sector, false);
-
-		try {
-                	std::istringstream is(datastr, std::ios_base::binary);
-                   	u8 version = SER_FMT_VER_INVALID;
-                     	is.read((char*)&version, 1);
-
-                     	if(is.fail())
-                             	throw SerializationError("ServerMap::loadBlock(): Failed"
-                                	             " to read MapBlock version");
-
-                     	MapBlock *block = NULL;
-                     	bool created_new = false;
-                     	block = sector->getBlockNoCreateNoEx(blockpos.Y);
-                     	if(block == NULL)
-                     	{
-                             	block = sector->createBlankBlockNoInsert(blockpos.Y);
-                             	created_new = true;
-                     	}
-                     	// Read basic data
-                     	block->deSerialize(is, version, true);
-                     	// If it's a new block, insert it to the map
-                     	if(created_new)
-                             	sector->insertBlock(block);
-                     	/*
-                             	Save blocks loaded in old format in new format
-                     	*/
-
-                     	//if(version < SER_FMT_VER_HIGHEST || save_after_load)
-                     	// Only save if asked to; no need to update version
-                     	//if(save_after_load)
-                        //     	saveBlock(block);
-                     	// We just loaded it from, so it's up-to-date.
-                     	block->resetModified();
-
-             	}
-             	catch(SerializationError &e)
-             	{
-                     	errorstream<<"Invalid block data in database"
-                                     <<" ("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<")"
-                                     <<" (SerializationError): "<<e.what()<<std::endl;
-                     // TODO: Block should be marked as invalid in memory so that it is
-                     // not touched but the game can run
-
-                     	if(g_settings->getBool("ignore_world_load_errors")){
-                             errorstream<<"Ignoring block load error. Duck and cover! "
-                                             <<"(ignore_world_load_errors)"<<std::endl;
-                     	} else {
-                             throw SerializationError("Invalid block data in database");
-                             //assert(0);
-                     	}
-             	}
-
-                return srvmap->getBlockNoCreateNoEx(blockpos);  // should not be using this here
-        }
-	return(NULL);
+	JMutexAutoLock lock(m_mutex);
+	std::map<unsigned long long, std::string>::iterator i =
+			m_database.find(getBlockAsInteger(blockpos));
+	if(i == m_database.end())
+		return "";
+	return i->second;
 }
 
 void Database_Dummy::listAllLoadableBlocks(std::list<v3s16> &dst)
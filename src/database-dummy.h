@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_DUMMY_HEADER
 
 #include "database.h"
+#include "jthread/jmutex.h"
 #include <map>
 #include <string>
 
@@ -33,12 +34,14 @@ class Database_Dummy : public Database
 	virtual void beginSave();
 	virtual void endSave();
         virtual void saveBlock(MapBlock *block);
-        virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual std::string loadBlock(v3s16 blockpos);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_Dummy();
 private:
 	ServerMap *srvmap;
 	std::map<unsigned long long, std::string> m_database;
+	// Guards m_database against loadBlock() from other threads
+	JMutex m_mutex;
 };
 #endif
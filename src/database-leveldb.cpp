@@ -35,6 +35,7 @@ LevelDB databases
 #include "main.h"
 #include "settings.h"
 #include "log.h"
+#include <algorithm>
 
 Database_LevelDB::Database_LevelDB(ServerMap *map, std::string savedir)
 {
@@ -87,14 +88,15 @@ void Database_LevelDB::saveBlock(MapBlock *block)
 	block->resetModified();
 }
 
-MapBlock* Database_LevelDB::loadBlock(v3s16 blockpos)
+std::string Database_LevelDB::loadBlock(v3s16 blockpos)
 {
-	v2s16 p2d(blockpos.X, blockpos.Z);
-
 	std::string datastr;
 	leveldb::Status s = m_database->Get(leveldb::ReadOptions(),
 		i64tos(getBlockAsInteger(blockpos)), &datastr);
-	if (datastr.length() == 0 && s.ok()) {
+	if (!s.ok())
+		return "";
+
+	if (datastr.length() == 0) {
 		errorstream << "Blank block data in database (datastr.length() == 0) ("
 			<< blockpos.X << "," << blockpos.Y << "," << blockpos.Z << ")" << std::endl;
 
@@ -104,70 +106,51 @@ MapBlock* Database_LevelDB::loadBlock(v3s16 blockpos)
 		} else {
 			throw SerializationError("Blank block data in database");
 		}
-		return NULL;
 	}
 
-	if (s.ok()) {
-		/*
-			Make sure sector is loaded
-		*/
-		MapSector *sector = srvmap->createSector(p2d);
-
-		try {
-			std::istringstream is(datastr, std::ios_base::binary);
-			u8 version = SER_FMT_VER_INVALID;
-			is.read((char *)&version, 1);
-
-			if (is.fail())
-				throw SerializationError("ServerMap::loadBlock(): Failed"
-					" to read MapBlock version");
-
-			MapBlock *block = NULL;
-			bool created_new = false;
-			block = sector->getBlockNoCreateNoEx(blockpos.Y);
-			if (block == NULL)
-			{
-				block = sector->createBlankBlockNoInsert(blockpos.Y);
-				created_new = true;
-			}
+	return datastr;
+}
 
-			// Read basic data
-			block->deSerialize(is, version, true);
-
-			// If it's a new block, insert it to the map
-			if (created_new)
-				sector->insertBlock(block);
-
-			/*
-				Save blocks loaded in old format in new format
-			*/
-			//if(version < SER_FMT_VER_HIGHEST || save_after_load)
-			// Only save if asked to; no need to update version
-			//if(save_after_load)
-			//     	saveBlock(block);
-			// We just loaded it from, so it's up-to-date.
-			block->resetModified();
-		}
-		catch (SerializationError &e)
-		{
-			errorstream << "Invalid block data in database"
-				<< " (" << blockpos.X << "," << blockpos.Y << "," << blockpos.Z
-				<< ") (SerializationError): " << e.what() << std::endl;
-			// TODO: Block should be marked as invalid in memory so that it is
-			// not touched but the game can run
+void Database_LevelDB::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> &dst)
+{
+	dst.clear();
+	dst.resize(positions.size());
+
+	/*
+		Seek a single iterator through the keys in their stored order,
+		instead of doing a separate lookup for each block
+	*/
+	std::vector<std::pair<std::string, u32> > keys;
+	keys.reserve(positions.size());
+	for (u32 i = 0; i < positions.size(); i++)
+		keys.push_back(std::make_pair(
+				i64tos(getBlockAsInteger(positions[i])), i));
+	std::sort(keys.begin(), keys.end());
+
+	leveldb::Iterator* it = m_database->NewIterator(leveldb::ReadOptions());
+	for (u32 k = 0; k < keys.size(); k++) {
+		it->Seek(keys[k].first);
+		if (!it->Valid() || it->key().ToString() != keys[k].first)
+			continue;
+
+		u32 i = keys[k].second;
+		dst[i] = it->value().ToString();
+		if (dst[i].empty()) {
+			v3s16 p = positions[i];
+			errorstream << "Blank block data in database (datastr.length() == 0) ("
+				<< p.X << "," << p.Y << "," << p.Z << ")" << std::endl;
 
 			if (g_settings->getBool("ignore_world_load_errors")) {
 				errorstream << "Ignoring block load error. Duck and cover! "
 					<< "(ignore_world_load_errors)" << std::endl;
 			} else {
-				throw SerializationError("Invalid block data in database");
-				//assert(0);
+				delete it;
+				throw SerializationError("Blank block data in database");
 			}
 		}
-
-		return srvmap->getBlockNoCreateNoEx(blockpos);  // should not be using this here
 	}
-	return NULL;
+	delete it;
 }
 
 void Database_LevelDB::listAllLoadableBlocks(std::list<v3s16> &dst)
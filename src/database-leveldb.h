@@ -37,7 +37,9 @@ class Database_LevelDB : public Database
 	virtual void beginSave();
 	virtual void endSave();
         virtual void saveBlock(MapBlock *block);
-        virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual std::string loadBlock(v3s16 blockpos);
+        virtual void loadBlocks(const std::vector<v3s16> &positions,
+                        std::vector<std::string> &dst);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_LevelDB();
@@ -44,15 +44,74 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "settings.h"
 #include "log.h"
+#include "profiler.h"
+#include "debug.h"
+#include "util/timetaker.h"
+#include "jthread/jmutexautolock.h"
+#include "jthread/jthread.h"
+#include <algorithm>
+
+// How often the writer commits queued blocks when it isn't woken up
+#define SQLITE_WRITE_INTERVAL_MS 1000
+
+class Database_SQLite3Writer : public JThread
+{
+	Database_SQLite3 *m_db;
+
+public:
+	// Posted to make the writer flush the queue now
+	JSemaphore event;
+
+	Database_SQLite3Writer(Database_SQLite3 *db):
+		JThread(),
+		m_db(db)
+	{
+	}
+
+	void * Thread();
+};
+
+void * Database_SQLite3Writer::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("Database_SQLite3Writer");
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(!StopRequested())
+	{
+		event.Wait(SQLITE_WRITE_INTERVAL_MS);
+		m_db->flushWriteQueue();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
 
 Database_SQLite3::Database_SQLite3(ServerMap *map, std::string savedir)
 {
 	m_database = NULL;
 	m_database_read = NULL;
+	m_database_read_range = NULL;
 	m_database_write = NULL;
 	m_database_list = NULL;
 	m_savedir = savedir;
 	srvmap = map;
+
+	m_writer = NULL;
+	m_writer_woken = false;
+	m_queue_waiters = 0;
+	m_write_queue_size = MYMAX(g_settings->getS32("sqlite_write_queue_size"), 0);
+	if(m_write_queue_size != 0)
+	{
+		m_writer = new Database_SQLite3Writer(this);
+		m_writer->Start();
+	}
 }
 
 int Database_SQLite3::Initialized(void)
@@ -61,12 +120,23 @@ int Database_SQLite3::Initialized(void)
 }
 
 void Database_SQLite3::beginSave() {
+	// The writer makes its own transactions
+	if(m_writer)
+		return;
+	JMutexAutoLock lock(m_mutex);
 	verifyDatabase();
 	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
 		infostream<<"WARNING: beginSave() failed, saving might be slow.";
 }
 
 void Database_SQLite3::endSave() {
+	// Don't wait for the next interval to write the saved blocks
+	if(m_writer)
+	{
+		m_writer->event.Post();
+		return;
+	}
+	JMutexAutoLock lock(m_mutex);
 	verifyDatabase();
 	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
 		infostream<<"WARNING: endSave() failed, map might not have saved.";
@@ -124,6 +194,12 @@ void Database_SQLite3::verifyDatabase() {
 			throw FileNotGoodException("Cannot prepare read statement");
 		}
 		
+		d = sqlite3_prepare(m_database, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &m_database_read_range, NULL);
+		if(d != SQLITE_OK) {
+			infostream<<"WARNING: SQLite3 database range read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare read statement");
+		}
+		
 		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
 		if(d != SQLITE_OK) {
 			infostream<<"WARNING: SQLite3 database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
@@ -176,8 +252,6 @@ void Database_SQLite3::saveBlock(MapBlock *block)
 		[1] data
 	*/
 	
-	verifyDatabase();
-	
 	std::ostringstream o(std::ios_base::binary);
 	
 	o.write((char*)&version, 1);
@@ -188,26 +262,142 @@ void Database_SQLite3::saveBlock(MapBlock *block)
 	// Write block to database
 	
 	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+	s64 pos = getBlockAsInteger(p3d);
+
+	// We just wrote it to the disk (or the queue) so clear modified flag
+	block->resetModified();
+
+	if(m_writer == NULL)
+	{
+		JMutexAutoLock lock(m_mutex);
+		verifyDatabase();
+		writeBlock(pos, tmp);
+		return;
+	}
+
+	for(;;)
+	{
+		bool queued = false;
+		bool wake = false;
+		{
+			JMutexAutoLock queuelock(m_queue_mutex);
+			if(m_write_queue.size() < m_write_queue_size ||
+					m_write_queue.count(pos))
+			{
+				m_write_queue[pos].swap(tmp);
+				queued = true;
+				// Wake the writer once the queue is half full
+				if(!m_writer_woken &&
+						m_write_queue.size() >= m_write_queue_size / 2)
+				{
+					m_writer_woken = true;
+					wake = true;
+				}
+			}
+			else
+			{
+				m_queue_waiters++;
+			}
+		}
+		if(wake)
+			m_writer->event.Post();
+		if(queued)
+			return;
+
+		// The writer is falling behind. Wait for it to take the queue
+		// instead of writing it on this thread, which usually holds the
+		// environment lock.
+		TimeTaker timer("Database_SQLite3::saveBlock() waiting");
+		m_writer->event.Post();
+		m_queue_taken.Wait();
+		g_profiler->avg("SQLite3: wait for full queue (ms)",
+				timer.stop(true));
+	}
+}
+
+void Database_SQLite3::writeBlock(s64 pos, const std::string &data)
+{
+	if(sqlite3_bind_int64(m_database_write, 1, pos) != SQLITE_OK)
 		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK)
 		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
 	int written = sqlite3_step(m_database_write);
 	if(written != SQLITE_DONE)
+	{
+		v3s16 p3d = getIntegerAsBlock(pos);
 		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
 		<<sqlite3_errmsg(m_database)<<std::endl;
+	}
 	// Make ready for later reuse
 	sqlite3_reset(m_database_write);
-	
-	// We just wrote it to the disk so clear modified flag
-	block->resetModified();
 }
 
-MapBlock* Database_SQLite3::loadBlock(v3s16 blockpos)
+void Database_SQLite3::flushWriteQueue()
 {
-	v2s16 p2d(blockpos.X, blockpos.Z);
+	/*
+		m_mutex is held for the whole flush so that two flushes can't
+		write different versions of a block in the wrong order.
+	*/
+	JMutexAutoLock lock(m_mutex);
+
+	{
+		JMutexAutoLock queuelock(m_queue_mutex);
+		if(m_write_queue.empty())
+			return;
+		m_writing.swap(m_write_queue);
+		m_writer_woken = false;
+		for(; m_queue_waiters != 0; m_queue_waiters--)
+			m_queue_taken.Post();
+	}
+
+	TimeTaker timer("Database_SQLite3::flushWriteQueue()");
+
+	verifyDatabase();
+
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: flushWriteQueue() failed to begin transaction,"
+				<<" saving might be slow."<<std::endl;
+
+	for(std::map<s64, std::string>::iterator
+			i = m_writing.begin(); i != m_writing.end(); ++i)
+		writeBlock(i->first, i->second);
+
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: flushWriteQueue() failed to commit,"
+				<<" map might not have saved."<<std::endl;
+
+	u32 count;
+	{
+		// Blocks are committed; loadBlock() can read them from the database
+		JMutexAutoLock queuelock(m_queue_mutex);
+		count = m_writing.size();
+		m_writing.clear();
+	}
+
+	u32 flush_ms = timer.stop(true);
+	g_profiler->avg("SQLite3: flush time (ms)", flush_ms);
+	g_profiler->avg("SQLite3: blocks per flush", count);
+	verbosestream<<"Database_SQLite3: wrote "<<count<<" blocks in "
+			<<flush_ms<<"ms"<<std::endl;
+}
+
+std::string Database_SQLite3::loadBlock(v3s16 blockpos)
+{
+	if(m_writer)
+	{
+		// The newest version may not have been written yet
+		s64 pos = getBlockAsInteger(blockpos);
+		JMutexAutoLock queuelock(m_queue_mutex);
+		std::map<s64, std::string>::iterator i = m_write_queue.find(pos);
+		if(i != m_write_queue.end())
+			return i->second;
+		i = m_writing.find(pos);
+		if(i != m_writing.end())
+			return i->second;
+	}
+
+	JMutexAutoLock lock(m_mutex);
+
 	verifyDatabase();
 
 	if (sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK) {
@@ -215,98 +405,124 @@ MapBlock* Database_SQLite3::loadBlock(v3s16 blockpos)
 			<< sqlite3_errmsg(m_database)<<std::endl;
 	}
 
-	if (sqlite3_step(m_database_read) == SQLITE_ROW) {
-		/*
-			Make sure sector is loaded
-		*/
-		MapSector *sector = srvmap->createSector(p2d);
+	if (sqlite3_step(m_database_read) != SQLITE_ROW) {
+		sqlite3_reset(m_database_read);
+		return "";
+	}
 
-		/*
-			Load block
-		*/
-		const char *data = (const char *)sqlite3_column_blob(m_database_read, 0);
-		size_t len = sqlite3_column_bytes(m_database_read, 0);
-		if (data == NULL || len == 0) {
-			errorstream << "Blank block data in database (data == NULL || len"
-				" == 0) (" << blockpos.X << "," << blockpos.Y << ","
-				<< blockpos.Z << ")" << std::endl;
-
-			if (g_settings->getBool("ignore_world_load_errors")) {
-				errorstream << "Ignoring block load error. Duck and cover! "
-					<< "(ignore_world_load_errors)" << std::endl;
-			} else {
-				throw SerializationError("Blank block data in database");
-			}
-			return NULL;
-		}
+	const char *data = (const char *)sqlite3_column_blob(m_database_read, 0);
+	size_t len = sqlite3_column_bytes(m_database_read, 0);
+	std::string datastr;
+	if (data != NULL)
+		datastr.assign(data, len);
+
+	sqlite3_step(m_database_read);
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
 
-		std::string datastr(data, len);
+	if (datastr.empty()) {
+		errorstream << "Blank block data in database (data == NULL || len"
+			" == 0) (" << blockpos.X << "," << blockpos.Y << ","
+			<< blockpos.Z << ")" << std::endl;
 
-		//srvmap->loadBlock(&datastr, blockpos, sector, false);
+		if (g_settings->getBool("ignore_world_load_errors")) {
+			errorstream << "Ignoring block load error. Duck and cover! "
+				<< "(ignore_world_load_errors)" << std::endl;
+		} else {
+			throw SerializationError("Blank block data in database");
+		}
+	}
 
-		try {
-			std::istringstream is(datastr, std::ios_base::binary);
+	return datastr;
+}
 
-			u8 version = SER_FMT_VER_INVALID;
-			is.read((char *)&version, 1);
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> &dst)
+{
+	dst.clear();
+	dst.resize(positions.size());
 
-			if (is.fail())
-				throw SerializationError("ServerMap::loadBlock(): Failed"
-					 " to read MapBlock version");
+	// Positions to read from the database and their indices in dst
+	std::vector<std::pair<s64, u32> > keys;
+	keys.reserve(positions.size());
 
-			MapBlock *block = NULL;
-			bool created_new = false;
-			block = sector->getBlockNoCreateNoEx(blockpos.Y);
-			if (block == NULL)
-			{
-				block = sector->createBlankBlockNoInsert(blockpos.Y);
-				created_new = true;
+	{
+		JMutexAutoLock queuelock(m_queue_mutex);
+		for(u32 i = 0; i < positions.size(); i++)
+		{
+			s64 pos = getBlockAsInteger(positions[i]);
+			// The newest version may not have been written yet
+			std::map<s64, std::string>::iterator n = m_write_queue.find(pos);
+			if(n != m_write_queue.end()) {
+				dst[i] = n->second;
+				continue;
 			}
+			n = m_writing.find(pos);
+			if(n != m_writing.end()) {
+				dst[i] = n->second;
+				continue;
+			}
+			keys.push_back(std::make_pair(pos, i));
+		}
+	}
 
-			// Read basic data
-			block->deSerialize(is, version, true);
+	if(keys.empty())
+		return;
 
-			// If it's a new block, insert it to the map
-			if (created_new)
-				sector->insertBlock(block);
+	/*
+		Blocks next to each other along X have consecutive keys, so a
+		mapchunk is read with one range query per row of blocks.
+	*/
+	std::sort(keys.begin(), keys.end());
+
+	JMutexAutoLock lock(m_mutex);
 
-			/*
-				Save blocks loaded in old format in new format
-			*/
-			//if(version < SER_FMT_VER_HIGHEST || save_after_load)
-			// Only save if asked to; no need to update version
-			//if(save_after_load)
-			//     	saveBlock(block);
+	verifyDatabase();
 
-			// We just loaded it from, so it's up-to-date.
-			block->resetModified();
+	u32 run_start = 0;
+	while(run_start < keys.size())
+	{
+		u32 run_end = run_start + 1;
+		while(run_end < keys.size() &&
+				keys[run_end].first == keys[run_end - 1].first + 1)
+			run_end++;
+
+		s64 min = keys[run_start].first;
+		if(sqlite3_bind_int64(m_database_read_range, 1, min) != SQLITE_OK ||
+				sqlite3_bind_int64(m_database_read_range, 2,
+				keys[run_end - 1].first) != SQLITE_OK) {
+			infostream << "WARNING: Could not bind block range for load: "
+				<< sqlite3_errmsg(m_database)<<std::endl;
 		}
-		catch (SerializationError &e)
+
+		while(sqlite3_step(m_database_read_range) == SQLITE_ROW)
 		{
-			errorstream << "Invalid block data in database"
-				<< " (" << blockpos.X << "," << blockpos.Y << "," << blockpos.Z << ")"
-				<< " (SerializationError): " << e.what() << std::endl;
-
-			// TODO: Block should be marked as invalid in memory so that it is
-			// not touched but the game can run
-
-			if (g_settings->getBool("ignore_world_load_errors")) {
-				errorstream << "Ignoring block load error. Duck and cover! "
-					<< "(ignore_world_load_errors)" << std::endl;
-			} else {
-				throw SerializationError("Invalid block data in database");
-				//assert(0);
+			s64 pos = sqlite3_column_int64(m_database_read_range, 0);
+			const char *data = (const char *)
+					sqlite3_column_blob(m_database_read_range, 1);
+			size_t len = sqlite3_column_bytes(m_database_read_range, 1);
+			u32 i = keys[run_start + (pos - min)].second;
+			if(data != NULL)
+				dst[i].assign(data, len);
+
+			if(dst[i].empty()) {
+				v3s16 p = positions[i];
+				errorstream << "Blank block data in database (data == NULL || len"
+					" == 0) (" << p.X << "," << p.Y << "," << p.Z << ")" << std::endl;
+
+				if (g_settings->getBool("ignore_world_load_errors")) {
+					errorstream << "Ignoring block load error. Duck and cover! "
+						<< "(ignore_world_load_errors)" << std::endl;
+				} else {
+					sqlite3_reset(m_database_read_range);
+					throw SerializationError("Blank block data in database");
+				}
 			}
 		}
+		sqlite3_reset(m_database_read_range);
 
-		sqlite3_step(m_database_read);
-		// We should never get more than 1 row, so ok to reset
-		sqlite3_reset(m_database_read);
-
-		return srvmap->getBlockNoCreateNoEx(blockpos);  // should not be using this here
+		run_start = run_end;
 	}
-	sqlite3_reset(m_database_read);
-	return NULL;
 }
 
 void Database_SQLite3::createDatabase()
@@ -328,6 +544,10 @@ void Database_SQLite3::createDatabase()
 
 void Database_SQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
 {
+	flushWriteQueue();
+
+	JMutexAutoLock lock(m_mutex);
+
 	verifyDatabase();
 	
 	while(sqlite3_step(m_database_list) == SQLITE_ROW)
@@ -341,8 +561,21 @@ void Database_SQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
 
 Database_SQLite3::~Database_SQLite3()
 {
+	if(m_writer)
+	{
+		m_writer->Stop();
+		m_writer->event.Post();
+		m_writer->Wait();
+		delete m_writer;
+		m_writer = NULL;
+	}
+	// Write what the writer didn't get to
+	flushWriteQueue();
+
 	if(m_database_read)
 		sqlite3_finalize(m_database_read);
+	if(m_database_read_range)
+		sqlite3_finalize(m_database_read_range);
 	if(m_database_write)
 		sqlite3_finalize(m_database_write);
 	if(m_database)
@@ -21,13 +21,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_SQLITE3_HEADER
 
 #include "database.h"
+#include "jthread/jmutex.h"
+#include "jthread/jsemaphore.h"
 #include <string>
+#include <map>
 
 extern "C" {
 	#include "sqlite3.h"
 }
 
 class ServerMap;
+class Database_SQLite3Writer;
 
 class Database_SQLite3 : public Database
 {
@@ -37,7 +41,9 @@ class Database_SQLite3 : public Database
         virtual void endSave();
 
         virtual void saveBlock(MapBlock *block);
-        virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual std::string loadBlock(v3s16 blockpos);
+        virtual void loadBlocks(const std::vector<v3s16> &positions,
+                        std::vector<std::string> &dst);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_SQLite3();
@@ -46,8 +52,44 @@ class Database_SQLite3 : public Database
 	std::string m_savedir;
 	sqlite3 *m_database;
 	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_read_range;
 	sqlite3_stmt *m_database_write;
 	sqlite3_stmt *m_database_list;
+	/*
+		Guards the connection and the statements, as loadBlock() is
+		called from the emerge threads
+	*/
+	JMutex m_mutex;
+
+	/*
+		Unless sqlite_write_queue_size is 0, saveBlock() only serializes
+		the block and queues it. The blocks are written by m_writer in
+		one transaction per flush.
+
+		m_write_queue holds the blocks waiting to be written and
+		m_writing the ones being written by flushWriteQueue(). Both are
+		keyed by block position and guarded by m_queue_mutex, as are
+		m_writer_woken and m_queue_waiters.
+	*/
+	friend class Database_SQLite3Writer;
+	Database_SQLite3Writer *m_writer;
+	JMutex m_queue_mutex;
+	std::map<s64, std::string> m_write_queue;
+	std::map<s64, std::string> m_writing;
+	u32 m_write_queue_size;
+	// Whether the writer has been woken up for the current queue
+	bool m_writer_woken;
+	/*
+		Number of saveBlock() calls waiting for the writer to take a full
+		queue; flushWriteQueue() posts m_queue_taken for each of them
+	*/
+	u32 m_queue_waiters;
+	JSemaphore m_queue_taken;
+
+	// Write all queued blocks in a single transaction
+	void flushWriteQueue();
+	// Write a serialized block; m_mutex must be locked
+	void writeBlock(s64 pos, const std::string &data);
 
 	// Create the database structure
 	void createDatabase();
@@ -36,6 +36,14 @@ static s64 pythonmodulo(s64 i, s64 mod)
 	return mod - ((-i) % mod);
 }
 
+void Database::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> &dst)
+{
+	dst.resize(positions.size());
+	for(u32 i = 0; i < positions.size(); i++)
+		dst[i] = loadBlock(positions[i]);
+}
+
 long long Database::getBlockAsInteger(const v3s16 pos) {
 	return (unsigned long long)pos.Z*16777216 +
 		(unsigned long long)pos.Y*4096 + 
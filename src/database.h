@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_HEADER
 
 #include <list>
+#include <string>
+#include <vector>
 #include "irr_v3d.h"
 
 class MapBlock;
@@ -32,7 +34,19 @@ class Database
 	virtual void endSave()=0;
 
 	virtual void saveBlock(MapBlock *block)=0;
-	virtual MapBlock* loadBlock(v3s16 blockpos)=0;
+	/*
+		Returns the block as stored by saveBlock(), or an empty string if
+		it isn't in the database.
+		Unlike the other methods, this can be called from any thread.
+	*/
+	virtual std::string loadBlock(v3s16 blockpos)=0;
+	/*
+		Loads many blocks at once; dst[i] is set like loadBlock() would
+		return for positions[i]. Backends override this to avoid one
+		query per block.
+	*/
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> &dst);
 	long long getBlockAsInteger(const v3s16 pos);
 	v3s16 getIntegerAsBlock(long long i);
 	virtual void listAllLoadableBlocks(std::list<v3s16> &dst)=0;
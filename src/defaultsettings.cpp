@@ -212,6 +212,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("max_objects_per_block", "49");
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("sqlite_write_queue_size", "2048");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("ignore_world_load_errors", "false");
@@ -223,7 +224,10 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_total", "256");
 	settings->setDefault("emergequeue_limit_diskonly", "32");
 	settings->setDefault("emergequeue_limit_generate", "32");
+	settings->setDefault("emergequeue_cancel_distance", "12");
 	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("abm_scan_threads", "0");
+	settings->setDefault("object_step_threads", "0");
 	
 	// physics stuff
 	settings->setDefault("movement_acceleration_default", "3");
@@ -242,6 +246,7 @@ void set_default_settings(Settings *settings)
 	//liquid stuff
 	settings->setDefault("liquid_finite", "false");
 	settings->setDefault("liquid_loop_max", "10000");
+	settings->setDefault("liquid_threads", "0");
 	settings->setDefault("liquid_update", "1.0");
 	settings->setDefault("liquid_relax", "2");
 	settings->setDefault("liquid_fast_flood", "1");
@@ -58,7 +58,6 @@ class EmergeThread : public JThread
 	int id;
 
 	Event qevent;
-	std::queue<v3s16> blockqueue;
 
 	EmergeThread(Server *server, int ethreadid):
 		JThread(),
@@ -75,6 +74,9 @@ class EmergeThread : public JThread
 	bool popBlockEmerge(v3s16 *pos, u8 *flags);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b,
 			BlockMakeData *data, bool allow_generate);
+	void finishChunks();
+	void finishChunkBatch(std::vector<BlockMakeData *> &chunks,
+			std::map<v3s16, MapBlock *> &modified_blocks);
 };
 
 
@@ -96,6 +98,7 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 	// This is because the *only* thread ever starting or stopping
 	// EmergeThreads should be the ServerThread.
 	this->threads_active = false;
+	this->finishing_chunks = false;
 
 	mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
@@ -113,6 +116,14 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 	if (!g_settings->getU16NoEx("emergequeue_limit_generate", qlimit_generate))
 		qlimit_generate = nthreads + 1;
 
+	// Never cancel what the clients are still going to ask for, with some
+	// slack for them moving between position updates
+	qcancel_distance = g_settings->getS16("emergequeue_cancel_distance");
+	s16 qwanted_distance = MYMAX(
+			g_settings->getS16("max_block_send_distance"),
+			g_settings->getS16("max_block_generate_distance"));
+	qcancel_distance = MYMAX(qcancel_distance, qwanted_distance + 2);
+
 	// don't trust user input for something very important like this
 	if (qlimit_total < 1)
 		qlimit_total = 1;
@@ -136,11 +147,18 @@ EmergeManager::~EmergeManager() {
 			emergethread[i]->Wait();
 		}
 		delete emergethread[i];
-		delete mapgen[i];
 	}
 	emergethread.clear();
+
+	// The mapgens are only created by initMapgens()
+	for (unsigned int i = 0; i != mapgen.size(); i++)
+		delete mapgen[i];
 	mapgen.clear();
 
+	for (unsigned int i = 0; i < chunks_to_finish.size(); i++)
+		delete chunks_to_finish[i];
+	chunks_to_finish.clear();
+
 	for (unsigned int i = 0; i < ores.size(); i++)
 		delete ores[i];
 	ores.clear();
@@ -248,7 +266,6 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 	BlockEmergeData *bedata;
 	u16 count;
 	u8 flags = 0;
-	int idx = 0;
 
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
@@ -269,31 +286,68 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 		if (iter != blocks_enqueued.end()) {
 			bedata = iter->second;
 			bedata->flags |= flags;
+			if (bedata->peers_requested.insert(peer_id).second)
+				peer_queue_count[peer_id] = count + 1;
 			return true;
 		}
 
 		bedata = new BlockEmergeData;
 		bedata->flags = flags;
-		bedata->peer_requested = peer_id;
+		bedata->peers_requested.insert(peer_id);
+		bedata->time_enqueued = porting::getTimeMs();
 		blocks_enqueued.insert(std::make_pair(p, bedata));
 
 		peer_queue_count[peer_id] = count + 1;
+	}
 
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
-			}
-		}
+	// The queue is shared; wake every thread so that an idle one picks the
+	// request up instead of it waiting for a busy one
+	for (unsigned int i = 0; i != emergethread.size(); i++)
+		emergethread[i]->qevent.signal();
 
-		emergethread[idx]->blockqueue.push(p);
+	return true;
+}
+
+
+void EmergeManager::setPeerPosition(u16 peer_id, v3s16 blockpos) {
+	JMutexAutoLock queuelock(queuemutex);
+	peer_positions[peer_id] = blockpos;
+}
+
+
+void EmergeManager::removePeer(u16 peer_id) {
+	JMutexAutoLock queuelock(queuemutex);
+
+	peer_positions.erase(peer_id);
+
+	// Blocks only this peer asked for are not going to be wanted soon;
+	// the others stay queued for the peers that merged into them
+	std::map<v3s16, BlockEmergeData *>::iterator iter;
+	for (iter = blocks_enqueued.begin(); iter != blocks_enqueued.end();) {
+		BlockEmergeData *bedata = iter->second;
+		bedata->peers_requested.erase(peer_id);
+		if (bedata->peers_requested.empty()) {
+			delete bedata;
+			blocks_enqueued.erase(iter++);
+		} else {
+			++iter;
+		}
 	}
-	emergethread[idx]->qevent.signal();
+	peer_queue_count.erase(peer_id);
+}
 
-	return true;
+
+s16 EmergeManager::getPeerDistance(v3s16 p) {
+	// Same distance as the block send radius of RemoteClient
+	s16 nearest = -1;
+	std::map<u16, v3s16>::const_iterator iter;
+	for (iter = peer_positions.begin(); iter != peer_positions.end(); ++iter) {
+		v3s16 d = p - iter->second;
+		s16 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+		if (nearest == -1 || dist < nearest)
+			nearest = dist;
+	}
+	return nearest;
 }
 
 
@@ -398,28 +452,71 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 
 ////////////////////////////// Emerge Thread //////////////////////////////////
 
+// queuemutex must be locked
+static void releasePeerQueueSlots(EmergeManager *emerge,
+		BlockEmergeData *bedata) {
+	std::set<u16>::const_iterator iter;
+	for (iter = bedata->peers_requested.begin();
+			iter != bedata->peers_requested.end(); ++iter)
+		emerge->peer_queue_count[*iter]--;
+}
+
+
 bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
+	std::map<v3s16, BlockEmergeData *>::iterator iter, best;
 	JMutexAutoLock queuelock(emerge->queuemutex);
 
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
+	/*
+		Take the request nearest to any player, the oldest one first among
+		equally near ones. Requests of players that are now too far from
+		them are dropped; the clients ask for them again if they come back.
+	*/
+	s16 best_dist = -1;
+	u32 cancelled = 0;
+	best = emerge->blocks_enqueued.end();
+	for (iter = emerge->blocks_enqueued.begin();
+			iter != emerge->blocks_enqueued.end();) {
+		BlockEmergeData *bedata = iter->second;
+		s16 dist = emerge->getPeerDistance(iter->first);
+		if (dist == -1)
+			dist = 0;
+
+		if (dist > emerge->qcancel_distance &&
+				bedata->peers_requested.count(PEER_ID_INEXISTENT) == 0) {
+			releasePeerQueueSlots(emerge, bedata);
+			delete bedata;
+			emerge->blocks_enqueued.erase(iter++);
+			cancelled++;
+			continue;
+		}
 
-	*pos = p;
+		if (best_dist == -1 || dist < best_dist || (dist == best_dist &&
+				bedata->time_enqueued < best->second->time_enqueued)) {
+			best_dist = dist;
+			best = iter;
+		}
+		++iter;
+	}
+
+	if (cancelled)
+		g_profiler->add("EmergeThread: requests cancelled", cancelled);
 
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end())
-		return false; //uh oh, queue and map out of sync!!
+	if (best == emerge->blocks_enqueued.end())
+		return false;
 
-	BlockEmergeData *bedata = iter->second;
+	BlockEmergeData *bedata = best->second;
+	*pos = best->first;
 	*flags = bedata->flags;
 
-	emerge->peer_queue_count[bedata->peer_requested]--;
+	g_profiler->avg("EmergeThread: queue wait time (ms)",
+			porting::getTimeMs() - bedata->time_enqueued);
+	g_profiler->avg("EmergeThread: queue length",
+			emerge->blocks_enqueued.size());
+
+	releasePeerQueueSlots(emerge, bedata);
 
 	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
+	emerge->blocks_enqueued.erase(best);
 
 	return true;
 }
@@ -428,6 +525,54 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 									BlockMakeData *data, bool allow_gen) {
 	v2s16 p2d(p.X, p.Z);
+	MapBlock *block;
+	u32 unload_count;
+	std::vector<v3s16> area_positions;
+
+	{
+		//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
+		JMutexAutoLock envlock(m_server->m_env_mutex);
+
+		block = map->getBlockNoCreateNoEx(p);
+		if (block && !block->isDummy() && block->isGenerated()) {
+			*b = block;
+			return false;
+		}
+		unload_count = map->getUnloadCount();
+
+		// Note which blocks of the area a generated chunk would need, so
+		// that they can be read from disk without holding the envlock too.
+		// Old worlds may have blocks in sector files, which are only read
+		// by initBlockMake() itself.
+		if (allow_gen && !map->hasSectorFiles()) {
+			v3s16 bpmin, bpmax;
+			map->getChunkArea(p, bpmin, bpmax);
+			bpmin -= v3s16(1,1,1);
+			bpmax += v3s16(1,1,1);
+			for (s16 z = bpmin.Z; z <= bpmax.Z; z++)
+			for (s16 y = bpmin.Y; y <= bpmax.Y; y++)
+			for (s16 x = bpmin.X; x <= bpmax.X; x++) {
+				v3s16 bp(x, y, z);
+				if (bp != p && map->getBlockNoCreateNoEx(bp) == NULL)
+					area_positions.push_back(bp);
+			}
+		}
+	}
+
+	// Read and deserialize the block without holding the envlock, so that
+	// slow disk access doesn't stall the server step
+	EMERGE_DBG_OUT("not in memory, attempting to load from disk");
+	MapBlock *readblock = map->readBlock(p);
+
+	// If the block has to be generated, read the rest of its area too
+	std::vector<MapBlock *> area_blocks;
+	bool area_read = false;
+	if (allow_gen && !map->hasSectorFiles() &&
+			(readblock == NULL || !readblock->isGenerated())) {
+		ScopeProfiler sp(g_profiler, "EmergeThread: read chunk area", SPT_AVG);
+		area_read = map->readBlocks(area_positions, area_blocks);
+	}
+
 	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
 	JMutexAutoLock envlock(m_server->m_env_mutex);
 
@@ -436,27 +581,150 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 		map->loadSectorMeta(p2d);
 
 	// Attempt to load block
-	MapBlock *block = map->getBlockNoCreateNoEx(p);
+	block = map->getBlockNoCreateNoEx(p);
 	if (!block || block->isDummy() || !block->isGenerated()) {
-		EMERGE_DBG_OUT("not in memory, attempting to load from disk");
-		block = map->loadBlock(p);
+		// If the map changed while reading, the read block may be stale;
+		// read it again while holding the lock
+		if (readblock && map->insertReadBlock(readblock, unload_count))
+			block = readblock;
+		else
+			block = map->loadBlock(p);
+		readblock = NULL;
 		if (block && block->isGenerated())
 			map->prepareBlock(block);
 	}
+	delete readblock;
 
 	// If could not load and allowed to generate,
 	// start generation inside this same envlock
 	if (allow_gen && (block == NULL || !block->isGenerated())) {
+		// Another thread is generating the chunk already; when it has
+		// finished, its blocks are sent to the clients anyway
+		v3s16 bpmin, bpmax;
+		map->getChunkArea(p, bpmin, bpmax);
+		if (emerge->chunks_generating.count(bpmin)) {
+			EMERGE_DBG_OUT("chunk is being generated");
+			g_profiler->add("EmergeThread: requests in chunks being generated", 1);
+			for (u32 i = 0; i != area_blocks.size(); i++)
+				delete area_blocks[i];
+			*b = NULL;
+			return false;
+		}
+
 		EMERGE_DBG_OUT("generating");
 		*b = block;
-		return map->initBlockMake(data, p);
+
+		// Insert the area read before; if any of it was added or unloaded
+		// in the meantime, let initBlockMake() load the area itself
+		bool load_area = !map->insertReadArea(area_blocks, area_read,
+				unload_count);
+		if (!map->initBlockMake(data, p, load_area))
+			return false;
+		if (mapgen)
+			emerge->chunks_generating.insert(data->blockpos_min);
+		return true;
 	}
 
+	for (u32 i = 0; i != area_blocks.size(); i++)
+		delete area_blocks[i];
+
 	*b = block;
 	return false;
 }
 
 
+void EmergeThread::finishChunks() {
+	{
+		JMutexAutoLock queuelock(emerge->finishqueuemutex);
+		// Another thread is finishing chunks and will pick ours up too
+		if (emerge->finishing_chunks)
+			return;
+		emerge->finishing_chunks = true;
+	}
+
+	try {
+		for (;;) {
+			std::vector<BlockMakeData *> chunks;
+			{
+				JMutexAutoLock queuelock(emerge->finishqueuemutex);
+				if (emerge->chunks_to_finish.empty()) {
+					emerge->finishing_chunks = false;
+					return;
+				}
+				chunks.swap(emerge->chunks_to_finish);
+			}
+
+			g_profiler->avg("EmergeThread: chunks per finish batch",
+					chunks.size());
+
+			std::map<v3s16, MapBlock *> modified_blocks;
+			finishChunkBatch(chunks, modified_blocks);
+
+			for (u32 i = 0; i != chunks.size(); i++)
+				delete chunks[i];
+
+			if (modified_blocks.size() > 0)
+				m_server->SetBlocksNotSent(modified_blocks);
+		}
+	} catch (...) {
+		JMutexAutoLock queuelock(emerge->finishqueuemutex);
+		emerge->finishing_chunks = false;
+		throw;
+	}
+}
+
+
+void EmergeThread::finishChunkBatch(std::vector<BlockMakeData *> &chunks,
+		std::map<v3s16, MapBlock *> &modified_blocks) {
+	TimeTaker wait_timer("envlock wait", NULL, PRECISION_MICRO);
+
+	//envlock: usually 0ms, but can take either 30 or 400ms to acquire
+	JMutexAutoLock envlock(m_server->m_env_mutex);
+	g_profiler->avg("EmergeThread: envlock wait for finish (us)",
+			wait_timer.stop(true));
+	ScopeProfiler sp(g_profiler, "EmergeThread: after "
+			"Mapgen::makeChunk (envlock)", SPT_AVG);
+
+	for (u32 i = 0; i != chunks.size(); i++) {
+		BlockMakeData *data = chunks[i];
+		v3s16 p = data->blockpos_requested;
+
+		map->finishBlockMake(data, modified_blocks);
+		emerge->chunks_generating.erase(data->blockpos_min);
+
+		MapBlock *block = map->getBlockNoCreateNoEx(p);
+		if (!block)
+			continue;
+
+		/*
+			Do some post-generate stuff
+		*/
+		v3s16 minp = data->blockpos_min * MAP_BLOCKSIZE;
+		v3s16 maxp = data->blockpos_max * MAP_BLOCKSIZE +
+					 v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
+
+		// Ignore map edit events, they will not need to be sent
+		// to anybody because the block hasn't been sent to anybody
+		MapEditEventAreaIgnorer
+			ign(&m_server->m_ignore_map_edit_events_area,
+			VoxelArea(minp, maxp));
+		try {  // takes about 90ms with -O1 on an e3-1230v2
+			m_server->getScriptIface()->environment_OnGenerated(
+					minp, maxp, emerge->getBlockSeed(minp));
+		} catch(LuaError &e) {
+			m_server->setAsyncFatalError(e.what());
+		}
+
+		EMERGE_DBG_OUT("ended up with: " << analyze_block(block));
+
+		m_server->m_env->activateBlock(block, 0);
+
+		// Add the originally requested block to the modified list
+		modified_blocks[p] = block;
+	}
+}
+
+
 void *EmergeThread::Thread() {
 	ThreadStarted();
 	log_register_thread("EmergeThread" + itos(id));
@@ -490,65 +758,40 @@ void *EmergeThread::Thread() {
 			Try to fetch block from memory or disk.
 			If not found and asked to generate, initialize generator.
 		*/
-		BlockMakeData data;
+		BlockMakeData *data = new BlockMakeData();
 		MapBlock *block = NULL;
-		std::map<v3s16, MapBlock *> modified_blocks;
 
-		if (getBlockOrStartGen(p, &block, &data, allow_generate) && mapgen) {
+		if (getBlockOrStartGen(p, &block, data, allow_generate) && mapgen) {
 			{
 				ScopeProfiler sp(g_profiler, "EmergeThread: Mapgen::makeChunk", SPT_AVG);
 				TimeTaker t("mapgen::make_block()");
 
-				mapgen->makeChunk(&data);
+				mapgen->makeChunk(data);
 
 				if (enable_mapgen_debug_info == false)
 					t.stop(true); // Hide output
 			}
 
+			/*
+				Blit the chunk back and run the post-generate stuff, which
+				need the envlock. Chunks generated by other threads in the
+				meantime are finished in the same envlock.
+			*/
 			{
-				//envlock: usually 0ms, but can take either 30 or 400ms to acquire
-				JMutexAutoLock envlock(m_server->m_env_mutex);
-				ScopeProfiler sp(g_profiler, "EmergeThread: after "
-						"Mapgen::makeChunk (envlock)", SPT_AVG);
-
-				map->finishBlockMake(&data, modified_blocks);
-
-				block = map->getBlockNoCreateNoEx(p);
-				if (block) {
-					/*
-						Do some post-generate stuff
-					*/
-					v3s16 minp = data.blockpos_min * MAP_BLOCKSIZE;
-					v3s16 maxp = data.blockpos_max * MAP_BLOCKSIZE +
-								 v3s16(1,1,1) * (MAP_BLOCKSIZE - 1);
-
-					// Ignore map edit events, they will not need to be sent
-					// to anybody because the block hasn't been sent to anybody
-					MapEditEventAreaIgnorer
-						ign(&m_server->m_ignore_map_edit_events_area,
-						VoxelArea(minp, maxp));
-					try {  // takes about 90ms with -O1 on an e3-1230v2
-						m_server->getScriptIface()->environment_OnGenerated(
-								minp, maxp, emerge->getBlockSeed(minp));
-					} catch(LuaError &e) {
-						m_server->setAsyncFatalError(e.what());
-					}
-
-					EMERGE_DBG_OUT("ended up with: " << analyze_block(block));
-
-					m_server->m_env->activateBlock(block, 0);
-				}
+				JMutexAutoLock queuelock(emerge->finishqueuemutex);
+				emerge->chunks_to_finish.push_back(data);
 			}
+			finishChunks();
+			continue;
 		}
+		delete data;
 
 		/*
-			Set sent status of modified blocks on clients
+			Set sent status of the fetched block on clients
 		*/
-		// Add the originally fetched block to the modified list
-		if (block)
+		if (block) {
+			std::map<v3s16, MapBlock *> modified_blocks;
 			modified_blocks[p] = block;
-
-		if (modified_blocks.size() > 0) {
 			m_server->SetBlocksNotSent(modified_blocks);
 		}
 	}
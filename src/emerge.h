@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
+#include <set>
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "map.h" // for ManualMapVoxelManipulator
@@ -66,8 +67,10 @@ struct BlockMakeData {
 };
 
 struct BlockEmergeData {
-	u16 peer_requested;
+	// Every peer that asked for the block, each counted in peer_queue_count
+	std::set<u16> peers_requested;
 	u8 flags;
+	u32 time_enqueued;
 };
 
 class EmergeManager {
@@ -87,6 +90,7 @@ class EmergeManager {
 	u16 qlimit_total;
 	u16 qlimit_diskonly;
 	u16 qlimit_generate;
+	s16 qcancel_distance;
 
 	u32 gennotify;
 
@@ -94,6 +98,15 @@ class EmergeManager {
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
 	std::map<u16, u16> peer_queue_count;
+	std::map<u16, v3s16> peer_positions;
+
+	//generated chunks waiting to be blitted back to the map
+	JMutex finishqueuemutex;
+	std::vector<BlockMakeData *> chunks_to_finish;
+	bool finishing_chunks;
+	//blockpos_min of chunks from initBlockMake() until they are finished;
+	//the envlock must be held
+	std::set<v3s16> chunks_generating;
 
 	//Mapgen-related structures
 	BiomeDefManager *biomedef;
@@ -112,6 +125,11 @@ class EmergeManager {
 	void startThreads();
 	void stopThreads();
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	void setPeerPosition(u16 peer_id, v3s16 blockpos);
+	void removePeer(u16 peer_id);
+	// Distance in blocks to the nearest player, -1 if there are none;
+	// queuemutex must be locked
+	s16 getPeerDistance(v3s16 p);
 
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	void loadParamsFromSettings(Settings *settings);
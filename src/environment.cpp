@@ -42,6 +42,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "emerge.h"
 #include "util/serialize.h"
+#include "util/thread.h"
+#include "noise.h"
+#include <algorithm>
+#include <iterator>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -242,15 +246,50 @@ ABMWithState::ABMWithState(ActiveBlockModifier *abm_):
 	ActiveBlockList
 */
 
-void fillRadiusBlock(v3s16 p0, s16 r, std::set<v3s16> &list)
+void ActiveBlockList::addRef(v3s16 p,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
+{
+	if(++m_refs[p] != 1)
+		return;
+	m_list.insert(p);
+	// If it was removed earlier in this update, it didn't change at all
+	if(blocks_removed.erase(p) == 0)
+		blocks_added.insert(p);
+}
+
+void ActiveBlockList::removeRef(v3s16 p,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
+{
+	std::map<v3s16, u32>::iterator n = m_refs.find(p);
+	assert(n != m_refs.end());
+	if(--n->second != 0)
+		return;
+	m_refs.erase(n);
+	m_list.erase(p);
+	if(blocks_added.erase(p) == 0)
+		blocks_removed.insert(p);
+}
+
+void ActiveBlockList::refRadius(v3s16 p0, s16 radius, const v3s16 *skip,
+		bool add,
+		std::set<v3s16> &blocks_removed,
+		std::set<v3s16> &blocks_added)
 {
 	v3s16 p;
-	for(p.X=p0.X-r; p.X<=p0.X+r; p.X++)
-	for(p.Y=p0.Y-r; p.Y<=p0.Y+r; p.Y++)
-	for(p.Z=p0.Z-r; p.Z<=p0.Z+r; p.Z++)
+	for(p.X=p0.X-radius; p.X<=p0.X+radius; p.X++)
+	for(p.Y=p0.Y-radius; p.Y<=p0.Y+radius; p.Y++)
+	for(p.Z=p0.Z-radius; p.Z<=p0.Z+radius; p.Z++)
 	{
-		// Set in list
-		list.insert(p);
+		if(skip && abs(p.X - skip->X) <= radius &&
+				abs(p.Y - skip->Y) <= radius &&
+				abs(p.Z - skip->Z) <= radius)
+			continue;
+		if(add)
+			addRef(p, blocks_removed, blocks_added);
+		else
+			removeRef(p, blocks_removed, blocks_added);
 	}
 }
 
@@ -259,52 +298,189 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 		std::set<v3s16> &blocks_removed,
 		std::set<v3s16> &blocks_added)
 {
+	std::vector<v3s16> positions(active_positions.begin(),
+			active_positions.end());
+	std::sort(positions.begin(), positions.end());
+
 	/*
-		Create the new list
+		If the radius has changed, start over
 	*/
-	std::set<v3s16> newlist = m_forceloaded_list;
-	for(std::list<v3s16>::iterator i = active_positions.begin();
-			i != active_positions.end(); ++i)
+	if(radius != m_radius)
 	{
-		fillRadiusBlock(*i, radius, newlist);
+		for(std::vector<v3s16>::iterator i = m_positions.begin();
+				i != m_positions.end(); ++i)
+			refRadius(*i, m_radius, NULL, false, blocks_removed, blocks_added);
+		m_positions.clear();
+		m_radius = radius;
 	}
 
 	/*
-		Find out which blocks on the old list are not on the new list
+		Find the positions that have appeared and disappeared
 	*/
-	// Go through old list
-	for(std::set<v3s16>::iterator i = m_list.begin();
-			i != m_list.end(); ++i)
+	std::vector<v3s16> gone;
+	std::vector<v3s16> came;
+	std::set_difference(m_positions.begin(), m_positions.end(),
+			positions.begin(), positions.end(), std::back_inserter(gone));
+	std::set_difference(positions.begin(), positions.end(),
+			m_positions.begin(), m_positions.end(), std::back_inserter(came));
+
+	/*
+		Treat an appeared position near a disappeared one as a player
+		having moved there; then only the blocks that are in one of the
+		areas but not in the other change.
+	*/
+	for(std::vector<v3s16>::iterator i = came.begin();
+			i != came.end(); ++i)
 	{
 		v3s16 p = *i;
-		// If not on new list, it's been removed
-		if(newlist.find(p) == newlist.end())
-			blocks_removed.insert(p);
+		std::vector<v3s16>::iterator nearest = gone.end();
+		s16 nearest_d = 2 * radius + 1;
+		for(std::vector<v3s16>::iterator j = gone.begin();
+				j != gone.end(); ++j)
+		{
+			s16 d = MYMAX(abs(p.X - j->X),
+					MYMAX(abs(p.Y - j->Y), abs(p.Z - j->Z)));
+			if(d < nearest_d){
+				nearest_d = d;
+				nearest = j;
+			}
+		}
+		if(nearest == gone.end()){
+			refRadius(p, radius, NULL, true, blocks_removed, blocks_added);
+			continue;
+		}
+		v3s16 old_p = *nearest;
+		gone.erase(nearest);
+		refRadius(p, radius, &old_p, true, blocks_removed, blocks_added);
+		refRadius(old_p, radius, &p, false, blocks_removed, blocks_added);
 	}
+	for(std::vector<v3s16>::iterator i = gone.begin();
+			i != gone.end(); ++i)
+		refRadius(*i, radius, NULL, false, blocks_removed, blocks_added);
+
+	m_positions.swap(positions);
 
 	/*
-		Find out which blocks on the new list are not on the old list
+		Apply changes in forceloaded blocks
 	*/
-	// Go through new list
-	for(std::set<v3s16>::iterator i = newlist.begin();
-			i != newlist.end(); ++i)
+	for(std::set<v3s16>::iterator i = m_forceloaded_list.begin();
+			i != m_forceloaded_list.end(); ++i)
 	{
-		v3s16 p = *i;
-		// If not on old list, it's been added
-		if(m_list.find(p) == m_list.end())
-			blocks_added.insert(p);
+		if(m_forceloaded_refs.find(*i) == m_forceloaded_refs.end())
+			addRef(*i, blocks_removed, blocks_added);
 	}
+	for(std::set<v3s16>::iterator i = m_forceloaded_refs.begin();
+			i != m_forceloaded_refs.end(); ++i)
+	{
+		if(m_forceloaded_list.find(*i) == m_forceloaded_list.end())
+			removeRef(*i, blocks_removed, blocks_added);
+	}
+	m_forceloaded_refs = m_forceloaded_list;
 
 	/*
-		Update m_list
+		Retry blocks that couldn't be activated, if still wanted
 	*/
-	m_list.clear();
-	for(std::set<v3s16>::iterator i = newlist.begin();
-			i != newlist.end(); ++i)
+	for(std::set<v3s16>::iterator i = m_failed.begin();
+			i != m_failed.end(); ++i)
 	{
 		v3s16 p = *i;
+		if(m_refs.find(p) == m_refs.end() || m_list.find(p) != m_list.end())
+			continue;
 		m_list.insert(p);
+		blocks_added.insert(p);
 	}
+	m_failed.clear();
+}
+
+/*
+	ActiveObjectIndex
+*/
+
+void ActiveObjectIndex::insert(ServerActiveObject *obj)
+{
+	obj->m_index_cell = getCell(obj->getBasePosition());
+	obj->m_indexed = true;
+	m_cells[obj->m_index_cell].insert(obj->getId());
+	if(obj->getType() == ACTIVEOBJECT_TYPE_PLAYER ||
+			obj->unlimitedTransferDistance())
+		m_unlimited.insert(obj->getId());
+}
+
+void ActiveObjectIndex::remove(ServerActiveObject *obj)
+{
+	if(!obj->m_indexed)
+		return;
+	std::map<v3s16, std::set<u16> >::iterator n =
+			m_cells.find(obj->m_index_cell);
+	if(n != m_cells.end()){
+		n->second.erase(obj->getId());
+		if(n->second.empty())
+			m_cells.erase(n);
+	}
+	m_unlimited.erase(obj->getId());
+	obj->m_indexed = false;
+}
+
+void ActiveObjectIndex::update(ServerActiveObject *obj)
+{
+	v3s16 cell = getCell(obj->getBasePosition());
+	if(cell == obj->m_index_cell)
+		return;
+	std::map<v3s16, std::set<u16> >::iterator n =
+			m_cells.find(obj->m_index_cell);
+	if(n != m_cells.end()){
+		n->second.erase(obj->getId());
+		if(n->second.empty())
+			m_cells.erase(n);
+	}
+	obj->m_index_cell = cell;
+	m_cells[cell].insert(obj->getId());
+}
+
+void ActiveObjectIndex::getObjectsNear(v3f pos, f32 radius,
+		std::vector<u16> &dst)
+{
+	v3s16 cmin = getCell(pos - v3f(radius, radius, radius));
+	v3s16 cmax = getCell(pos + v3f(radius, radius, radius));
+
+	// Look up the cells in the area, or go through the occupied cells if
+	// there are fewer of them
+	s64 volume = (s64)(cmax.X - cmin.X + 1) * (cmax.Y - cmin.Y + 1)
+			* (cmax.Z - cmin.Z + 1);
+	if(volume > (s64)m_cells.size())
+	{
+		for(std::map<v3s16, std::set<u16> >::iterator
+				i = m_cells.begin(); i != m_cells.end(); ++i)
+		{
+			v3s16 c = i->first;
+			if(c.X < cmin.X || c.X > cmax.X || c.Y < cmin.Y ||
+					c.Y > cmax.Y || c.Z < cmin.Z || c.Z > cmax.Z)
+				continue;
+			dst.insert(dst.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	for(s16 z=cmin.Z; z<=cmax.Z; z++)
+	for(s16 y=cmin.Y; y<=cmax.Y; y++)
+	for(s16 x=cmin.X; x<=cmax.X; x++)
+	{
+		std::map<v3s16, std::set<u16> >::iterator i =
+				m_cells.find(v3s16(x,y,z));
+		if(i == m_cells.end())
+			continue;
+		dst.insert(dst.end(), i->second.begin(), i->second.end());
+	}
+}
+
+v3s16 ActiveObjectIndex::getCell(v3f pos)
+{
+	// Keep far away positions from overflowing
+	const f32 limit = (MAP_GENERATION_LIMIT + MAP_BLOCKSIZE) * BS;
+	pos.X = rangelim(pos.X, -limit, limit);
+	pos.Y = rangelim(pos.Y, -limit, limit);
+	pos.Z = rangelim(pos.Z, -limit, limit);
+	return getNodeBlockPos(floatToInt(pos, BS));
 }
 
 /*
@@ -322,9 +498,21 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1),
-	m_max_lag_estimate(0.1)
+	m_max_lag_estimate(0.1),
+	m_player_files_indexed(false),
+	m_abm_scan_pool(NULL),
+	m_object_step_pool(NULL)
 {
 	m_use_weather = g_settings->getBool("weather");
+
+	u16 abm_scan_threads = g_settings->getU16("abm_scan_threads");
+	if(abm_scan_threads > 0)
+		m_abm_scan_pool = new WorkerPool(abm_scan_threads, "ABMScanThread");
+
+	u16 object_step_threads = g_settings->getU16("object_step_threads");
+	if(object_step_threads > 0)
+		m_object_step_pool = new WorkerPool(object_step_threads,
+				"ObjectStepThread");
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -339,6 +527,9 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_abm_scan_pool;
+	delete m_object_step_pool;
+
 	// Delete ActiveBlockModifiers
 	for(std::list<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -383,12 +574,11 @@ bool ServerEnvironment::line_of_sight(v3f pos1, v3f pos2, float stepsize, v3s16
 	return true;
 }
 
-void ServerEnvironment::serializePlayers(const std::string &savedir)
+void ServerEnvironment::indexPlayerFiles(const std::string &players_path,
+		bool load)
 {
-	std::string players_path = savedir + "/players";
-	fs::CreateDir(players_path);
-
-	std::set<Player*> saved_players;
+	m_player_files.clear();
+	m_player_files_indexed = true;
 
 	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
 	for(u32 i=0; i<player_files.size(); i++)
@@ -414,46 +604,71 @@ void ServerEnvironment::serializePlayers(const std::string &savedir)
 			testplayer.deSerialize(is, player_files[i].name);
 		}
 
-		//infostream<<"Loaded test player with name "<<testplayer.getName()<<std::endl;
+		std::string playername = testplayer.getName();
+		if(m_player_files.find(playername) == m_player_files.end())
+			m_player_files[playername] = path;
+
+		if(!load)
+			continue;
+
+		if(!string_allowed(playername, PLAYERNAME_ALLOWED_CHARS))
+		{
+			infostream<<"Not loading player with invalid name: "
+					<<playername<<std::endl;
+		}
+
+		/*infostream<<"Loaded test player with name "<<playername
+				<<std::endl;*/
 		
 		// Search for the player
-		std::string playername = testplayer.getName();
 		Player *player = getPlayer(playername.c_str());
+		bool newplayer = false;
 		if(player == NULL)
 		{
-			infostream<<"Didn't find matching player, ignoring file "<<path<<std::endl;
-			continue;
+			//infostream<<"Is a new player"<<std::endl;
+			player = new RemotePlayer(m_gamedef);
+			newplayer = true;
 		}
 
-		//infostream<<"Found matching player, overwriting."<<std::endl;
-
-		// OK, found. Save player there.
-		if(player->checkModified())
+		// Load player
 		{
-			// Open file and serialize
-			std::ostringstream ss(std::ios_base::binary);
-			player->serialize(ss);
-			if(!fs::safeWriteToFile(path, ss.str()))
+			verbosestream<<"Reading player "<<playername<<" from "
+					<<path<<std::endl;
+			// Open file and deserialize
+			std::ifstream is(path.c_str(), std::ios_base::binary);
+			if(is.good() == false)
 			{
-				infostream<<"Failed to write "<<path<<std::endl;
+				infostream<<"Failed to read "<<path<<std::endl;
+				if(newplayer)
+					delete player;
 				continue;
 			}
-			saved_players.insert(player);
-		} else {
-			saved_players.insert(player);
+			player->deSerialize(is, player_files[i].name);
+		}
+
+		if(newplayer)
+		{
+			addPlayer(player);
 		}
 	}
+}
+
+void ServerEnvironment::serializePlayers(const std::string &savedir)
+{
+	std::string players_path = savedir + "/players";
+	fs::CreateDir(players_path);
+
+	// The players directory is only read once; after that the index is
+	// kept up to date with the files written here
+	if(!m_player_files_indexed)
+		indexPlayerFiles(players_path, false);
+
+	u32 saved_count = 0;
 
 	for(std::list<Player*>::iterator i = m_players.begin();
 			i != m_players.end(); ++i)
 	{
 		Player *player = *i;
-		if(saved_players.find(player) != saved_players.end())
-		{
-			/*infostream<<"Player "<<player->getName()
-					<<" was already saved."<<std::endl;*/
-			continue;
-		}
 		std::string playername = player->getName();
 		// Don't save unnamed player
 		if(playername == "")
@@ -461,113 +676,80 @@ void ServerEnvironment::serializePlayers(const std::string &savedir)
 			//infostream<<"Not saving unnamed player."<<std::endl;
 			continue;
 		}
+
 		/*
-			Find a sane filename
+			Players that are not connected only change through the
+			dirty flag; don't compare their whole inventories
 		*/
-		if(string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
-			playername = "player";
-		std::string path = players_path + "/" + playername;
-		bool found = false;
-		for(u32 i=0; i<1000; i++)
+		std::map<std::string, std::string>::iterator file =
+				m_player_files.find(playername);
+		bool has_file = (file != m_player_files.end());
+		if(has_file)
 		{
-			if(fs::PathExists(path) == false)
-			{
-				found = true;
-				break;
-			}
-			path = players_path + "/" + playername + itos(i);
-		}
-		if(found == false)
-		{
-			infostream<<"Didn't find free file for player"<<std::endl;
-			continue;
-		}
-
-		{
-			/*infostream<<"Saving player "<<player->getName()<<" to "
-					<<path<<std::endl;*/
-			// Open file and serialize
-			std::ostringstream ss(std::ios_base::binary);
-			player->serialize(ss);
-			if(!fs::safeWriteToFile(path, ss.str()))
-			{
-				infostream<<"Failed to write "<<path<<std::endl;
+			if(player->getPlayerSAO() == NULL && !player->isModified())
 				continue;
-			}
-			saved_players.insert(player);
-		}
-	}
-
-	//infostream<<"Saved "<<saved_players.size()<<" players."<<std::endl;
-}
-
-void ServerEnvironment::deSerializePlayers(const std::string &savedir)
-{
-	std::string players_path = savedir + "/players";
-
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
-	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
-
-		//infostream<<"Checking player file "<<path<<std::endl;
-
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
+			if(!player->checkModified())
 				continue;
-			}
-			testplayer.deSerialize(is, player_files[i].name);
 		}
-
-		if(!string_allowed(testplayer.getName(), PLAYERNAME_ALLOWED_CHARS))
+		else
 		{
-			infostream<<"Not loading player with invalid name: "
-					<<testplayer.getName()<<std::endl;
+			player->checkModified();
 		}
 
-		/*infostream<<"Loaded test player with name "<<testplayer.getName()
-				<<std::endl;*/
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		bool newplayer = false;
-		if(player == NULL)
+		std::string path;
+		if(has_file)
 		{
-			//infostream<<"Is a new player"<<std::endl;
-			player = new RemotePlayer(m_gamedef);
-			newplayer = true;
+			path = file->second;
 		}
-
-		// Load player
+		else
 		{
-			verbosestream<<"Reading player "<<testplayer.getName()<<" from "
-					<<path<<std::endl;
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
+			/*
+				Find a sane filename
+			*/
+			if(string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
+				playername = "player";
+			path = players_path + "/" + playername;
+			bool found = false;
+			for(u32 i=0; i<1000; i++)
 			{
-				infostream<<"Failed to read "<<path<<std::endl;
+				if(fs::PathExists(path) == false)
+				{
+					found = true;
+					break;
+				}
+				path = players_path + "/" + playername + itos(i);
+			}
+			if(found == false)
+			{
+				infostream<<"Didn't find free file for player"<<std::endl;
 				continue;
 			}
-			player->deSerialize(is, player_files[i].name);
 		}
 
-		if(newplayer)
+		/*infostream<<"Saving player "<<player->getName()<<" to "
+				<<path<<std::endl;*/
+		// Open file and serialize
+		std::ostringstream ss(std::ios_base::binary);
+		player->serialize(ss);
+		if(!fs::safeWriteToFile(path, ss.str()))
 		{
-			addPlayer(player);
+			infostream<<"Failed to write "<<path<<std::endl;
+			// Try again on the next save
+			player->setModified(true);
+			continue;
 		}
+		m_player_files[player->getName()] = path;
+		saved_count++;
 	}
+
+	verbosestream<<"ServerEnvironment: Saved "<<saved_count<<" of "
+			<<m_players.size()<<" players"<<std::endl;
+}
+
+void ServerEnvironment::deSerializePlayers(const std::string &savedir)
+{
+	// Builds the index of player files while loading them
+	indexPlayerFiles(savedir + "/players", true);
 }
 
 void ServerEnvironment::saveMeta(const std::string &savedir)
@@ -641,16 +823,44 @@ struct ActiveABM
 	std::set<content_t> required_neighbors;
 };
 
+/*
+	A node found by a block scan whose ABM is to be triggered
+*/
+struct ABMTrigger
+{
+	ActiveABM *aabm;
+	v3s16 p;
+	MapNode n;
+};
+
+/*
+	Everything the scan of one block needs. It is gathered on the server
+	thread so that the scan itself can run without touching the Map.
+*/
+struct ABMBlockJob
+{
+	MapBlock *block;
+	// The block and its neighbors, see getNeighborhoodNode()
+	MapBlock *neighborhood[27];
+	u32 active_object_count;
+	u32 active_object_count_wider;
+	std::vector<ABMTrigger> triggers;
+};
+
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
 	std::map<content_t, std::list<ActiveABM> > m_aabms;
+	// m_aabms by content id, NULL where nothing is triggered
+	std::vector<std::list<ActiveABM>*> m_aabms_by_content;
+	PseudoRandom m_rand;
 public:
 	ABMHandler(std::list<ABMWithState> &abms,
 			float dtime_s, ServerEnvironment *env,
 			bool use_timers):
-		m_env(env)
+		m_env(env),
+		m_rand(myrand())
 	{
 		if(dtime_s < 0.001)
 			return;
@@ -711,16 +921,47 @@ class ABMHandler
 				}
 			}
 		}
-	}
-	void apply(MapBlock *block)
-	{
+
 		if(m_aabms.empty())
 			return;
+		// m_aabms is sorted, so its last key is the highest id
+		m_aabms_by_content.resize(m_aabms.rbegin()->first + 1, NULL);
+		for(std::map<content_t, std::list<ActiveABM> >::iterator
+				i = m_aabms.begin(); i != m_aabms.end(); ++i)
+			m_aabms_by_content[i->first] = &i->second;
+	}
+	bool empty()
+	{
+		return m_aabms.empty();
+	}
 
+	/*
+		Fill in job for block. Returns false if the block contains nothing
+		any ABM is triggered by and doesn't need to be scanned.
+		Reads the Map, so this has to be done on the server thread.
+	*/
+	bool prepare(MapBlock *block, ABMBlockJob &job)
+	{
 		ServerMap *map = &m_env->getServerMap();
 
+		job.block = block;
+		job.triggers.clear();
+
+		bool triggered = false;
+		const std::vector<content_t> &contents = block->getContents();
+		for(std::vector<content_t>::const_iterator
+				i = contents.begin(); i != contents.end(); ++i)
+		{
+			if(getABMs(*i) != NULL){
+				triggered = true;
+				break;
+			}
+		}
+		if(!triggered)
+			return false;
+
 		// Find out how many objects the block contains
-		u32 active_object_count = block->m_static_objects.m_active.size();
+		job.active_object_count = block->m_static_objects.m_active.size();
 		// Find out how many objects this and all the neighbors contain
 		u32 active_object_count_wider = 0;
 		u32 wider_unknown_count = 0;
@@ -730,6 +971,7 @@ class ABMHandler
 		{
 			MapBlock *block2 = map->getBlockNoCreateNoEx(
 					block->getPos() + v3s16(x,y,z));
+			job.neighborhood[(z+1)*9 + (y+1)*3 + (x+1)] = block2;
 			if(block2==NULL){
 				wider_unknown_count = 0;
 				continue;
@@ -741,38 +983,45 @@ class ABMHandler
 		// Extrapolate
 		u32 wider_known_count = 3*3*3 - wider_unknown_count;
 		active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
+		job.active_object_count_wider = active_object_count_wider;
+		return true;
+	}
+
+	/*
+		Collect the nodes of job.block whose ABMs fire into job.triggers.
+		Only reads the blocks referenced by job, so several jobs can be
+		scanned concurrently as long as the Map is not modified.
+	*/
+	void scan(ABMBlockJob &job, PseudoRandom &pr)
+	{
+		MapBlock *block = job.block;
 		v3s16 p0;
 		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
 		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
 		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
 		{
 			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
-
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			std::list<ActiveABM> *aabms = getABMs(n.getContent());
+			if(aabms == NULL)
 				continue;
 
 			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
+					i = aabms->begin(); i != aabms->end(); i++)
 			{
-				if(myrand() % i->chance != 0)
+				if(pr.next() % i->chance != 0)
 					continue;
 
 				// Check neighbors
 				if(!i->required_neighbors.empty())
 				{
 					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
 					{
-						if(p1 == p)
+						if(p1 == p0)
 							continue;
-						MapNode n = map->getNodeNoEx(p1);
+						MapNode n = getNeighborhoodNode(job, p1);
 						content_t c = n.getContent();
 						std::set<content_t>::const_iterator k;
 						k = i->required_neighbors.find(c);
@@ -785,13 +1034,129 @@ class ABMHandler
 				}
 neighbor_found:
 
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
+				ABMTrigger trigger;
+				trigger.aabm = &(*i);
+				trigger.p = p0 + block->getPosRelative();
+				trigger.n = n;
+				job.triggers.push_back(trigger);
 			}
 		}
 	}
+
+	/*
+		Call the ABMs found by scan(). Runs Lua, so only on the server
+		thread.
+	*/
+	void trigger(ABMBlockJob &job)
+	{
+		for(std::vector<ABMTrigger>::iterator
+				i = job.triggers.begin(); i != job.triggers.end(); ++i)
+		{
+			// Call all the trigger variations
+			i->aabm->abm->trigger(m_env, i->p, i->n);
+			i->aabm->abm->trigger(m_env, i->p, i->n,
+					job.active_object_count, job.active_object_count_wider);
+		}
+	}
+
+	void apply(MapBlock *block)
+	{
+		if(m_aabms.empty())
+			return;
+
+		ABMBlockJob job;
+		if(!prepare(block, job))
+			return;
+		scan(job, m_rand);
+		trigger(job);
+	}
+
+private:
+	std::list<ActiveABM> * getABMs(content_t c)
+	{
+		if(c >= m_aabms_by_content.size())
+			return NULL;
+		return m_aabms_by_content[c];
+	}
+
+	// p is relative to job.block and at most one node outside of it
+	static MapNode getNeighborhoodNode(ABMBlockJob &job, v3s16 p)
+	{
+		v3s16 bp(0,0,0);
+		if(p.X < 0) bp.X = -1; else if(p.X >= MAP_BLOCKSIZE) bp.X = 1;
+		if(p.Y < 0) bp.Y = -1; else if(p.Y >= MAP_BLOCKSIZE) bp.Y = 1;
+		if(p.Z < 0) bp.Z = -1; else if(p.Z >= MAP_BLOCKSIZE) bp.Z = 1;
+		MapBlock *block = job.neighborhood[(bp.Z+1)*9 + (bp.Y+1)*3 + (bp.X+1)];
+		if(block == NULL)
+			return MapNode(CONTENT_IGNORE);
+		return block->getNodeNoEx(p - bp * MAP_BLOCKSIZE);
+	}
+};
+
+/*
+	Scans a set of prepared blocks on the ABM scan worker pool
+*/
+class ABMScanJobList : public ParallelJobList
+{
+public:
+	ABMScanJobList(ABMHandler &handler, std::vector<ABMBlockJob> &jobs,
+			u16 worker_count):
+		m_handler(handler),
+		m_jobs(jobs)
+	{
+		// PseudoRandom is not thread-safe; give each worker its own
+		for(u16 i = 0; i < worker_count; i++)
+			m_rand.push_back(PseudoRandom(myrand()));
+	}
+
+	u32 getJobCount()
+	{
+		return m_jobs.size();
+	}
+
+	void runJob(u32 i, u16 worker)
+	{
+		m_handler.scan(m_jobs[i], m_rand[worker]);
+	}
+
+private:
+	ABMHandler &m_handler;
+	std::vector<ABMBlockJob> &m_jobs;
+	std::vector<PseudoRandom> m_rand;
+};
+
+// Number of objects handed to a worker at once
+#define OBJECT_PHYSICS_JOB_SIZE 16
+
+/*
+	Runs ServerActiveObject::stepPhysics() of the objects on a WorkerPool
+*/
+class ObjectPhysicsJobList : public ParallelJobList
+{
+public:
+	ObjectPhysicsJobList(const std::vector<ServerActiveObject*> &objects,
+			float dtime):
+		m_objects(objects),
+		m_dtime(dtime)
+	{
+	}
+
+	u32 getJobCount()
+	{
+		return (m_objects.size() + OBJECT_PHYSICS_JOB_SIZE - 1)
+				/ OBJECT_PHYSICS_JOB_SIZE;
+	}
+
+	void runJob(u32 i, u16 worker)
+	{
+		u32 end = MYMIN((i + 1) * OBJECT_PHYSICS_JOB_SIZE, m_objects.size());
+		for(u32 j = i * OBJECT_PHYSICS_JOB_SIZE; j < end; j++)
+			m_objects[j]->stepPhysics(m_dtime);
+	}
+
+private:
+	const std::vector<ServerActiveObject*> &m_objects;
+	float m_dtime;
 };
 
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
@@ -895,12 +1260,15 @@ bool ServerEnvironment::swapNode(v3s16 p, const MapNode &n)
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> near;
+	m_active_object_index.getObjectsNear(pos, radius, near);
+	for(std::vector<u16>::iterator
+			i = near.begin(); i != near.end(); ++i)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = *i;
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -909,6 +1277,12 @@ std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 	return objects;
 }
 
+void ServerEnvironment::updateActiveObjectIndex(ServerActiveObject *obj)
+{
+	m_active_object_index.update(obj);
+	m_object_collision_grid.update(obj);
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
@@ -943,6 +1317,8 @@ void ServerEnvironment::clearAllObjects()
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		m_script->removeObjectReference(obj);
+		m_active_object_index.remove(obj);
+		m_object_collision_grid.remove(obj->getId());
 
 		// Delete active object
 		if(obj->environmentDeletes())
@@ -1156,7 +1532,7 @@ void ServerEnvironment::step(float dtime)
 
 			MapBlock *block = m_map->getBlockOrEmerge(p);
 			if(block==NULL){
-				m_active_blocks.m_list.erase(p);
+				m_active_blocks.removeFailed(p);
 				continue;
 			}
 
@@ -1230,24 +1606,63 @@ void ServerEnvironment::step(float dtime)
 		// Initialize handling of ActiveBlockModifiers
 		ABMHandler abmhandler(m_abms, abm_interval, this, true);
 
-		for(std::set<v3s16>::iterator
-				i = m_active_blocks.m_list.begin();
-				i != m_active_blocks.m_list.end(); ++i)
+		if(m_abm_scan_pool == NULL || abmhandler.empty())
 		{
-			v3s16 p = *i;
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
+			for(std::set<v3s16>::iterator
+					i = m_active_blocks.m_list.begin();
+					i != m_active_blocks.m_list.end(); ++i)
+			{
+				v3s16 p = *i;
+				
+				/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
+						<<") being handled"<<std::endl;*/
 
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if(block==NULL)
-				continue;
-			
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
+				MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+				if(block==NULL)
+					continue;
+				
+				// Set current time as timestamp
+				block->setTimestampNoChangedFlag(m_game_time);
+
+				/* Handle ActiveBlockModifiers */
+				abmhandler.apply(block);
+			}
+		}
+		else
+		{
+			/*
+				Scan all blocks on the worker pool first and run the
+				triggers afterwards, so that the Map stays untouched
+				while the workers read it.
+			*/
+			std::vector<ABMBlockJob> jobs;
+			jobs.reserve(m_active_blocks.m_list.size());
+			for(std::set<v3s16>::iterator
+					i = m_active_blocks.m_list.begin();
+					i != m_active_blocks.m_list.end(); ++i)
+			{
+				MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
+				if(block==NULL)
+					continue;
+
+				// Set current time as timestamp
+				block->setTimestampNoChangedFlag(m_game_time);
+
+				jobs.push_back(ABMBlockJob());
+				if(!abmhandler.prepare(block, jobs.back()))
+					jobs.pop_back();
+			}
+
+			{
+				ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg /1s", SPT_AVG);
+				ABMScanJobList joblist(abmhandler, jobs,
+						m_abm_scan_pool->getWorkerCount());
+				m_abm_scan_pool->run(&joblist);
+			}
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
+			for(std::vector<ABMBlockJob>::iterator
+					i = jobs.begin(); i != jobs.end(); ++i)
+				abmhandler.trigger(*i);
 		}
 
 		u32 time_ms = timer.stop(true);
@@ -1283,13 +1698,47 @@ void ServerEnvironment::step(float dtime)
 			send_recommended = true;
 		}
 
+		static CachedSetting<bool> only_peaceful_mobs(g_settings,
+				"only_peaceful_mobs");
+
+		// Positions are kept up to date as the objects move, but the
+		// collision boxes and flags may also have changed
+		for(std::map<u16, ServerActiveObject*>::iterator
+				i = m_active_objects.begin();
+				i != m_active_objects.end(); ++i)
+			m_object_collision_grid.update(i->second);
+
+		/*
+			Move the objects on the worker pool first. Nothing but the
+			objects themselves is modified until the pool is done; then
+			the objects are stepped one at a time as usual, applying the
+			movement and running their on_step callbacks.
+		*/
+		if(m_object_step_pool != NULL)
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: object physics avg", SPT_AVG);
+			std::vector<ServerActiveObject*> objects;
+			objects.reserve(m_active_objects.size());
+			for(std::map<u16, ServerActiveObject*>::iterator
+					i = m_active_objects.begin();
+					i != m_active_objects.end(); ++i)
+			{
+				ServerActiveObject* obj = i->second;
+				if(obj->m_removed || obj->m_pending_deactivation)
+					continue;
+				objects.push_back(obj);
+			}
+			ObjectPhysicsJobList joblist(objects, dtime);
+			m_object_step_pool->run(&joblist);
+		}
+
 		for(std::map<u16, ServerActiveObject*>::iterator
 				i = m_active_objects.begin();
 				i != m_active_objects.end(); ++i)
 		{
 			ServerActiveObject* obj = i->second;
 			// Remove non-peaceful mobs on peaceful mode
-			if(g_settings->getBool("only_peaceful_mobs")){
+			if(only_peaceful_mobs.get()){
 				if(!obj->isPeaceful())
 					obj->m_removed = true;
 			}
@@ -1418,19 +1867,28 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
 	/*
-		Go through the object list,
+		Get the objects that are near or may have unlimited transfer
+		distance from the index
+	*/
+	std::vector<u16> candidates;
+	m_active_object_index.getObjectsNear(pos_f, radius_f, candidates);
+	const std::set<u16> &unlimited =
+			m_active_object_index.getUnlimitedObjects();
+	candidates.insert(candidates.end(), unlimited.begin(), unlimited.end());
+	/*
+		Go through the candidates,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::vector<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		u16 id = i->first;
+		u16 id = *i;
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed or deactivating
@@ -1552,6 +2010,8 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object);
+	m_object_collision_grid.update(object);
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1667,6 +2127,8 @@ void ServerEnvironment::removeRemovedObjects()
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		m_script->removeObjectReference(obj);
+		m_active_object_index.remove(obj);
+		m_object_collision_grid.remove(obj->getId());
 
 		// Delete
 		if(obj->environmentDeletes())
@@ -2032,6 +2494,8 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 		obj->removingFromEnvironment();
 		// Deregister in scripting api
 		m_script->removeObjectReference(obj);
+		m_active_object_index.remove(obj);
+		m_object_collision_grid.remove(obj->getId());
 
 		// Delete active object
 		if(obj->environmentDeletes())
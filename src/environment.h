@@ -38,6 +38,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "mapnode.h"
 #include "mapblock.h"
+#include "collision.h"
 
 class ServerEnvironment;
 class ActiveBlockModifier;
@@ -49,6 +50,7 @@ class ServerMap;
 class ClientMap;
 class GameScripting;
 class Player;
+class WorkerPool;
 
 class Environment
 {
@@ -164,6 +166,16 @@ struct ABMWithState
 class ActiveBlockList
 {
 public:
+	ActiveBlockList():
+		m_radius(0)
+	{}
+
+	/*
+		Makes the blocks within radius of active_positions and the
+		forceloaded blocks active. Only the changes since the previous
+		call are applied: the cost depends on how far the positions
+		have moved, not on the volume around them.
+	*/
 	void update(std::list<v3s16> &active_positions,
 			s16 radius,
 			std::set<v3s16> &blocks_removed,
@@ -175,12 +187,76 @@ class ActiveBlockList
 
 	void clear(){
 		m_list.clear();
+		m_refs.clear();
+		m_positions.clear();
+		m_forceloaded_refs.clear();
+		m_failed.clear();
+	}
+
+	// Removes a block that couldn't be activated; update() retries it
+	void removeFailed(v3s16 p){
+		m_list.erase(p);
+		m_failed.insert(p);
 	}
 
 	std::set<v3s16> m_list;
 	std::set<v3s16> m_forceloaded_list;
 
 private:
+	void addRef(v3s16 p, std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+	void removeRef(v3s16 p, std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+	/*
+		Adds (or removes) a reference to the blocks within radius of p0,
+		skipping those that are also within radius of *skip
+	*/
+	void refRadius(v3s16 p0, s16 radius, const v3s16 *skip, bool add,
+			std::set<v3s16> &blocks_removed,
+			std::set<v3s16> &blocks_added);
+
+	// Number of active positions and forceloads each active block is for
+	std::map<v3s16, u32> m_refs;
+	// Sorted active positions the references were made for
+	std::vector<v3s16> m_positions;
+	s16 m_radius;
+	// Forceloaded blocks the references were made for
+	std::set<v3s16> m_forceloaded_refs;
+	// Blocks given to removeFailed()
+	std::set<v3s16> m_failed;
+};
+
+/*
+	Spatial index of the active objects of a ServerEnvironment.
+
+	Objects are kept in cells of the size of a MapBlock. Objects that
+	may have unlimited transfer distance (players) are also listed
+	separately, as they have to be found regardless of distance.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	void insert(ServerActiveObject *obj);
+	void remove(ServerActiveObject *obj);
+	// Moves the object to its new cell if it has left its old one
+	void update(ServerActiveObject *obj);
+
+	/*
+		Adds to dst the ids of the objects in the cells touching the cube
+		of the given radius around pos. The caller has to check the
+		actual distances.
+	*/
+	void getObjectsNear(v3f pos, f32 radius, std::vector<u16> &dst);
+
+	const std::set<u16> & getUnlimitedObjects()
+		{ return m_unlimited; }
+
+	static v3s16 getCell(v3f pos);
+
+private:
+	std::map<v3s16, std::set<u16> > m_cells;
+	std::set<u16> m_unlimited;
 };
 
 /*
@@ -295,6 +371,17 @@ class ServerEnvironment : public Environment
 	
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+
+	// Called by ServerActiveObject::setBasePosition()
+	void updateActiveObjectIndex(ServerActiveObject *obj);
+
+	/*
+		Adds to dst the active objects colliding with other objects whose
+		collision boxes touch box. Used by collisionMoveSimple().
+	*/
+	void getCollidingObjects(const aabb3f &box,
+			std::vector<ActiveObject*> &dst)
+		{ m_object_collision_grid.getObjectsInBox(box, dst); }
 	
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
@@ -317,6 +404,12 @@ class ServerEnvironment : public Environment
 	
 private:
 
+	/*
+		Find out which file each player is saved in; if load is true,
+		also load the players
+	*/
+	void indexPlayerFiles(const std::string &players_path, bool load);
+
 	/*
 		Internal ActiveObject interface
 		-------------------------------------------
@@ -367,6 +460,10 @@ class ServerEnvironment : public Environment
 	IGameDef *m_gamedef;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Positions of m_active_objects
+	ActiveObjectIndex m_active_object_index;
+	// Collision boxes of m_active_objects, refreshed every step
+	ObjectCollisionGrid m_object_collision_grid;
 	// Outgoing network message buffer for active objects
 	std::list<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -390,6 +487,13 @@ class ServerEnvironment : public Environment
 	// Estimate for general maximum lag as determined by server.
 	// Can raise to high values like 15s with eg. map generation mods.
 	float m_max_lag_estimate;
+	// Player name -> player file, filled by indexPlayerFiles()
+	std::map<std::string, std::string> m_player_files;
+	bool m_player_files_indexed;
+	// Threads scanning active blocks for ABMs; NULL if scanned serially
+	WorkerPool *m_abm_scan_pool;
+	// Threads running ServerActiveObject::stepPhysics(); NULL if not used
+	WorkerPool *m_object_step_pool;
 };
 
 #ifndef SERVER
@@ -94,7 +94,7 @@ Settings *g_settings = &main_settings;
 std::string g_settings_path;
 
 // Global profiler
-Profiler main_profiler;
+Profiler main_profiler(&g_probes);
 Profiler *g_profiler = &main_profiler;
 
 // Menu clouds are created later
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "util/directiontables.h"
 #include "util/mathconstants.h"
+#include "util/thread.h"
 #include "rollback_interface.h"
 #include "environment.h"
 #include "emerge.h"
@@ -73,7 +74,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_liquid_pool(NULL),
+	m_unload_count(0)
 {
 }
 
@@ -87,6 +90,8 @@ Map::~Map()
 	{
 		delete i->second;
 	}
+
+	delete m_liquid_pool;
 }
 
 void Map::addEventReceiver(MapEventReceiver *event_receiver)
@@ -144,14 +149,14 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 	return sector;
 }
 
-MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
+void Map::indexBlock(MapBlock *block)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	m_block_index.insert(block->getPos(), block);
+}
+
+void Map::unindexBlock(v3s16 p)
+{
+	m_block_index.remove(p);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -1492,6 +1497,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 			{
 				all_blocks_deleted = false;
 				block_count_all++;
+				block->stepNetworkCache(dtime);
 			}
 		}
 
@@ -1505,6 +1511,8 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
 
+	m_unload_count += deleted_blocks_count;
+
 	if(deleted_blocks_count != 0)
 	{
 		PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1998,6 +2006,389 @@ void Map::transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks)
 	updateLighting(lighting_modified_blocks, modified_blocks);
 }
 
+/*
+	Transforms a single queued liquid node. The map is accessed through
+	T, so that this can be run both directly on the map and on the
+	blocks of a LiquidRegionJob. T has to provide:
+
+		MapNode getNode(v3s16 p);
+		// Sets p (which was oldnode) to newnode
+		void setNode(v3s16 p, MapNode &oldnode, MapNode &newnode);
+		// Queues p for transformation on the next run
+		void pushTransforming(v3s16 p);
+		// Queues p0 again, as its viscosity kept it from changing fully
+		void pushReflow(v3s16 p);
+*/
+template<typename T>
+static void transformLiquidNode(T &map, INodeDefManager *nodemgr, v3s16 p0)
+{
+	MapNode n0 = map.getNode(p0);
+
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	content_t liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = nodemgr->get(n0).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
+
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
+				break;
+			case 4:
+				nt = NEIGHBOR_LOWER;
+				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb = {map.getNode(npos), nt, npos};
+		switch (nodemgr->get(nb.n.getContent()).liquid_type) {
+			case LIQUID_NONE:
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						map.pushTransforming(npos);
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(dirs[i].Y != -1)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
+				if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
+				break;
+		}
+	}
+
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+	u8 range = rangelim(nodemgr->get(liquid_kind).liquid_range, 0, LIQUID_LEVEL_MAX+1);
+	if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+		if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
+			new_node_content = CONTENT_AIR;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
+					break;
+				case NEIGHBOR_LOWER:
+					break;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
+					}
+					break;
+			}
+		}
+
+		u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				map.pushReflow(p0);
+		} else
+			new_node_level = max_node_level;
+
+		if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = CONTENT_AIR;
+
+	}
+
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
+
+
+	/*
+		update the current node
+	 */
+	MapNode n00 = n0;
+	//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+
+	map.setNode(p0, n00, n0);
+
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (nodemgr->get(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					map.pushTransforming(flows[i].p);
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					map.pushTransforming(airs[i].p);
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				map.pushTransforming(flows[i].p);
+			break;
+	}
+}
+
+/*
+	Gives transformLiquidNode() direct access to the map
+*/
+class LiquidMapAccess
+{
+public:
+	LiquidMapAccess(Map *map, UniqueQueue<v3s16> &transforming,
+			UniqueQueue<v3s16> &must_reflow,
+			std::map<v3s16, MapBlock*> &modified_blocks,
+			std::map<v3s16, MapBlock*> &lighting_modified_blocks):
+		m_map(map),
+		m_transforming(transforming),
+		m_must_reflow(must_reflow),
+		m_modified_blocks(modified_blocks),
+		m_lighting_modified_blocks(lighting_modified_blocks)
+	{}
+
+	MapNode getNode(v3s16 p)
+		{ return m_map->getNodeNoEx(p); }
+	void setNode(v3s16 p, MapNode &oldnode, MapNode &newnode)
+	{
+		m_map->setNode(p, newnode);
+		m_map->reportLiquidChange(p, oldnode, newnode,
+				m_modified_blocks, m_lighting_modified_blocks);
+	}
+	void pushTransforming(v3s16 p)
+		{ m_transforming.push_back(p); }
+	void pushReflow(v3s16 p)
+		{ m_must_reflow.push_back(p); }
+
+private:
+	Map *m_map;
+	UniqueQueue<v3s16> &m_transforming;
+	UniqueQueue<v3s16> &m_must_reflow;
+	std::map<v3s16, MapBlock*> &m_modified_blocks;
+	std::map<v3s16, MapBlock*> &m_lighting_modified_blocks;
+};
+
+/*
+	The queued liquid nodes of one MapBlock, transformed by a worker
+	thread. The jobs that run at the same time are for blocks that are
+	not next to each other, so a job can read the neighboring blocks and
+	write its own one without locking. The changes are applied to the
+	rest of the map by the main thread afterwards.
+*/
+struct LiquidRegionJob
+{
+	struct Change
+	{
+		v3s16 p;
+		MapNode oldnode;
+		MapNode newnode;
+	};
+
+	v3s16 blockpos;
+	// The block and its neighbors, NULL if not loaded; index with
+	// (z+1)*9 + (y+1)*3 + (x+1)
+	MapBlock *blocks[27];
+	// Queued nodes in the block, in queue order
+	std::vector<v3s16> nodes;
+
+	std::vector<Change> changes;
+	std::vector<v3s16> transforming;
+	std::vector<v3s16> reflow;
+
+	// Nodes are never more than one node outside of the block
+	MapNode getNode(v3s16 p)
+	{
+		v3s16 bp = getNodeBlockPos(p);
+		v3s16 d = bp - blockpos;
+		MapBlock *block = blocks[(d.Z+1)*9 + (d.Y+1)*3 + (d.X+1)];
+		if(block == NULL)
+			return MapNode(CONTENT_IGNORE);
+		return block->getNodeNoCheck(p - bp*MAP_BLOCKSIZE);
+	}
+	void setNode(v3s16 p, MapNode &oldnode, MapNode &newnode)
+	{
+		// Never allow placing CONTENT_IGNORE, see Map::setNode()
+		if(newnode.getContent() == CONTENT_IGNORE)
+			return;
+		MapBlock *block = blocks[13];
+		if(block == NULL)
+			return;
+		block->setNodeNoCheck(p - blockpos*MAP_BLOCKSIZE, newnode);
+		Change c = {p, oldnode, newnode};
+		changes.push_back(c);
+	}
+	void pushTransforming(v3s16 p)
+		{ transforming.push_back(p); }
+	void pushReflow(v3s16 p)
+		{ reflow.push_back(p); }
+};
+
+class LiquidJobList : public ParallelJobList
+{
+public:
+	LiquidJobList(std::vector<LiquidRegionJob*> &jobs,
+			INodeDefManager *nodemgr):
+		m_jobs(jobs),
+		m_nodemgr(nodemgr)
+	{}
+
+	u32 getJobCount()
+	{
+		return m_jobs.size();
+	}
+
+	void runJob(u32 i, u16 worker)
+	{
+		LiquidRegionJob &job = *m_jobs[i];
+		for(std::vector<v3s16>::iterator
+				n = job.nodes.begin(); n != job.nodes.end(); ++n)
+			transformLiquidNode(job, m_nodemgr, *n);
+	}
+
+private:
+	std::vector<LiquidRegionJob*> &m_jobs;
+	INodeDefManager *m_nodemgr;
+};
+
+void Map::reportLiquidChange(v3s16 p, MapNode &oldnode, MapNode &newnode,
+		std::map<v3s16, MapBlock*> &modified_blocks,
+		std::map<v3s16, MapBlock*> &lighting_modified_blocks)
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+
+	// Find out whether there is a suspect for this action
+	std::string suspect;
+	if(m_gamedef->rollback()){
+		suspect = m_gamedef->rollback()->getSuspect(p, 83, 1);
+	}
+
+	if(!suspect.empty()){
+		// Blame suspect
+		RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+		// The node has already been set; only the node changed, not the
+		// metadata
+		RollbackNode rollback_newnode(this, p, m_gamedef);
+		RollbackNode rollback_oldnode = rollback_newnode;
+		rollback_oldnode.name = nodemgr->get(oldnode).name;
+		rollback_oldnode.param1 = oldnode.param1;
+		rollback_oldnode.param2 = oldnode.param2;
+		// Report
+		RollbackAction action;
+		action.setSetNode(p, rollback_oldnode, rollback_newnode);
+		m_gamedef->rollback()->reportAction(action);
+	}
+
+	v3s16 blockpos = getNodeBlockPos(p);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
+	if(block != NULL) {
+		modified_blocks[blockpos] =  block;
+		// If new or old node emits light, MapBlock requires lighting update
+		if(nodemgr->get(newnode).light_source != 0 ||
+				nodemgr->get(oldnode).light_source != 0)
+			lighting_modified_blocks[block->getPos()] = block;
+	}
+}
+
 void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 {
 
@@ -2015,6 +2406,8 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	/*if(initial_size != 0)
 		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
 
+	g_profiler->avg("Map: liquid queue length", initial_size);
+
 	// list of nodes that due to viscosity have not reached their max level height
 	UniqueQueue<v3s16> must_reflow;
 
@@ -2022,257 +2415,124 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks)
 	std::map<v3s16, MapBlock*> lighting_modified_blocks;
 
 	u16 loop_max = g_settings->getU16("liquid_loop_max");
-
-	while(m_transforming_liquid.size() != 0)
+	// Unless set, only the parallel transforming has a time limit, so that
+	// liquids flow as they always did without liquid_threads
+	float max_time = 0;
+	if(!g_settings->getFloatNoEx("liquid_max_time", max_time) && m_liquid_pool)
+		max_time = 0.05;
+	u32 max_time_ms = max_time * 1000;
+	u32 start_ms = porting::getTimeMs();
+
+	if(m_liquid_pool == NULL)
 	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size || loopcount >= loop_max)
-			break;
-		loopcount++;
-
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+		LiquidMapAccess access(this, m_transforming_liquid, must_reflow,
+				modified_blocks, lighting_modified_blocks);
 
-		MapNode n0 = getNodeNoEx(p0);
-
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		content_t liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = nodemgr->get(n0).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = nodemgr->getId(nodemgr->get(n0).liquid_alternative_flowing);
+		while(m_transforming_liquid.size() != 0)
+		{
+			// This should be done here so that it is done when continue is used
+			if(loopcount >= initial_size || loopcount >= loop_max)
 				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
+			// Leave the rest for the next time if this has taken too long
+			if(max_time_ms != 0 && loopcount % 64 == 0 &&
+					porting::getTimeMs() - start_ms > max_time_ms)
 				break;
-			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
-				break;
-		}
+			loopcount++;
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
-					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(dirs[i].Y != -1)
-							sources[num_sources++] = nb;
-					}
-					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing);
-					if (nodemgr->getId(nodemgr->get(nb.n).liquid_alternative_flowing) != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					}
-					break;
-			}
-		}
+			/*
+				Get a queued transforming liquid node
+			*/
+			v3s16 p0 = m_transforming_liquid.pop_front();
 
+			transformLiquidNode(access, nodemgr, p0);
+		}
+	}
+	else
+	{
 		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		u8 range = rangelim(nodemgr->get(liquid_kind).liquid_range, 0, LIQUID_LEVEL_MAX+1);
-		if ((num_sources >= 2 && nodemgr->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = nodemgr->getId(nodemgr->get(liquid_kind).liquid_alternative_source);
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
-			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-			if (new_node_level < (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = CONTENT_AIR;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
+			Group the queued nodes by block. Blocks are transformed in
+			parallel in eight rounds, one for each combination of the
+			parities of the block coordinates; blocks of the same round
+			are never next to each other.
+		*/
+		std::map<v3s16, LiquidRegionJob*> jobs_by_pos;
+		std::vector<LiquidRegionJob*> rounds[8];
+		while(m_transforming_liquid.size() != 0 &&
+				loopcount < initial_size && loopcount < loop_max)
+		{
+			loopcount++;
+			v3s16 p0 = m_transforming_liquid.pop_front();
+			v3s16 blockpos = getNodeBlockPos(p0);
+			LiquidRegionJob *&job = jobs_by_pos[blockpos];
+			if(job == NULL){
+				job = new LiquidRegionJob;
+				job->blockpos = blockpos;
+				for(s16 z=-1; z<=1; z++)
+				for(s16 y=-1; y<=1; y++)
+				for(s16 x=-1; x<=1; x++)
+				{
+					MapBlock *block =
+							getBlockNoCreateNoEx(blockpos + v3s16(x,y,z));
+					if(block && block->isDummy())
+						block = NULL;
+					job->blocks[(z+1)*9 + (y+1)*3 + (x+1)] = block;
 				}
+				rounds[(blockpos.X & 1) | (blockpos.Y & 1) << 1 |
+						(blockpos.Z & 1) << 2].push_back(job);
 			}
-
-			u8 viscosity = nodemgr->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (max_node_level >= (LIQUID_LEVEL_MAX+1-range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
-
+			job->nodes.push_back(p0);
 		}
 
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (nodemgr->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
-
+		g_profiler->avg("Map: liquid blocks", jobs_by_pos.size());
 
-		/*
-			update the current node
-		 */
-		MapNode n00 = n0;
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-		n0.setContent(new_node_content);
-
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if(m_gamedef->rollback()){
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
-		}
-
-		if(!suspect.empty()){
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
-		}
-
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks[blockpos] =  block;
-			// If new or old node emits light, MapBlock requires lighting update
-			if(nodemgr->get(n0).light_source != 0 ||
-					nodemgr->get(n00).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
+		for(u32 r = 0; r < 8; r++)
+		{
+			// Leave the remaining rounds for the next time if this has
+			// taken too long
+			if(max_time_ms != 0 &&
+					porting::getTimeMs() - start_ms > max_time_ms)
+			{
+				for(; r < 8; r++)
+				{
+					for(std::vector<LiquidRegionJob*>::iterator
+							i = rounds[r].begin(); i != rounds[r].end(); ++i)
+					{
+						LiquidRegionJob *job = *i;
+						for(std::vector<v3s16>::iterator
+								n = job->nodes.begin(); n != job->nodes.end(); ++n)
+							m_transforming_liquid.push_back(*n);
+						job->nodes.clear();
+					}
+				}
+				break;
+			}
+			LiquidJobList joblist(rounds[r], nodemgr);
+			m_liquid_pool->run(&joblist);
 		}
 
 		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (nodemgr->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+			Apply the results to the rest of the map
+		*/
+		for(std::map<v3s16, LiquidRegionJob*>::iterator
+				i = jobs_by_pos.begin(); i != jobs_by_pos.end(); ++i)
+		{
+			LiquidRegionJob *job = i->second;
+			for(std::vector<LiquidRegionJob::Change>::iterator
+					c = job->changes.begin(); c != job->changes.end(); ++c)
+				reportLiquidChange(c->p, c->oldnode, c->newnode,
+						modified_blocks, lighting_modified_blocks);
+			for(std::vector<v3s16>::iterator
+					p = job->transforming.begin(); p != job->transforming.end(); ++p)
+				m_transforming_liquid.push_back(*p);
+			for(std::vector<v3s16>::iterator
+					p = job->reflow.begin(); p != job->reflow.end(); ++p)
+				must_reflow.push_back(*p);
+			delete job;
 		}
 	}
+
+	g_profiler->avg("Map: liquid nodes transformed", loopcount);
+
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 	while (must_reflow.size() > 0)
 		m_transforming_liquid.push_back(must_reflow.pop_front());
@@ -2314,6 +2574,7 @@ bool Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return false;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->expireNetworkSerialization();
 	return true;
 }
 
@@ -2329,6 +2590,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->expireNetworkSerialization();
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -2412,6 +2674,10 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
+	u16 liquid_threads = g_settings->getU16("liquid_threads");
+	if(liquid_threads > 0)
+		m_liquid_pool = new WorkerPool(liquid_threads, "LiquidThread");
+
 	/*
 		Try to load map; if not found, create a new one.
 	*/
@@ -2440,6 +2706,9 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
+	m_has_sector_files =
+			fs::PathExists(m_savedir + DIR_DELIM + "sectors") ||
+			fs::PathExists(m_savedir + DIR_DELIM + "sectors2");
 
 	try
 	{
@@ -2554,19 +2823,27 @@ s16 ServerMap::getWaterLevel()
 	return m_emerge->params.water_level;
 }
 
-bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
+void ServerMap::getChunkArea(v3s16 blockpos, v3s16 &blockpos_min,
+		v3s16 &blockpos_max)
 {
-	bool enable_mapgen_debug_info = m_emerge->mapgen_debug_info;
-	EMERGE_DBG_OUT("initBlockMake(): " PP(blockpos) " - " PP(blockpos));
-
 	s16 chunksize = m_emerge->params.chunksize;
 	s16 coffset = -chunksize / 2;
 	v3s16 chunk_offset(coffset, coffset, coffset);
 	v3s16 blockpos_div = getContainerPos(blockpos - chunk_offset, chunksize);
-	v3s16 blockpos_min = blockpos_div * chunksize;
-	v3s16 blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
+	blockpos_min = blockpos_div * chunksize;
+	blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
 	blockpos_min += chunk_offset;
 	blockpos_max += chunk_offset;
+}
+
+bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos,
+		bool load_area)
+{
+	bool enable_mapgen_debug_info = m_emerge->mapgen_debug_info;
+	EMERGE_DBG_OUT("initBlockMake(): " PP(blockpos) " - " PP(blockpos));
+
+	v3s16 blockpos_min, blockpos_max;
+	getChunkArea(blockpos, blockpos_min, blockpos_max);
 
 	v3s16 extra_borders(1,1,1);
 
@@ -2587,6 +2864,11 @@ bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
 	{
 		//TimeTaker timer("initBlockMake() create area");
 
+		// Load what exists of the area from disk at once
+		if(load_area)
+			loadBlocks(blockpos_min - extra_borders,
+					blockpos_max + extra_borders);
+
 		for(s16 x=blockpos_min.X-extra_borders.X;
 				x<=blockpos_max.X+extra_borders.X; x++)
 		for(s16 z=blockpos_min.Z-extra_borders.Z;
@@ -2602,9 +2884,11 @@ bool ServerMap::initBlockMake(BlockMakeData *data, v3s16 blockpos)
 			{
 				v3s16 p(x,y,z);
 				//MapBlock *block = createBlock(p);
-				// 1) get from memory, 2) load from disk
-				MapBlock *block = emergeBlock(p, false);
-				// 3) create a blank one
+				// 1) get from memory (loaded from disk above)
+				MapBlock *block = getBlockNoCreateNoEx(p);
+				if(block && block->isDummy())
+					block = NULL;
+				// 2) create a blank one
 				if(block == NULL)
 				{
 					block = createBlock(p);
@@ -3766,12 +4050,18 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSecto
 	}
 }
 
-void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+/*
+	Reads block data as stored in the database into block.
+	Returns false if the data is invalid but ignore_world_load_errors is
+	set; throws SerializationError if it isn't set.
+*/
+static bool deSerializeBlockData(MapBlock *block, const std::string &data,
+		bool defer_node_ids=false)
 {
-	DSTACK(__FUNCTION_NAME);
+	v3s16 p3d = block->getPos();
 
 	try {
-		std::istringstream is(*blob, std::ios_base::binary);
+		std::istringstream is(data, std::ios_base::binary);
 
 		u8 version = SER_FMT_VER_INVALID;
 		is.read((char*)&version, 1);
@@ -3780,41 +4070,11 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 			throw SerializationError("ServerMap::loadBlock(): Failed"
 					" to read MapBlock version");
 
-		/*u32 block_size = MapBlock::serializedLength(version);
-		SharedBuffer<u8> data(block_size);
-		is.read((char*)*data, block_size);*/
-
-		// This will always return a sector because we're the server
-		//MapSector *sector = emergeSector(p2d);
-
-		MapBlock *block = NULL;
-		bool created_new = false;
-		block = sector->getBlockNoCreateNoEx(p3d.Y);
-		if(block == NULL)
-		{
-			block = sector->createBlankBlockNoInsert(p3d.Y);
-			created_new = true;
-		}
-
 		// Read basic data
-		block->deSerialize(is, version, true);
-
-		// If it's a new block, insert it to the map
-		if(created_new)
-			sector->insertBlock(block);
-
-		/*
-			Save blocks loaded in old format in new format
-		*/
-
-		//if(version < SER_FMT_VER_HIGHEST_READ || save_after_load)
-		// Only save if asked to; no need to update version
-		if(save_after_load)
-			saveBlock(block);
-
-		// We just loaded it from, so it's up-to-date.
-		block->resetModified();
-
+		if(defer_node_ids)
+			block->deSerializeDeferNodeIds(is, version);
+		else
+			block->deSerialize(is, version, true);
 	}
 	catch(SerializationError &e)
 	{
@@ -3828,11 +4088,144 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		if(g_settings->getBool("ignore_world_load_errors")){
 			errorstream<<"Ignoring block load error. Duck and cover! "
 					<<"(ignore_world_load_errors)"<<std::endl;
+			return false;
 		} else {
 			throw SerializationError("Invalid block data in database");
 			//assert(0);
 		}
 	}
+
+	return true;
+}
+
+void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	/*u32 block_size = MapBlock::serializedLength(version);
+	SharedBuffer<u8> data(block_size);
+	is.read((char*)*data, block_size);*/
+
+	// This will always return a sector because we're the server
+	//MapSector *sector = emergeSector(p2d);
+
+	MapBlock *block = NULL;
+	bool created_new = false;
+	block = sector->getBlockNoCreateNoEx(p3d.Y);
+	if(block == NULL)
+	{
+		block = sector->createBlankBlockNoInsert(p3d.Y);
+		created_new = true;
+	}
+
+	if(!deSerializeBlockData(block, *blob))
+	{
+		if(created_new)
+			delete block;
+		return;
+	}
+
+	// If it's a new block, insert it to the map
+	if(created_new)
+		sector->insertBlock(block);
+
+	/*
+		Save blocks loaded in old format in new format
+	*/
+
+	//if(version < SER_FMT_VER_HIGHEST_READ || save_after_load)
+	// Only save if asked to; no need to update version
+	if(save_after_load)
+		saveBlock(block);
+
+	// We just loaded it from, so it's up-to-date.
+	block->resetModified();
+}
+
+// Whether readBlock() can deserialize the data without the node definitions
+static bool canReadBlockData(const std::string &data)
+{
+	return (u8)data[0] >= 22;
+}
+
+MapBlock* ServerMap::readBlock(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string data = dbase->loadBlock(blockpos);
+	if(data.empty() || !canReadBlockData(data))
+		return NULL;
+
+	MapBlock *block = new MapBlock(this, blockpos, m_gamedef);
+	if(!deSerializeBlockData(block, data, true))
+	{
+		delete block;
+		return NULL;
+	}
+
+	// We just loaded it from, so it's up-to-date.
+	block->resetModified();
+	return block;
+}
+
+bool ServerMap::insertReadBlock(MapBlock *block, u32 unload_count)
+{
+	v3s16 p = block->getPos();
+	if(getBlockNoCreateNoEx(p) != NULL || getUnloadCount() != unload_count)
+	{
+		delete block;
+		return false;
+	}
+
+	block->correctNodeIds();
+
+	MapSector *sector = createSector(v2s16(p.X, p.Z));
+	sector->insertBlock(block);
+	return true;
+}
+
+bool ServerMap::insertReadArea(std::vector<MapBlock*> &blocks,
+		bool all_read, u32 unload_count)
+{
+	bool complete = all_read && getUnloadCount() == unload_count;
+	for(u32 i = 0; i < blocks.size(); i++)
+	{
+		if(blocks[i] && !insertReadBlock(blocks[i], unload_count))
+			complete = false;
+	}
+	return complete;
+}
+
+bool ServerMap::readBlocks(const std::vector<v3s16> &positions,
+		std::vector<MapBlock*> &blocks)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::vector<std::string> data;
+	dbase->loadBlocks(positions, data);
+
+	bool all_read = true;
+	blocks.resize(positions.size());
+	for(u32 i = 0; i < positions.size(); i++)
+	{
+		blocks[i] = NULL;
+		if(data[i].empty())
+			continue;
+		if(!canReadBlockData(data[i]))
+		{
+			all_read = false;
+			continue;
+		}
+		MapBlock *block = new MapBlock(this, positions[i], m_gamedef);
+		if(!deSerializeBlockData(block, data[i], true))
+		{
+			delete block;
+			continue;
+		}
+		block->resetModified();
+		blocks[i] = block;
+	}
+	return all_read;
 }
 
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
@@ -3841,11 +4234,57 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
-	MapBlock *ret;
-
-	ret = dbase->loadBlock(blockpos);
-	if (ret) return (ret);
+	std::string data = dbase->loadBlock(blockpos);
+	if(!data.empty())
+	{
+		MapSector *sector = createSector(p2d);
+		loadBlock(&data, blockpos, sector, false);
+		return getBlockNoCreateNoEx(blockpos);
+	}
 	// Not found in database, try the files
+	return loadBlockFromFiles(blockpos);
+}
+
+void ServerMap::loadBlocks(v3s16 blockpos_min, v3s16 blockpos_max)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::vector<v3s16> positions;
+	for(s16 z=blockpos_min.Z; z<=blockpos_max.Z; z++)
+	for(s16 y=blockpos_min.Y; y<=blockpos_max.Y; y++)
+	for(s16 x=blockpos_min.X; x<=blockpos_max.X; x++)
+	{
+		v3s16 p(x,y,z);
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if(block == NULL || block->isDummy())
+			positions.push_back(p);
+	}
+
+	if(positions.empty())
+		return;
+
+	std::vector<std::string> data;
+	dbase->loadBlocks(positions, data);
+
+	for(u32 i = 0; i < positions.size(); i++)
+	{
+		v3s16 p = positions[i];
+		if(data[i].empty())
+		{
+			// Not found in database, try the files
+			loadBlockFromFiles(p);
+			continue;
+		}
+		MapSector *sector = createSector(v2s16(p.X, p.Z));
+		loadBlock(&data[i], p, sector, false);
+	}
+}
+
+MapBlock* ServerMap::loadBlockFromFiles(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -4147,6 +4586,10 @@ void ManualMapVoxelManipulator::initialEmerge(v3s16 blockpos_min,
 
 	addArea(block_area_nodes);
 
+	// Load what exists of the area from disk at once
+	if(load_if_inexistent)
+		((ServerMap *)m_map)->loadBlocks(p_min, p_max);
+
 	for(s32 z=p_min.Z; z<=p_max.Z; z++)
 	for(s32 y=p_min.Y; y<=p_max.Y; y++)
 	for(s32 x=p_min.X; x<=p_max.X; x++)
@@ -4179,12 +4622,9 @@ void ManualMapVoxelManipulator::initialEmerge(v3s16 blockpos_min,
 		{
 			
 			if (load_if_inexistent) {
+				// Not on disk either, see loadBlocks() above
 				ServerMap *svrmap = (ServerMap *)m_map;
-				block = svrmap->emergeBlock(p, false);
-				if (block == NULL)
-					block = svrmap->createBlock(p);
-				else
-					block->copyTo(*this);
+				block = svrmap->createBlock(p);
 			} else {
 				flags |= VMANIP_BLOCK_DATA_INEXIST;
 				
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "modifiedstate.h"
 #include "util/container.h"
 #include "nodetimer.h"
+#include "mapblockindex.h"
 
 class Database;
 class ClientMap;
@@ -44,6 +45,7 @@ class IGameDef;
 class IRollbackReportSink;
 class EmergeManager;
 class ServerEnvironment;
+class WorkerPool;
 struct BlockMakeData;
 struct MapgenParams;
 
@@ -186,7 +188,15 @@ class Map /*: public NodeContainer*/
 	// Returns InvalidPositionException if not found
 	MapBlock * getBlockNoCreate(v3s16 p);
 	// Returns NULL if not found
-	MapBlock * getBlockNoCreateNoEx(v3s16 p);
+	MapBlock * getBlockNoCreateNoEx(v3s16 p)
+	{ return m_block_index.find(p); }
+
+	/*
+		Called by MapSector when it adds or removes a block, to keep
+		the block index up to date
+	*/
+	void indexBlock(MapBlock *block);
+	void unindexBlock(v3s16 p);
 
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true)
@@ -285,6 +295,10 @@ class Map /*: public NodeContainer*/
 	*/
 	void unloadUnreferencedBlocks(std::list<v3s16> *unloaded_blocks=NULL);
 
+	// Number of blocks unloaded by timerUpdate() so far
+	u32 getUnloadCount()
+		{ return m_unload_count; }
+
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
 	// If deleted sector is in sector cache, clears cache
@@ -304,6 +318,13 @@ class Map /*: public NodeContainer*/
 	virtual void PrintInfo(std::ostream &out);
 
 	void transformLiquids(std::map<v3s16, MapBlock*> & modified_blocks);
+	/*
+		Reports a node set by the liquid transform to the rollback and
+		marks its block modified
+	*/
+	void reportLiquidChange(v3s16 p, MapNode &oldnode, MapNode &newnode,
+			std::map<v3s16, MapBlock*> &modified_blocks,
+			std::map<v3s16, MapBlock*> &lighting_modified_blocks);
 	void transformLiquidsFinite(std::map<v3s16, MapBlock*> & modified_blocks);
 
 	/*
@@ -369,8 +390,16 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	// All the blocks of all the sectors
+	MapBlockIndex m_block_index;
+
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+	// Transforms the queued liquid nodes of many blocks at once; NULL if
+	// they are transformed one at a time on the calling thread
+	WorkerPool *m_liquid_pool;
+
+	u32 m_unload_count;
 };
 
 /*
@@ -403,8 +432,17 @@ class ServerMap : public Map
 
 	/*
 		Blocks are generated by using these and makeBlock().
+
+		If load_area is false, the blocks of the area that are not in
+		memory are not looked for on disk; the caller has already loaded
+		them (see readBlocks()).
 	*/
-	bool initBlockMake(BlockMakeData *data, v3s16 blockpos);
+	bool initBlockMake(BlockMakeData *data, v3s16 blockpos,
+			bool load_area=true);
+	// The blocks of the chunk that contains blockpos, without the
+	// neighboring blocks
+	void getChunkArea(v3s16 blockpos, v3s16 &blockpos_min,
+			v3s16 &blockpos_max);
 	MapBlock *finishBlockMake(BlockMakeData *data,
 			std::map<v3s16, MapBlock*> &changed_blocks);
 
@@ -493,9 +531,58 @@ class ServerMap : public Map
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+	/*
+		Loads the blocks in the area that are not in memory (or are
+		dummies), reading the database with a single bulk query.
+		Blocks that don't exist are not created.
+	*/
+	void loadBlocks(v3s16 blockpos_min, v3s16 blockpos_max);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Loading a block from the database in two steps, so that the slow
+		part can be done without holding the environment lock.
+
+		readBlock() reads and deserializes the block into a new MapBlock
+		that is not part of the map. It doesn't touch the map nor the node
+		definitions. Returns NULL if the block isn't in the database, or
+		if it is stored in a format older than version 22 which can only
+		be read by loadBlock().
+
+		insertReadBlock() converts the node ids of such a block, which may
+		allocate ids for unknown nodes, and puts it into the map. If the
+		map got a block at the same position meanwhile, or blocks have been
+		unloaded (and maybe saved) since getUnloadCount() returned
+		unload_count, the read block may be outdated; it is then deleted
+		and false is returned.
+	*/
+	MapBlock* readBlock(v3s16 p);
+	bool insertReadBlock(MapBlock *block, u32 unload_count);
+	// Like readBlock(), for many blocks with a single bulk query; blocks
+	// gets NULL for the ones not read. Returns false if some of them are
+	// in the database but have to be loaded by loadBlock().
+	bool readBlocks(const std::vector<v3s16> &positions,
+			std::vector<MapBlock*> &blocks);
+	/*
+		Inserts blocks of a chunk area read by readBlocks(), skipping the
+		NULL ones. Returns false if initBlockMake() still has to load the
+		area: if all_read is false, if a read block was outdated, or if
+		blocks have been unloaded since unload_count, as the ones that were
+		in memory then (and so not read) may be gone.
+	*/
+	bool insertReadArea(std::vector<MapBlock*> &blocks, bool all_read,
+			u32 unload_count);
+	// Whether blocks can also be in the sectors/ files of old worlds,
+	// which readBlock() and readBlocks() don't read
+	bool hasSectorFiles()
+	{ return m_has_sector_files; }
+
+private:
+	// Loads a block from the sectors/ or sectors2/ files of old worlds
+	MapBlock* loadBlockFromFiles(v3s16 p);
+public:
+
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 
@@ -513,6 +600,7 @@ class ServerMap : public Map
 
 	std::string m_savedir;
 	bool m_map_saving_enabled;
+	bool m_has_sector_files;
 
 #if 0
 	// Chunk size in MapSectors
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -57,11 +58,21 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_contents_expired(true),
+		m_network_serialization_version(0),
+		m_network_version(0),
+		m_network_version_expired(true),
+		m_network_changes_started(false),
+		m_network_changes_base(0),
+		m_network_changes(NULL),
+		m_network_delta_version(0),
+		m_network_cache_timer(0),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_usage_timer(0),
-		m_refcount(0)
+		m_refcount(0),
+		m_deferred_nimap(NULL)
 {
 	data = NULL;
 	if(dummy == false)
@@ -88,6 +99,9 @@ MapBlock::~MapBlock()
 
 	if(data)
 		delete[] data;
+
+	delete m_network_changes;
+	delete m_deferred_nimap;
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -126,6 +140,9 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		addContent(n.getContent());
+		recordNetworkChange(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
+		expireNetworkSerialization();
 	}
 }
 
@@ -175,6 +192,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 {
 	INodeDefManager *nodemgr = m_gamedef->ndef();
 
+	// Light is written directly to the nodes below
+	expireNetworkSerialization();
+
 	// Whether the sunlight at the top of the bottom block is valid
 	bool block_below_is_valid = true;
 	
@@ -285,6 +305,9 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 				if(current_light > old_light || remove_light)
 				{
 					n.setLight(LIGHTBANK_DAY, current_light, nodemgr);
+					if(current_light != old_light)
+						recordNetworkChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE
+								+ y*MAP_BLOCKSIZE + x);
 				}
 				
 				if(diminish_light(current_light) != 0)
@@ -356,9 +379,27 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
+	// Keep what the nodes were to record which of them change
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	MapNode *old_data = NULL;
+	if(m_network_changes_started){
+		old_data = new MapNode[nodecount];
+		std::copy(data, data + nodecount, old_data);
+	}
+
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	expireContents();
+	expireNetworkSerialization();
+
+	if(old_data){
+		for(u32 i=0; i<nodecount && m_network_changes_started; i++){
+			if(!(data[i] == old_data[i]))
+				recordNetworkChange(i);
+		}
+		delete[] old_data;
+	}
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -425,6 +466,35 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::actuallyUpdateContents()
+{
+	// Running this function un-expires m_contents
+	m_contents_expired = false;
+	m_contents.clear();
+
+	if(data == NULL)
+		return;
+
+	/*
+		Look up each node in a bitmap of seen ids; nodes mostly repeat the
+		previous one, so check that first.
+	*/
+	// Every content_t value, as unregistered ids can be stored too
+	std::vector<bool> seen(0x10000, false);
+	content_t last = data[0].getContent();
+	seen[last] = true;
+	m_contents.push_back(last);
+	for(u32 i=1; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	{
+		content_t c = data[i].getContent();
+		if(c == last || seen[c])
+			continue;
+		seen[c] = true;
+		last = c;
+		m_contents.push_back(c);
+	}
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -637,6 +707,177 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	}
 }
 
+const std::string & MapBlock::getNetworkSerialization(u8 version)
+{
+	m_network_cache_timer = 0;
+	if(m_network_serialization.empty() ||
+			m_network_serialization_version != version)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		serialize(os, version, false);
+		m_network_serialization = os.str();
+		m_network_serialization_version = version;
+	}
+	return m_network_serialization;
+}
+
+// Handed out by getNetworkVersion(); only used with the environment locked
+static u32 g_block_network_version = 0;
+
+u32 MapBlock::getNetworkVersion()
+{
+	if(m_network_version_expired)
+	{
+		m_network_version = ++g_block_network_version;
+		m_network_version_expired = false;
+	}
+	return m_network_version;
+}
+
+void MapBlock::startNetworkChanges()
+{
+	stopNetworkChanges();
+	m_network_changes_base = getNetworkVersion();
+	m_network_changes_started = true;
+}
+
+void MapBlock::stopNetworkChanges()
+{
+	delete m_network_changes;
+	m_network_changes = NULL;
+	m_network_changed_nodes.clear();
+	m_network_changes_started = false;
+	m_network_delta.clear();
+}
+
+bool MapBlock::canSendNetworkDelta(u32 version)
+{
+	return m_network_changes_started && version >= m_network_changes_base;
+}
+
+const std::string & MapBlock::getNetworkDelta(u8 version)
+{
+	assert(m_network_changes_started);
+	m_network_cache_timer = 0;
+
+	if(m_network_delta.empty() || m_network_delta_version != version)
+	{
+		std::ostringstream os(std::ios_base::binary);
+
+		// Same flags as in serialize()
+		u8 flags = 0;
+		if(is_underground)
+			flags |= 0x01;
+		if(getDayNightDiff())
+			flags |= 0x02;
+		if(m_lighting_expired)
+			flags |= 0x04;
+		if(m_generated == false)
+			flags |= 0x08;
+		writeU8(os, flags);
+
+		/*
+			Changed nodes
+		*/
+		u32 nodelength = MapNode::serializedLength(version);
+		std::string nodes(2 + m_network_changed_nodes.size() * (2 + nodelength),
+				'\0');
+		u8 *dest = (u8*)&nodes[0];
+		writeU16(dest, m_network_changed_nodes.size());
+		dest += 2;
+		for(std::vector<u16>::iterator i = m_network_changed_nodes.begin();
+				i != m_network_changed_nodes.end(); ++i)
+		{
+			writeU16(dest, *i);
+			data[*i].serialize(dest + 2, version);
+			dest += 2 + nodelength;
+		}
+		compressZlib(nodes, os);
+
+		/*
+			Node metadata
+		*/
+		std::ostringstream oss(std::ios_base::binary);
+		m_node_metadata.serialize(oss);
+		compressZlib(oss.str(), os);
+
+		m_network_delta = os.str();
+		m_network_delta_version = version;
+	}
+	return m_network_delta;
+}
+
+void MapBlock::stepNetworkCache(float dtime)
+{
+	if(m_network_serialization.empty() && m_network_delta.empty())
+		return;
+	m_network_cache_timer += dtime;
+	if(m_network_cache_timer > BLOCK_NETWORK_CACHE_TIMEOUT)
+	{
+		m_network_serialization.clear();
+		m_network_delta.clear();
+	}
+}
+
+void MapBlock::deSerializeNetworkDelta(std::istream &is, u8 version)
+{
+	if(data == NULL)
+		throw SerializationError("MapBlock::deSerializeNetworkDelta(): "
+				"dummy block");
+
+	u8 flags = readU8(is);
+	is_underground = (flags & 0x01) ? true : false;
+	m_day_night_differs = (flags & 0x02) ? true : false;
+	m_lighting_expired = (flags & 0x04) ? true : false;
+	m_generated = (flags & 0x08) ? false : true;
+	m_day_night_differs_expired = false;
+
+	/*
+		Changed nodes
+	*/
+	std::ostringstream nodes_os(std::ios_base::binary);
+	decompressZlib(is, nodes_os);
+	std::string nodes = nodes_os.str();
+	u32 nodelength = MapNode::serializedLength(version);
+	if(nodes.size() < 2)
+		throw SerializationError("MapBlock::deSerializeNetworkDelta(): "
+				"no node count");
+	const u8 *src = (const u8*)nodes.c_str();
+	u16 count = readU16(src);
+	src += 2;
+	if(nodes.size() < 2 + (u32)count * (2 + nodelength))
+		throw SerializationError("MapBlock::deSerializeNetworkDelta(): "
+				"truncated node list");
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	for(u16 i=0; i<count; i++)
+	{
+		u16 index = readU16(src);
+		if(index >= nodecount)
+			throw SerializationError("MapBlock::deSerializeNetworkDelta(): "
+					"node index out of range");
+		data[index].deSerialize((u8*)src + 2, version);
+		src += 2 + nodelength;
+	}
+	expireContents();
+
+	/*
+		Node metadata
+	*/
+	// Ignore errors
+	try{
+		std::ostringstream oss(std::ios_base::binary);
+		decompressZlib(is, oss);
+		std::istringstream iss(oss.str(), std::ios_base::binary);
+		m_node_metadata.deSerialize(iss, m_gamedef);
+	}
+	catch(SerializationError &e)
+	{
+		errorstream<<"WARNING: MapBlock::deSerializeNetworkDelta(): Ignoring"
+				<<" an error while deserializing node metadata at ("
+				<<PP(getPos())<<": "<<e.what()<<std::endl;
+	}
+}
+
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 {
 	if(data == NULL)
@@ -652,6 +893,35 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 	}
 }
 
+void MapBlock::deSerializeDeferNodeIds(std::istream &is, u8 version)
+{
+	if(version <= 21)
+		throw SerializationError("MapBlock::deSerializeDeferNodeIds(): "
+				"version < 22 not supported");
+
+	delete m_deferred_nimap;
+	m_deferred_nimap = new NameIdMapping;
+	try{
+		deSerialize(is, version, true);
+	}
+	catch(...)
+	{
+		delete m_deferred_nimap;
+		m_deferred_nimap = NULL;
+		throw;
+	}
+}
+
+void MapBlock::correctNodeIds()
+{
+	if(m_deferred_nimap == NULL)
+		return;
+	correctBlockNodeIds(m_deferred_nimap, data, m_gamedef);
+	delete m_deferred_nimap;
+	m_deferred_nimap = NULL;
+	expireContents();
+}
+
 void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 {
 	if(!ser_ver_supported(version))
@@ -660,6 +930,9 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
 	m_day_night_differs_expired = false;
+	expireContents();
+	expireNetworkSerialization();
+	stopNetworkChanges();
 
 	if(version <= 21)
 	{
@@ -739,12 +1012,17 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		setTimestamp(readU32(is));
 		m_disk_timestamp = m_timestamp;
 		
-		// Dynamically re-set ids based on node names
+		// Dynamically re-set ids based on node names, now or in
+		// correctNodeIds()
 		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 				<<": NameIdMapping"<<std::endl);
-		NameIdMapping nimap;
-		nimap.deSerialize(is);
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if(m_deferred_nimap){
+			m_deferred_nimap->deSerialize(is);
+		} else {
+			NameIdMapping nimap;
+			nimap.deSerialize(is);
+			correctBlockNodeIds(&nimap, data, m_gamedef);
+		}
 
 		if(version >= 25){
 			TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPBLOCK_HEADER
 
 #include <set>
+#include <vector>
+#include <bitset>
 #include "debug.h"
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -37,9 +39,22 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class NameIdMapping;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+// Beyond this many distinct contents, setNode stops extending the content
+// list and has it rebuilt on the next getContents() instead
+#define BLOCK_CONTENTS_MAX 64
+
+// Beyond this many changed nodes, a delta is no cheaper than sending the
+// whole block and changes are not recorded anymore
+#define BLOCK_NETWORK_CHANGES_MAX (MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE/8)
+
+// Seconds the cached network serialization and delta of a block are kept
+// without being used
+#define BLOCK_NETWORK_CACHE_TIMEOUT 10.0
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -127,6 +142,8 @@ class MapBlock /*: public NodeContainer*/
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		expireContents();
+		stopNetworkChanges();
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -147,6 +164,11 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		// Anything but timestamps and static objects might show up in
+		// the network serialization
+		if(mod >= MOD_STATE_WRITE_NEEDED)
+			expireNetworkSerialization();
+
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -292,6 +314,8 @@ class MapBlock /*: public NodeContainer*/
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		addContent(n.getContent());
+		recordNetworkChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -321,6 +345,8 @@ class MapBlock /*: public NodeContainer*/
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		addContent(n.getContent());
+		recordNetworkChange(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -374,6 +400,27 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Content ids present in the block.
+		May also contain ids that have since been overwritten.
+	*/
+	const std::vector<content_t> & getContents()
+	{
+		if(m_contents_expired)
+			actuallyUpdateContents();
+		return m_contents;
+	}
+	// Rebuilds m_contents from the node data
+	void actuallyUpdateContents();
+	/*
+		Call this after writing node data without the setters, so that the
+		content list is rebuilt when it is needed the next time.
+	*/
+	void expireContents()
+	{
+		m_contents_expired = true;
+	}
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -472,10 +519,59 @@ class MapBlock /*: public NodeContainer*/
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
+	/*
+		Like deSerialize(is, version, true), but leaves the node ids as
+		they are in the data until correctNodeIds() is called, so that
+		the node definitions aren't touched. Then a block can be read
+		without the environment lock; correctNodeIds() may allocate ids
+		for unknown nodes and needs it. Versions below 22 are not
+		supported, as reading them looks at the node definitions.
+	*/
+	void deSerializeDeferNodeIds(std::istream &is, u8 version);
+	void correctNodeIds();
 
 	void serializeNetworkSpecific(std::ostream &os, u16 net_proto_version);
 	void deSerializeNetworkSpecific(std::istream &is);
 
+	/*
+		Returns what serialize(os, version, false) would write. The result
+		is kept until the block is modified, so a block sent to many
+		clients is only serialized and compressed once per version.
+	*/
+	const std::string & getNetworkSerialization(u8 version);
+	void expireNetworkSerialization()
+	{
+		m_network_serialization.clear();
+		m_network_delta.clear();
+		m_network_version_expired = true;
+	}
+
+	/*
+		Network versions and deltas (server only).
+		getNetworkVersion() changes whenever the network serialization
+		does; only call it with the environment locked.
+		After startNetworkChanges() the block records which nodes change,
+		so that a client holding any version since then can be brought up
+		to date by getNetworkDelta() instead of the whole block.
+	*/
+	u32 getNetworkVersion();
+	void startNetworkChanges();
+	void stopNetworkChanges();
+	// Whether a delta updates a client holding the given version
+	bool canSendNetworkDelta(u32 version);
+	/*
+		Flags, the nodes changed since startNetworkChanges() and all the
+		node metadata, compressed. Cached like getNetworkSerialization().
+	*/
+	const std::string & getNetworkDelta(u8 version);
+	void deSerializeNetworkDelta(std::istream &is, u8 version);
+	/*
+		Drops the cached network serialization and delta when they haven't
+		been used for BLOCK_NETWORK_CACHE_TIMEOUT. Unlike modifying the
+		block, this keeps the network version.
+	*/
+	void stepNetworkCache(float dtime);
+
 private:
 	/*
 		Private methods
@@ -483,6 +579,37 @@ class MapBlock /*: public NodeContainer*/
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	void addContent(content_t c)
+	{
+		if(m_contents_expired)
+			return;
+		for(std::vector<content_t>::const_iterator
+				i = m_contents.begin(); i != m_contents.end(); ++i)
+			if(*i == c)
+				return;
+		if(m_contents.size() >= BLOCK_CONTENTS_MAX)
+			expireContents();
+		else
+			m_contents.push_back(c);
+	}
+
+	void recordNetworkChange(u32 i)
+	{
+		if(!m_network_changes_started)
+			return;
+		if(m_network_changes == NULL)
+			m_network_changes = new std::bitset<
+					MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE>;
+		if(m_network_changes->test(i))
+			return;
+		if(m_network_changed_nodes.size() >= BLOCK_NETWORK_CHANGES_MAX){
+			stopNetworkChanges();
+			return;
+		}
+		m_network_changes->set(i);
+		m_network_changed_nodes.push_back(i);
+	}
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
@@ -569,6 +696,39 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	/*
+		Distinct content ids of the nodes in the block; lets e.g. the
+		ABM handler skip blocks without looking at every node.
+		If m_contents_expired is set, this is rebuilt when needed.
+	*/
+	std::vector<content_t> m_contents;
+	bool m_contents_expired;
+
+	/*
+		Cached result of getNetworkSerialization(), empty if none.
+		Doesn't include the network specific data (heat and humidity),
+		which is cheap to write and changes without the block being
+		modified.
+	*/
+	std::string m_network_serialization;
+	u8 m_network_serialization_version;
+
+	/*
+		See getNetworkVersion(). Nodes changed since the version
+		m_network_changes_base are flagged in m_network_changes (allocated
+		on the first change) and listed in m_network_changed_nodes.
+	*/
+	u32 m_network_version;
+	bool m_network_version_expired;
+	bool m_network_changes_started;
+	u32 m_network_changes_base;
+	std::bitset<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE> *m_network_changes;
+	std::vector<u16> m_network_changed_nodes;
+	std::string m_network_delta;
+	u8 m_network_delta_version;
+	// Time since the cached network data was last used
+	float m_network_cache_timer;
+
 	bool m_generated;
 	
 	/*
@@ -590,6 +750,9 @@ class MapBlock /*: public NodeContainer*/
 		the list of blocks to be drawn.
 	*/
 	int m_refcount;
+
+	// Mapping of the node ids left by deSerializeDeferNodeIds()
+	NameIdMapping *m_deferred_nimap;
 };
 
 inline bool blockpos_over_limit(v3s16 p)
@@ -0,0 +1,120 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblockindex.h"
+
+#define MAPBLOCKINDEX_INITIAL_CAPACITY 1024
+
+MapBlockIndex::MapBlockIndex():
+	m_entries(NULL),
+	m_mask(0),
+	m_count(0)
+{
+	resize(MAPBLOCKINDEX_INITIAL_CAPACITY);
+}
+
+MapBlockIndex::~MapBlockIndex()
+{
+	delete[] m_entries;
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	if(block == NULL){
+		remove(p);
+		return;
+	}
+
+	// Keep the table at most half full
+	if((m_count + 1) * 2 > m_mask + 1)
+		resize((m_mask + 1) * 2);
+
+	u32 i = hash(p) & m_mask;
+	for(;;){
+		Entry &e = m_entries[i];
+		if(e.block == NULL){
+			e.pos = p;
+			e.block = block;
+			m_count++;
+			return;
+		}
+		if(e.pos == p){
+			e.block = block;
+			return;
+		}
+		i = (i + 1) & m_mask;
+	}
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u32 i = hash(p) & m_mask;
+	for(;;){
+		if(m_entries[i].block == NULL)
+			return;
+		if(m_entries[i].pos == p)
+			break;
+		i = (i + 1) & m_mask;
+	}
+
+	/*
+		Move back the following entries that would not be found anymore
+		with the hole at i, that is, the ones whose home slot is not in
+		the range (i, j].
+	*/
+	u32 j = i;
+	for(;;){
+		j = (j + 1) & m_mask;
+		Entry &e = m_entries[j];
+		if(e.block == NULL)
+			break;
+		u32 home = hash(e.pos) & m_mask;
+		if(((j - home) & m_mask) >= ((j - i) & m_mask)){
+			m_entries[i] = e;
+			i = j;
+		}
+	}
+	m_entries[i].block = NULL;
+	m_count--;
+}
+
+void MapBlockIndex::clear()
+{
+	for(u32 i = 0; i <= m_mask; i++)
+		m_entries[i].block = NULL;
+	m_count = 0;
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	Entry *old_entries = m_entries;
+	u32 old_capacity = old_entries ? m_mask + 1 : 0;
+
+	m_entries = new Entry[capacity];
+	m_mask = capacity - 1;
+	m_count = 0;
+	for(u32 i = 0; i < capacity; i++)
+		m_entries[i].block = NULL;
+
+	for(u32 i = 0; i < old_capacity; i++){
+		if(old_entries[i].block != NULL)
+			insert(old_entries[i].pos, old_entries[i].block);
+	}
+	delete[] old_entries;
+}
@@ -0,0 +1,93 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPBLOCKINDEX_HEADER
+#define MAPBLOCKINDEX_HEADER
+
+#include "irrlichttypes_bloated.h"
+
+class MapBlock;
+
+/*
+	Hash table of all the MapBlocks of a Map by block position.
+
+	The sectors still own the blocks; they add and remove them here.
+	This makes finding a block a single lookup in a flat array instead
+	of one in the sector map and another in the sector.
+
+	Open addressing with linear probing. Removed entries are filled by
+	moving the following entries back, so there are no tombstones.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+	~MapBlockIndex();
+
+	// Returns NULL if there is no block at p
+	MapBlock *find(v3s16 p) const
+	{
+		u32 i = hash(p) & m_mask;
+		for(;;){
+			const Entry &e = m_entries[i];
+			if(e.block == NULL)
+				return NULL;
+			if(e.pos == p)
+				return e.block;
+			i = (i + 1) & m_mask;
+		}
+	}
+
+	// Replaces an earlier block at the same position
+	void insert(v3s16 p, MapBlock *block);
+	// Does nothing if there is no block at p
+	void remove(v3s16 p);
+	void clear();
+
+	u32 size() const
+	{
+		return m_count;
+	}
+
+private:
+	struct Entry
+	{
+		v3s16 pos;
+		// NULL if empty
+		MapBlock *block;
+	};
+
+	static u32 hash(v3s16 p)
+	{
+		u64 k = ((u64)(u16)p.X) | ((u64)(u16)p.Y << 16) |
+				((u64)(u16)p.Z << 32);
+		k *= 0x9E3779B97F4A7C15ULL;
+		return (u32)(k >> 32);
+	}
+
+	void resize(u32 capacity);
+
+	Entry *m_entries;
+	// Capacity - 1; the capacity is a power of two
+	u32 m_mask;
+	u32 m_count;
+};
+
+#endif
+
@@ -1016,27 +1016,86 @@ void Mapgen::setLighting(v3s16 nmin, v3s16 nmax, u8 light) {
 }
 
 
-void Mapgen::lightSpread(VoxelArea &a, v3s16 p, u8 light) {
-	if (light <= 1 || !a.contains(p))
-		return;
+/*
+	Light spreading queue, in buckets by light level.
 
-	u32 vi = vm->m_area.index(p);
-	MapNode &nn = vm->m_data[vi];
+	A node queued with a light level is lit if it is inside the area,
+	propagates light and has less light than that; then its neighbors
+	are queued with one less light. The neighbors of a light source or a
+	lit node first looked at by calcLighting() are queued with two less.
+	The comparison is with the whole param1, as it always has been.
+*/
+struct LightQueueEntry {
+	u32 i;
+	v3s16 p;
+};
 
-	light--;
-	// should probably compare masked, but doesn't seem to make a difference
-	if (light <= nn.param1 || !ndef->get(nn).light_propagates)
-		return;
+class LightQueue {
+public:
+	LightQueue(ManualMapVoxelManipulator *vm, INodeDefManager *ndef,
+			VoxelArea &a):
+		m_vm(vm),
+		m_ndef(ndef),
+		m_a(a)
+	{
+		v3s16 em = vm->m_area.getExtent();
+		m_ystride = em.X;
+		m_zstride = em.X * em.Y;
+	}
 
-	nn.param1 = light;
+	void pushNeighbors(u32 i, v3s16 p, u8 light)
+	{
+		if (p.Z < m_a.MaxEdge.Z)
+			push(i + m_zstride, p + v3s16(0, 0, 1), light);
+		if (p.Y < m_a.MaxEdge.Y)
+			push(i + m_ystride, p + v3s16(0, 1, 0), light);
+		if (p.X < m_a.MaxEdge.X)
+			push(i + 1,         p + v3s16(1, 0, 0), light);
+		if (p.Z > m_a.MinEdge.Z)
+			push(i - m_zstride, p - v3s16(0, 0, 1), light);
+		if (p.Y > m_a.MinEdge.Y)
+			push(i - m_ystride, p - v3s16(0, 1, 0), light);
+		if (p.X > m_a.MinEdge.X)
+			push(i - 1,         p - v3s16(1, 0, 0), light);
+	}
 
-	lightSpread(a, p + v3s16(0, 0, 1), light);
-	lightSpread(a, p + v3s16(0, 1, 0), light);
-	lightSpread(a, p + v3s16(1, 0, 0), light);
-	lightSpread(a, p - v3s16(0, 0, 1), light);
-	lightSpread(a, p - v3s16(0, 1, 0), light);
-	lightSpread(a, p - v3s16(1, 0, 0), light);
-}
+	// Lights the queued nodes, brightest first, so that every node is
+	// lit only once
+	void spread()
+	{
+		for (int light = LIGHT_SUN; light >= 1; light--) {
+			std::vector<LightQueueEntry> &bucket = m_buckets[light];
+			while (!bucket.empty()) {
+				LightQueueEntry e = bucket.back();
+				bucket.pop_back();
+
+				MapNode &n = m_vm->m_data[e.i];
+				if (light <= n.param1)
+					continue;
+				n.param1 = light;
+				if (light > 1)
+					pushNeighbors(e.i, e.p, light - 1);
+			}
+		}
+	}
+
+private:
+	void push(u32 i, v3s16 p, u8 light)
+	{
+		MapNode &n = m_vm->m_data[i];
+		if (light <= n.param1 || !m_ndef->get(n).light_propagates)
+			return;
+		LightQueueEntry e = {i, p};
+		m_buckets[light].push_back(e);
+	}
+
+	ManualMapVoxelManipulator *m_vm;
+	INodeDefManager *m_ndef;
+	VoxelArea &m_a;
+	u32 m_ystride;
+	u32 m_zstride;
+	std::vector<LightQueueEntry> m_buckets[LIGHT_SUN + 1];
+};
 
 
 void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
@@ -1071,6 +1130,7 @@ void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
 	}
 
 	// now spread the sunlight and light up any sources
+	LightQueue queue(vm, ndef, a);
 	for (int z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++) {
 		for (int y = a.MinEdge.Y; y <= a.MaxEdge.Y; y++) {
 			u32 i = vm->m_area.index(a.MinEdge.X, y, z);
@@ -1081,21 +1141,20 @@ void Mapgen::calcLighting(v3s16 nmin, v3s16 nmax) {
 					continue;
 
 				u8 light_produced = ndef->get(n).light_source & 0x0F;
-				if (light_produced)
+				if (light_produced) {
+					// The light that has reached the source so far is
+					// replaced by its own
+					queue.spread();
 					n.param1 = light_produced;
+				}
 
 				u8 light = n.param1 & 0x0F;
-				if (light) {
-					lightSpread(a, v3s16(x,     y,     z + 1), light - 1);
-					lightSpread(a, v3s16(x,     y + 1, z    ), light - 1);
-					lightSpread(a, v3s16(x + 1, y,     z    ), light - 1);
-					lightSpread(a, v3s16(x,     y,     z - 1), light - 1);
-					lightSpread(a, v3s16(x,     y - 1, z    ), light - 1);
-					lightSpread(a, v3s16(x - 1, y,     z    ), light - 1);
-				}
+				if (light > 2)
+					queue.pushNeighbors(i, v3s16(x, y, z), light - 2);
 			}
 		}
 	}
+	queue.spread();
 
 	//printf("updateLighting: %dms\n", t.stop());
 }
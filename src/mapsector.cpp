@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "exceptions.h"
 #include "mapblock.h"
 #include "serialization.h"
+#include "map.h"
 
 MapSector::MapSector(Map *parent, v2s16 pos, IGameDef *gamedef):
 		differs_from_disk(false),
@@ -45,6 +46,7 @@ void MapSector::deleteBlocks()
 	for(std::map<s16, MapBlock*>::iterator i = m_blocks.begin();
 		i != m_blocks.end(); ++i)
 	{
+		m_parent->unindexBlock(i->second->getPos());
 		delete i->second;
 	}
 
@@ -99,6 +101,7 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 	
 	m_blocks[y] = block;
+	m_parent->indexBlock(block);
 
 	return block;
 }
@@ -117,6 +120,7 @@ void MapSector::insertBlock(MapBlock *block)
 	
 	// Insert into container
 	m_blocks[block_y] = block;
+	m_parent->indexBlock(block);
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -128,6 +132,7 @@ void MapSector::deleteBlock(MapBlock *block)
 	
 	// Remove from container
 	m_blocks.erase(block_y);
+	m_parent->unindexBlock(block->getPos());
 
 	// Delete
 	delete block;
@@ -183,6 +183,8 @@ void ContentFeatures::reset()
 	has_on_construct = false;
 	has_on_destruct = false;
 	has_after_destruct = false;
+	collision_boxes.clear();
+	collision_bouncy = 0;
 	/*
 		Actual data
 
@@ -597,6 +599,38 @@ class CNodeDefManager: public IWritableNodeDefManager
 			}
 		}
 	}
+	virtual void updateCollisionBoxes()
+	{
+		for(u32 i=0; i<m_content_features.size(); i++)
+		{
+			ContentFeatures *f = &m_content_features[i];
+			f->collision_bouncy = itemgroup_get(f->groups, "bouncy");
+			f->collision_boxes.clear();
+			if(!f->walkable){
+				f->collision_boxes.resize(1);
+				continue;
+			}
+			// One set of boxes for every param2 value that shapes them
+			u32 count = 1;
+			if(f->node_box.type == NODEBOX_LEVELED &&
+					(f->leveled || f->liquid_type == LIQUID_FLOWING ||
+					f->param_type_2 == CPT2_LEVELED ||
+					f->param_type_2 == CPT2_FLOWINGLIQUID))
+				count = 256;
+			else if(f->node_box.type != NODEBOX_REGULAR &&
+					f->param_type_2 == CPT2_FACEDIR)
+				count = 24;
+			else if(f->node_box.type != NODEBOX_REGULAR &&
+					f->param_type_2 == CPT2_WALLMOUNTED)
+				count = 6;
+			f->collision_boxes.resize(count);
+			for(u32 param2=0; param2<count; param2++)
+			{
+				MapNode n(i, 0, param2);
+				f->collision_boxes[param2] = n.getNodeBoxes(this);
+			}
+		}
+	}
 	virtual void updateTextures(ITextureSource *tsrc)
 	{
 #ifndef SERVER
@@ -173,6 +173,13 @@ struct ContentFeatures
 	bool has_on_destruct;
 	bool has_after_destruct;
 
+	// Node boxes for collision detection, for every value of param2, or a
+	// single set if param2 doesn't change them. Empty set if not walkable.
+	// Updated by IWritableNodeDefManager::updateCollisionBoxes()
+	std::vector<std::vector<aabb3f> > collision_boxes;
+	// Value of the "bouncy" group
+	int collision_bouncy;
+
 	/*
 		Actual data
 	*/
@@ -269,6 +276,21 @@ struct ContentFeatures
 		if(!isLiquid() || !f.isLiquid()) return false;
 		return (liquid_alternative_flowing == f.liquid_alternative_flowing);
 	}
+	// NULL if the collision boxes have not been updated
+	const std::vector<aabb3f>* getCollisionBoxes(u8 param2) const{
+		if(collision_boxes.empty()) return NULL;
+		u32 i = param2;
+		if(collision_boxes.size() != 256){
+			if(param_type_2 == CPT2_FACEDIR)
+				i = param2 & 0x1F;
+			else if(param_type_2 == CPT2_WALLMOUNTED)
+				i = param2 & 0x07;
+			// Unused rotations look the same as the first one
+			if(i >= collision_boxes.size())
+				i = 0;
+		}
+		return &collision_boxes[i];
+	}
 };
 
 class INodeDefManager
@@ -325,6 +347,12 @@ class IWritableNodeDefManager : public INodeDefManager
 	*/
 	virtual void updateTextures(ITextureSource *tsrc)=0;
 
+	/*
+		Precompute the collision boxes of all nodes.
+		Call after all node definitions are set.
+	*/
+	virtual void updateCollisionBoxes()=0;
+
 	virtual void serialize(std::ostream &os, u16 protocol_version)=0;
 	virtual void deSerialize(std::istream &is)=0;
 };
@@ -25,6 +25,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "debug.h"
 #include "util/numeric.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+		(defined(__clang__) || __GNUC__ > 4 || \
+		(__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+	#define NOISE_X86_KERNELS
+	#include <immintrin.h>
+#endif
+
 #define NOISE_MAGIC_X    1619
 #define NOISE_MAGIC_Y    31337
 #define NOISE_MAGIC_Z    52591
@@ -40,21 +47,27 @@ float cos_lookup[16] = {
 
 
 //noise poly:  p(n) = 60493n^3 + 19990303n + 137612589
-float noise2d(int x, int y, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+//computed unsigned, as the signed overflow of the lattice hash is undefined.
+//The result is not masked to 31 bits: optimizing compilers dropped that mask
+//from the signed version, and maps generated by such builds have to stay the
+//same. The noise is in (-1, 3] therefore.
+static inline float latticeNoise(u32 n) {
+	n &= 0x7fffffff;
 	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	n = n * (n * n * 60493 + 19990303) + 1376312589;
+	return 1.f - (float)(s32)n / 0x40000000;
+}
+
+
+float noise2d(int x, int y, int seed) {
+	return latticeNoise((u32)NOISE_MAGIC_X * x + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_SEED * seed);
 }
 
 
 float noise3d(int x, int y, int z, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y + NOISE_MAGIC_Z * z
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
-	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	return latticeNoise((u32)NOISE_MAGIC_X * x + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_Z * z + (u32)NOISE_MAGIC_SEED * seed);
 }
 
 
@@ -268,6 +281,294 @@ float contour(float v)
 }
 
 
+/*
+	Noise map kernels
+
+	The lattice generation, interpolation and octave accumulation loops
+	of the noise maps, in a scalar version and in SSE2 and AVX2 versions
+	used if the CPU supports them. All of them do the same float
+	operations in the same order, so the results are bit-for-bit the same.
+*/
+
+struct NoiseMapKernels {
+	// out[i] = noise of the lattice point hashed from
+	// base + NOISE_MAGIC_X * i, as in noise2d() and noise3d()
+	void (*lattice)(float *out, u32 base, int count);
+	// Interpolates a lattice row along x; the lattice points left of
+	// column i are row[ix[i]]
+	void (*interpX)(float *out, const float *row, const int *ix,
+		const float *tx, int count);
+	// Interpolates along y between two rows interpolated along x
+	void (*interp2D)(float *out, const float *row0, const float *row1,
+		float ty, int count);
+	// Interpolates along y and z between four rows interpolated along x;
+	// the rows are indexed [y][z]
+	void (*interp3D)(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		float ty, float tz, int count);
+	// result[i] += g * buf[i]
+	void (*accumulate)(float *result, const float *buf, float g, int count);
+};
+
+static void latticeScalar(float *out, u32 base, int count) {
+	for (int i = 0; i != count; i++)
+		out[i] = latticeNoise(base + NOISE_MAGIC_X * i);
+}
+
+static void interpXScalar(float *out, const float *row, const int *ix,
+		const float *tx, int count) {
+	for (int i = 0; i != count; i++)
+		out[i] = linearInterpolation(row[ix[i]], row[ix[i] + 1], tx[i]);
+}
+
+static void interp2DScalar(float *out, const float *row0, const float *row1,
+		float ty, int count) {
+	for (int i = 0; i != count; i++)
+		out[i] = linearInterpolation(row0[i], row1[i], ty);
+}
+
+static void interp3DScalar(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		float ty, float tz, int count) {
+	for (int i = 0; i != count; i++) {
+		float u = linearInterpolation(row00[i], row10[i], ty);
+		float v = linearInterpolation(row01[i], row11[i], ty);
+		out[i] = linearInterpolation(u, v, tz);
+	}
+}
+
+static void accumulateScalar(float *result, const float *buf, float g, int count) {
+	for (int i = 0; i != count; i++)
+		result[i] += g * buf[i];
+}
+
+static const NoiseMapKernels noise_kernels_scalar = {
+	latticeScalar,
+	interpXScalar,
+	interp2DScalar,
+	interp3DScalar,
+	accumulateScalar
+};
+
+#ifdef NOISE_X86_KERNELS
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+TARGET_SSE2 static inline __m128 lerpSSE2(__m128 v0, __m128 v1, __m128 t) {
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+// There is no 32-bit multiplication in SSE2; multiply the even and the
+// odd elements separately
+TARGET_SSE2 static inline __m128i mulSSE2(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd  = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+TARGET_SSE2 static void latticeSSE2(float *out, u32 base, int count) {
+	const __m128i mask = _mm_set1_epi32(0x7fffffff);
+	const __m128i step = _mm_set1_epi32(NOISE_MAGIC_X * 4);
+	__m128i n0 = _mm_add_epi32(_mm_set1_epi32(base),
+		_mm_setr_epi32(0, NOISE_MAGIC_X, NOISE_MAGIC_X * 2, NOISE_MAGIC_X * 3));
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128i n = _mm_and_si128(n0, mask);
+		n = _mm_xor_si128(_mm_srli_epi32(n, 13), n);
+		__m128i t = mulSSE2(mulSSE2(n, n), _mm_set1_epi32(60493));
+		t = _mm_add_epi32(t, _mm_set1_epi32(19990303));
+		n = _mm_add_epi32(mulSSE2(n, t), _mm_set1_epi32(1376312589));
+		__m128 f = _mm_div_ps(_mm_cvtepi32_ps(n), _mm_set1_ps(0x40000000));
+		_mm_storeu_ps(out + i, _mm_sub_ps(_mm_set1_ps(1.f), f));
+		n0 = _mm_add_epi32(n0, step);
+	}
+	latticeScalar(out + i, base + NOISE_MAGIC_X * i, count - i);
+}
+
+TARGET_SSE2 static void interpXSSE2(float *out, const float *row, const int *ix,
+		const float *tx, int count) {
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const int *x = ix + i;
+		__m128 v0 = _mm_setr_ps(row[x[0]], row[x[1]], row[x[2]], row[x[3]]);
+		__m128 v1 = _mm_setr_ps(row[x[0] + 1], row[x[1] + 1],
+			row[x[2] + 1], row[x[3] + 1]);
+		_mm_storeu_ps(out + i, lerpSSE2(v0, v1, _mm_loadu_ps(tx + i)));
+	}
+	interpXScalar(out + i, row, ix + i, tx + i, count - i);
+}
+
+TARGET_SSE2 static void interp2DSSE2(float *out, const float *row0, const float *row1,
+		float ty, int count) {
+	__m128 vty = _mm_set1_ps(ty);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(out + i, lerpSSE2(_mm_loadu_ps(row0 + i),
+			_mm_loadu_ps(row1 + i), vty));
+	}
+	interp2DScalar(out + i, row0 + i, row1 + i, ty, count - i);
+}
+
+TARGET_SSE2 static void interp3DSSE2(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		float ty, float tz, int count) {
+	__m128 vty = _mm_set1_ps(ty);
+	__m128 vtz = _mm_set1_ps(tz);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 u = lerpSSE2(_mm_loadu_ps(row00 + i),
+			_mm_loadu_ps(row10 + i), vty);
+		__m128 v = lerpSSE2(_mm_loadu_ps(row01 + i),
+			_mm_loadu_ps(row11 + i), vty);
+		_mm_storeu_ps(out + i, lerpSSE2(u, v, vtz));
+	}
+	interp3DScalar(out + i, row00 + i, row10 + i, row01 + i, row11 + i,
+		ty, tz, count - i);
+}
+
+TARGET_SSE2 static void accumulateSSE2(float *result, const float *buf, float g, int count) {
+	__m128 vg = _mm_set1_ps(g);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m128 r = _mm_add_ps(_mm_loadu_ps(result + i),
+			_mm_mul_ps(vg, _mm_loadu_ps(buf + i)));
+		_mm_storeu_ps(result + i, r);
+	}
+	accumulateScalar(result + i, buf + i, g, count - i);
+}
+
+static const NoiseMapKernels noise_kernels_sse2 = {
+	latticeSSE2,
+	interpXSSE2,
+	interp2DSSE2,
+	interp3DSSE2,
+	accumulateSSE2
+};
+
+TARGET_AVX2 static inline __m256 lerpAVX2(__m256 v0, __m256 v1, __m256 t) {
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+TARGET_AVX2 static void latticeAVX2(float *out, u32 base, int count) {
+	const __m256i mask = _mm256_set1_epi32(0x7fffffff);
+	const __m256i step = _mm256_set1_epi32(NOISE_MAGIC_X * 8);
+	__m256i n0 = _mm256_add_epi32(_mm256_set1_epi32(base),
+		_mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+			_mm256_set1_epi32(NOISE_MAGIC_X)));
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i n = _mm256_and_si256(n0, mask);
+		n = _mm256_xor_si256(_mm256_srli_epi32(n, 13), n);
+		__m256i t = _mm256_mullo_epi32(_mm256_mullo_epi32(n, n),
+			_mm256_set1_epi32(60493));
+		t = _mm256_add_epi32(t, _mm256_set1_epi32(19990303));
+		n = _mm256_add_epi32(_mm256_mullo_epi32(n, t),
+			_mm256_set1_epi32(1376312589));
+		__m256 f = _mm256_div_ps(_mm256_cvtepi32_ps(n),
+			_mm256_set1_ps(0x40000000));
+		_mm256_storeu_ps(out + i, _mm256_sub_ps(_mm256_set1_ps(1.f), f));
+		n0 = _mm256_add_epi32(n0, step);
+	}
+	latticeScalar(out + i, base + NOISE_MAGIC_X * i, count - i);
+}
+
+TARGET_AVX2 static void interp2DAVX2(float *out, const float *row0, const float *row1,
+		float ty, int count) {
+	__m256 vty = _mm256_set1_ps(ty);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		_mm256_storeu_ps(out + i, lerpAVX2(_mm256_loadu_ps(row0 + i),
+			_mm256_loadu_ps(row1 + i), vty));
+	}
+	interp2DScalar(out + i, row0 + i, row1 + i, ty, count - i);
+}
+
+TARGET_AVX2 static void interp3DAVX2(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		float ty, float tz, int count) {
+	__m256 vty = _mm256_set1_ps(ty);
+	__m256 vtz = _mm256_set1_ps(tz);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 u = lerpAVX2(_mm256_loadu_ps(row00 + i),
+			_mm256_loadu_ps(row10 + i), vty);
+		__m256 v = lerpAVX2(_mm256_loadu_ps(row01 + i),
+			_mm256_loadu_ps(row11 + i), vty);
+		_mm256_storeu_ps(out + i, lerpAVX2(u, v, vtz));
+	}
+	interp3DScalar(out + i, row00 + i, row10 + i, row01 + i, row11 + i,
+		ty, tz, count - i);
+}
+
+TARGET_AVX2 static void accumulateAVX2(float *result, const float *buf, float g, int count) {
+	__m256 vg = _mm256_set1_ps(g);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(result + i),
+			_mm256_mul_ps(vg, _mm256_loadu_ps(buf + i)));
+		_mm256_storeu_ps(result + i, r);
+	}
+	accumulateScalar(result + i, buf + i, g, count - i);
+}
+
+// The gathers of interpolating along x are no faster with AVX2
+static const NoiseMapKernels noise_kernels_avx2 = {
+	latticeAVX2,
+	interpXSSE2,
+	interp2DAVX2,
+	interp3DAVX2,
+	accumulateAVX2
+};
+
+#undef TARGET_SSE2
+#undef TARGET_AVX2
+
+#endif
+
+static const NoiseMapKernels *getKernelSet(NoiseKernelSet set) {
+	switch (set) {
+#ifdef NOISE_X86_KERNELS
+	case NOISE_KERNELS_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? &noise_kernels_avx2 : NULL;
+	case NOISE_KERNELS_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2") ? &noise_kernels_sse2 : NULL;
+#endif
+	case NOISE_KERNELS_SCALAR:
+		return &noise_kernels_scalar;
+	default:
+		return NULL;
+	}
+}
+
+static const NoiseMapKernels *selectKernels() {
+	const NoiseMapKernels *kernels = getKernelSet(NOISE_KERNELS_AVX2);
+	if (kernels == NULL)
+		kernels = getKernelSet(NOISE_KERNELS_SSE2);
+	if (kernels == NULL)
+		kernels = getKernelSet(NOISE_KERNELS_SCALAR);
+	return kernels;
+}
+
+static const NoiseMapKernels *noise_kernels = selectKernels();
+
+bool setNoiseKernels(NoiseKernelSet set) {
+	const NoiseMapKernels *kernels = getKernelSet(set);
+	if (kernels == NULL)
+		return false;
+	noise_kernels = kernels;
+	return true;
+}
+
+
 ///////////////////////// [ New perlin stuff ] ////////////////////////////
 
 
@@ -289,10 +590,13 @@ void Noise::init(NoiseParams *np, int seed, int sx, int sy, int sz) {
 	this->sz   = sz;
 
 	this->noisebuf = NULL;
+	this->xinterp  = NULL;
 	resizeNoiseBuf(sz > 1);
 
 	this->buf    = new float[sx * sy * sz];
 	this->result = new float[sx * sy * sz];
+	this->xlattice = new int[sx];
+	this->xfrac    = new float[sx];
 }
 
 
@@ -300,6 +604,9 @@ Noise::~Noise() {
 	delete[] buf;
 	delete[] result;
 	delete[] noisebuf;
+	delete[] xlattice;
+	delete[] xfrac;
+	delete[] xinterp;
 }
 
 
@@ -318,8 +625,12 @@ void Noise::setSize(int sx, int sy, int sz) {
 
 	delete[] buf;
 	delete[] result;
+	delete[] xlattice;
+	delete[] xfrac;
 	this->buf    = new float[sx * sy * sz];
 	this->result = new float[sx * sy * sz];
+	this->xlattice = new int[sx];
+	this->xfrac    = new float[sx];
 }
 
 
@@ -355,6 +666,9 @@ void Noise::resizeNoiseBuf(bool is3d) {
 	if (noisebuf)
 		delete[] noisebuf;
 	noisebuf = new float[nlx * nly * nlz];
+
+	delete[] xinterp;
+	xinterp = new float[sx * nly * nlz];
 }
 
 
@@ -371,9 +685,10 @@ void Noise::resizeNoiseBuf(bool is3d) {
  */
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed) {
-	float v00, v01, v10, v11, u, v, orig_u;
+	float u, v, orig_u;
 	int index, i, j, x0, y0, noisex, noisey;
 	int nlx, nly;
+	u32 base;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -384,34 +699,38 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
-	index = 0;
+	base = (u32)NOISE_MAGIC_X * x0 + (u32)NOISE_MAGIC_Y * y0
+		+ (u32)NOISE_MAGIC_SEED * seed;
+	for (j = 0; j != nly; j++)
+		noise_kernels->lattice(&noisebuf[idx(0, j)],
+			base + (u32)NOISE_MAGIC_Y * j, nlx);
+
+	//calculate lattice columns and eased positions, the same for every row
+	u = orig_u;
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		xlattice[i] = noisex;
+		xfrac[i] = easeCurve(u);
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+
+	//interpolate the lattice rows along x
 	for (j = 0; j != nly; j++)
-		for (i = 0; i != nlx; i++)
-			noisebuf[index++] = noise2d(x0 + i, y0 + j, seed);
+		noise_kernels->interpX(&xinterp[j * sx], &noisebuf[idx(0, j)],
+			xlattice, xfrac, sx);
 
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noisebuf[idx(0, noisey)];
-		v10 = noisebuf[idx(1, noisey)];
-		v01 = noisebuf[idx(0, noisey + 1)];
-		v11 = noisebuf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			buf[index++] = biLinearInterpolation(v00, v10, v01, v11, u, v);
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noisebuf[idx(noisex + 1, noisey)];
-				v11 = noisebuf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		noise_kernels->interp2D(&buf[index],
+			&xinterp[noisey * sx], &xinterp[(noisey + 1) * sx],
+			easeCurve(v), sx);
+		index += sx;
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -424,14 +743,14 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 
 
 #define idx(x, y, z) ((z) * nly * nlx + (y) * nlx + (x))
+#define xidx(y, z) (((z) * nly + (y)) * sx)
 void Noise::gradientMap3D(float x, float y, float z,
 						  float step_x, float step_y, float step_z,
 						  int seed) {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
 	float u, v, w, orig_u, orig_v;
 	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
 	int nlx, nly, nlz;
+	u32 base;
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -446,11 +765,31 @@ void Noise::gradientMap3D(float x, float y, float z,
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
 	nlz = (int)(w + sz * step_z) + 2;
-	index = 0;
+	base = (u32)NOISE_MAGIC_X * x0 + (u32)NOISE_MAGIC_Y * y0
+		+ (u32)NOISE_MAGIC_Z * z0 + (u32)NOISE_MAGIC_SEED * seed;
+	for (k = 0; k != nlz; k++)
+		for (j = 0; j != nly; j++)
+			noise_kernels->lattice(&noisebuf[idx(0, j, k)],
+				base + (u32)NOISE_MAGIC_Y * j + (u32)NOISE_MAGIC_Z * k, nlx);
+
+	//calculate lattice columns and positions, the same for every row
+	u = orig_u;
+	noisex = 0;
+	for (i = 0; i != sx; i++) {
+		xlattice[i] = noisex;
+		xfrac[i] = u;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+
+	//interpolate the lattice rows along x
 	for (k = 0; k != nlz; k++)
 		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
-				noisebuf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+			noise_kernels->interpX(&xinterp[xidx(j, k)],
+				&noisebuf[idx(0, j, k)], xlattice, xfrac, sx);
 
 	//calculate interpolations
 	index  = 0;
@@ -460,36 +799,13 @@ void Noise::gradientMap3D(float x, float y, float z,
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noisebuf[idx(0, noisey,     noisez)];
-			v100 = noisebuf[idx(1, noisey,     noisez)];
-			v010 = noisebuf[idx(0, noisey + 1, noisez)];
-			v110 = noisebuf[idx(1, noisey + 1, noisez)];
-			v001 = noisebuf[idx(0, noisey,     noisez + 1)];
-			v101 = noisebuf[idx(1, noisey,     noisez + 1)];
-			v011 = noisebuf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noisebuf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				buf[index++] = triLinearInterpolation(
-									v000, v100, v010, v110,
-									v001, v101, v011, v111,
-									u, v, w);
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noisebuf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noisebuf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noisebuf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noisebuf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
+			noise_kernels->interp3D(&buf[index],
+				&xinterp[xidx(noisey,     noisez)],
+				&xinterp[xidx(noisey + 1, noisez)],
+				&xinterp[xidx(noisey,     noisez + 1)],
+				&xinterp[xidx(noisey + 1, noisez + 1)],
+				v, w, sx);
+			index += sx;
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -505,12 +821,13 @@ void Noise::gradientMap3D(float x, float y, float z,
 		}
 	}
 }
+#undef xidx
 #undef idx
 
 
 float *Noise::perlinMap2D(float x, float y) {
 	float f = 1.0, g = 1.0;
-	int i, j, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -522,13 +839,7 @@ float *Noise::perlinMap2D(float x, float y) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g * buf[index];
-				index++;
-			}
-		}
+		noise_kernels->accumulate(result, buf, g, sx * sy);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -575,7 +886,7 @@ float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 
 float *Noise::perlinMap3D(float x, float y, float z) {
 	float f = 1.0, g = 1.0;
-	int i, j, k, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -588,15 +899,7 @@ float *Noise::perlinMap3D(float x, float y, float z) {
 			f / np->spread.X, f / np->spread.Y, f / np->spread.Z,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (k = 0; k != sz; k++) {
-			for (j = 0; j != sy; j++) {
-				for (i = 0; i != sx; i++) {
-					result[index] += g * buf[index];
-					index++;
-				}
-			}
-		}
+		noise_kernels->accumulate(result, buf, g, sx * sy * sz);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -101,6 +101,11 @@ class Noise {
 	float *noisebuf;
 	float *buf;
 	float *result;
+	// Lattice column and interpolation position of each map column
+	int *xlattice;
+	float *xfrac;
+	// The lattice rows interpolated along x
+	float *xinterp;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy);
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz);
@@ -127,7 +132,19 @@ class Noise {
 	void transformNoiseMap();
 };
 
-// Return value: -1 ... 1
+enum NoiseKernelSet {
+	NOISE_KERNELS_SCALAR,
+	NOISE_KERNELS_SSE2,
+	NOISE_KERNELS_AVX2
+};
+
+// Noise maps are computed with the fastest kernels the CPU supports;
+// this selects others for testing. Returns false if not supported.
+bool setNoiseKernels(NoiseKernelSet set);
+
+// Return value: -1 ... 3
+// The hash keeps the unmasked result of the original optimized builds, so
+// that the maps they generated stay the same.
 float noise2d(int x, int y, int seed);
 float noise3d(int x, int y, int z, int seed);
 
@@ -52,7 +52,8 @@ Player::Player(IGameDef *gamedef):
 	m_last_yaw(0),
 	m_last_pos(0,0,0),
 	m_last_hp(PLAYER_MAX_HP),
-	m_last_inventory(gamedef->idef())
+	m_last_inventory(gamedef->idef()),
+	m_dirty(false)
 {
 	updateName("<not set>");
 	inventory.clear();
@@ -168,6 +168,7 @@ class Player
 	virtual void setBreath(u16 breath)
 	{
 		m_breath = breath;
+		m_dirty = true;
 	}
 
 	f32 getRadPitch()
@@ -218,9 +219,22 @@ class Player
 	void serialize(std::ostream &os);
 	void deSerialize(std::istream &is, std::string playername);
 
+	/*
+		For changes checkModified() can't see by comparing, like breath
+		or the inventory of a player that is not connected
+	*/
+	void setModified(bool modified)
+	{
+		m_dirty = modified;
+	}
+	bool isModified() const
+	{
+		return m_dirty;
+	}
+
 	bool checkModified()
 	{
-		if(m_last_hp != hp || m_last_pitch != m_pitch ||
+		if(m_dirty || m_last_hp != hp || m_last_pitch != m_pitch ||
 				m_last_pos != m_position || m_last_yaw != m_yaw ||
 				!(inventory == m_last_inventory))
 		{
@@ -229,6 +243,7 @@ class Player
 			m_last_pos = m_position;
 			m_last_yaw = m_yaw;
 			m_last_inventory = inventory;
+			m_dirty = false;
 			return true;
 		} else {
 			return false;
@@ -306,6 +321,7 @@ class Player
 	v3f m_last_pos;
 	u16 m_last_hp;
 	Inventory m_last_inventory;
+	bool m_dirty;
 };
 
 
@@ -321,7 +337,12 @@ class RemotePlayer : public Player
 	PlayerSAO *getPlayerSAO()
 	{ return m_sao; }
 	void setPlayerSAO(PlayerSAO *sao)
-	{ m_sao = sao; }
+	{
+		m_sao = sao;
+		// Only players with an SAO are compared on save; make sure the
+		// changes of a leaving player are saved too
+		m_dirty = true;
+	}
 	void setPosition(const v3f &position);
 	
 private:
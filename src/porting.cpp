@@ -251,6 +251,106 @@ bool threadSetPriority(threadid_t tid, int prio) {
 }
 
 
+/*
+	Thread local keys
+*/
+
+#if defined(_WIN32)
+
+/*
+	Unlike thread local storage, fiber local storage calls a function for
+	each thread that exits, but it is missing before Windows Vista. Values
+	are kept in a ThreadLocalValue that knows the destructor to call.
+*/
+typedef VOID (WINAPI *FlsCallback)(PVOID);
+typedef DWORD (WINAPI *FlsAllocFunc)(FlsCallback);
+typedef PVOID (WINAPI *FlsGetValueFunc)(DWORD);
+typedef BOOL (WINAPI *FlsSetValueFunc)(DWORD, PVOID);
+
+static FlsAllocFunc fls_alloc = NULL;
+static FlsGetValueFunc fls_get_value = NULL;
+static FlsSetValueFunc fls_set_value = NULL;
+
+struct ThreadLocalValue
+{
+	ThreadLocalKey::Destructor destructor;
+	void *value;
+};
+
+static VOID WINAPI destroyThreadLocalValue(PVOID p)
+{
+	ThreadLocalValue *v = (ThreadLocalValue*)p;
+	if(v == NULL)
+		return;
+	if(v->value != NULL && v->destructor != NULL)
+		v->destructor(v->value);
+	delete v;
+}
+
+ThreadLocalKey::ThreadLocalKey(Destructor destructor):
+	m_destructor(destructor)
+{
+	// Keys are created during static initialization, by a single thread
+	static bool fls_checked = false;
+	if(!fls_checked){
+		HMODULE kernel32 = GetModuleHandleA("kernel32.dll");
+		fls_alloc = (FlsAllocFunc)GetProcAddress(kernel32, "FlsAlloc");
+		fls_get_value = (FlsGetValueFunc)GetProcAddress(kernel32, "FlsGetValue");
+		fls_set_value = (FlsSetValueFunc)GetProcAddress(kernel32, "FlsSetValue");
+		if(!fls_alloc || !fls_get_value || !fls_set_value)
+			fls_alloc = NULL;
+		fls_checked = true;
+	}
+
+	m_fls = fls_alloc != NULL;
+	m_key = m_fls ? fls_alloc(destroyThreadLocalValue) : TlsAlloc();
+	// FLS_OUT_OF_INDEXES is the same
+	assert(m_key != TLS_OUT_OF_INDEXES);
+}
+
+void *ThreadLocalKey::get()
+{
+	ThreadLocalValue *v = (ThreadLocalValue*)
+			(m_fls ? fls_get_value(m_key) : TlsGetValue(m_key));
+	return v ? v->value : NULL;
+}
+
+void ThreadLocalKey::set(void *value)
+{
+	ThreadLocalValue *v = (ThreadLocalValue*)
+			(m_fls ? fls_get_value(m_key) : TlsGetValue(m_key));
+	if(v == NULL){
+		v = new ThreadLocalValue;
+		v->destructor = m_destructor;
+		if(m_fls)
+			fls_set_value(m_key, v);
+		else
+			TlsSetValue(m_key, v);
+	}
+	v->value = value;
+}
+
+#else
+
+ThreadLocalKey::ThreadLocalKey(Destructor destructor)
+{
+	int r = pthread_key_create(&m_key, destructor);
+	assert(r == 0);
+}
+
+void *ThreadLocalKey::get()
+{
+	return pthread_getspecific(m_key);
+}
+
+void ThreadLocalKey::set(void *value)
+{
+	pthread_setspecific(m_key, value);
+}
+
+#endif
+
+
 /*
 	Path mangler
 */
@@ -167,6 +167,33 @@ bool threadBindToProcessor(threadid_t tid, int pnumber);
 */
 bool threadSetPriority(threadid_t tid, int prio);
 
+/*
+	A pointer with its own value in each thread, NULL until set. If a
+	destructor is given, it is called with the value of each thread that
+	exits with one other than NULL; not on Windows XP, though.
+	Keys are meant to be static and are never freed.
+*/
+class ThreadLocalKey
+{
+public:
+	typedef void (*Destructor)(void *value);
+
+	ThreadLocalKey(Destructor destructor=NULL);
+
+	void *get();
+	void set(void *value);
+
+private:
+#ifdef _WIN32
+	Destructor m_destructor;
+	// Whether m_key is a fiber local storage index, see porting.cpp
+	bool m_fls;
+	DWORD m_key;
+#else
+	pthread_key_t m_key;
+#endif
+};
+
 /*
 	Return system information
 	e.g. "Linux/3.12.7 x86_64"
@@ -266,6 +293,36 @@ inline u32 getTime(TimePrecision prec)
 	return 0;
 }
 
+/*
+	Loads and stores of a u32 that other threads access at the same time.
+	An acquiring load that sees the value of a releasing store also sees
+	everything the storing thread wrote before it.
+*/
+#if defined(_MSC_VER)
+	// Volatile accesses acquire and release with MSVC
+	inline u32 atomicLoad(volatile u32 *p) { return *p; }
+	inline u32 atomicLoadAcquire(volatile u32 *p) { return *p; }
+	inline void atomicStore(volatile u32 *p, u32 v) { *p = v; }
+	inline void atomicStoreRelease(volatile u32 *p, u32 v) { *p = v; }
+#elif defined(__clang__) || __GNUC__ > 4 || \
+		(__GNUC__ == 4 && __GNUC_MINOR__ >= 7)
+	inline u32 atomicLoad(volatile u32 *p)
+	{ return __atomic_load_n(p, __ATOMIC_RELAXED); }
+	inline u32 atomicLoadAcquire(volatile u32 *p)
+	{ return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+	inline void atomicStore(volatile u32 *p, u32 v)
+	{ __atomic_store_n(p, v, __ATOMIC_RELAXED); }
+	inline void atomicStoreRelease(volatile u32 *p, u32 v)
+	{ __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+#else
+	// Older GCC only has full barriers
+	inline u32 atomicLoad(volatile u32 *p) { return *p; }
+	inline u32 atomicLoadAcquire(volatile u32 *p)
+	{ u32 v = *p; __sync_synchronize(); return v; }
+	inline void atomicStore(volatile u32 *p, u32 v) { *p = v; }
+	inline void atomicStoreRelease(volatile u32 *p, u32 v)
+	{ __sync_synchronize(); *p = v; }
+#endif
 
 } // namespace porting
 
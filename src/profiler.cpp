@@ -0,0 +1,263 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "profiler.h"
+#include "porting.h"
+#include <cstring>
+
+ProbeRegistry g_probes;
+
+ProbeRegistry::ProbeRegistry():
+	m_thread_slots(releaseThreadSlots),
+	m_epoch(1)
+{
+}
+
+ProbeId ProbeRegistry::registerProbe(const std::string &name)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(u32 i = 0; i < m_names.size(); i++)
+		if(m_names[i] == name)
+			return i;
+
+	if(m_names.size() >= PROBE_MAX)
+		return PROBE_INVALID;
+
+	m_names.push_back(name);
+	// Samples start at zero
+	Totals totals;
+	memset(&totals, 0, sizeof(totals));
+	m_last.push_back(totals);
+	m_last_averages.push_back(totals);
+	return m_names.size() - 1;
+}
+
+void ProbeRegistry::sample(ProbeId id, u32 value)
+{
+	if(id >= PROBE_MAX)
+		return;
+
+	ThreadSlots *t = (ThreadSlots*)m_thread_slots.get();
+	ProbeSlot *slot = t ? t->slots[id] : NULL;
+	if(slot == NULL)
+		slot = createSlot(id);
+
+	u32 b = getBucket(value);
+	porting::atomicStore(&slot->buckets[b], slot->buckets[b] + 1);
+	porting::atomicStore(&slot->sum, slot->sum + value);
+
+	u32 epoch = porting::atomicLoad(&m_epoch);
+	if(slot->epoch != epoch){
+		porting::atomicStore(&slot->min, value);
+		porting::atomicStore(&slot->max, value);
+		porting::atomicStoreRelease(&slot->epoch, epoch);
+	} else {
+		if(value < slot->min)
+			porting::atomicStore(&slot->min, value);
+		if(value > slot->max)
+			porting::atomicStore(&slot->max, value);
+	}
+
+	porting::atomicStoreRelease(&slot->count, slot->count + 1);
+}
+
+ProbeSlot *ProbeRegistry::createSlot(ProbeId id)
+{
+	// Published under the mutex, so that collect() never sees a slot
+	// before it is zeroed
+	JMutexAutoLock lock(m_mutex);
+
+	ThreadSlots *t = (ThreadSlots*)m_thread_slots.get();
+	if(t == NULL){
+		if(!m_free_threads.empty()){
+			t = m_free_threads.back();
+			m_free_threads.pop_back();
+		} else {
+			t = new ThreadSlots;
+			t->registry = this;
+			memset(t->slots, 0, sizeof(t->slots));
+			m_threads.push_back(t);
+		}
+		m_thread_slots.set(t);
+	}
+
+	// A recycled thread may have the slot already
+	if(t->slots[id] == NULL){
+		ProbeSlot *slot = new ProbeSlot;
+		memset(slot, 0, sizeof(ProbeSlot));
+		t->slots[id] = slot;
+	}
+	return t->slots[id];
+}
+
+void ProbeRegistry::releaseThreadSlots(void *p)
+{
+	ThreadSlots *t = (ThreadSlots*)p;
+	JMutexAutoLock lock(t->registry->m_mutex);
+	t->registry->m_free_threads.push_back(t);
+}
+
+u32 ProbeRegistry::getThreadSlotsCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_threads.size();
+}
+
+void ProbeRegistry::sumTotals(ProbeId id, Totals &totals)
+{
+	memset(&totals, 0, sizeof(totals));
+	for(u32 t = 0; t < m_threads.size(); t++)
+	{
+		ProbeSlot *slot = m_threads[t]->slots[id];
+		if(slot == NULL)
+			continue;
+		totals.count += porting::atomicLoadAcquire(&slot->count);
+		totals.sum += porting::atomicLoad(&slot->sum);
+		for(u32 b = 0; b < PROBE_BUCKETS; b++)
+			totals.buckets[b] += porting::atomicLoad(&slot->buckets[b]);
+	}
+}
+
+void ProbeRegistry::collect(std::vector<ProbeStats> &result)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 epoch = m_epoch;
+	for(u32 id = 0; id < m_names.size(); id++)
+	{
+		Totals totals;
+		sumTotals(id, totals);
+
+		// Differences since reset(), correct across wrap arounds
+		const Totals &last = m_last[id];
+		u32 count = totals.count - last.count;
+		if(count == 0)
+			continue;
+
+		ProbeStats stats;
+		stats.name = m_names[id];
+		stats.count = count;
+		stats.avg = (float)(totals.sum - last.sum) / count;
+
+		// Samples taken around reset() may have no min and max yet
+		bool have_minmax = false;
+		stats.min = 0;
+		stats.max = 0;
+		for(u32 t = 0; t < m_threads.size(); t++)
+		{
+			ProbeSlot *slot = m_threads[t]->slots[id];
+			if(slot == NULL ||
+					porting::atomicLoadAcquire(&slot->epoch) != epoch)
+				continue;
+			u32 min = porting::atomicLoad(&slot->min);
+			u32 max = porting::atomicLoad(&slot->max);
+			if(!have_minmax || min < stats.min)
+				stats.min = min;
+			if(!have_minmax || max > stats.max)
+				stats.max = max;
+			have_minmax = true;
+		}
+
+		// Percentiles: the bucket holding the n-th smallest sample
+		u32 rank50 = (count + 1) / 2;
+		u32 rank99 = count - count / 100;
+		stats.p50 = 0;
+		stats.p99 = 0;
+		u32 seen = 0;
+		for(u32 b = 0; b < PROBE_BUCKETS; b++)
+		{
+			u32 n = totals.buckets[b] - last.buckets[b];
+			if(n == 0)
+				continue;
+			if(seen < rank50 && seen + n >= rank50)
+				stats.p50 = getBucketValue(b);
+			if(seen < rank99 && seen + n >= rank99)
+				stats.p99 = getBucketValue(b);
+			seen += n;
+		}
+
+		if(have_minmax){
+			stats.p50 = MYMIN(MYMAX(stats.p50, stats.min), stats.max);
+			stats.p99 = MYMIN(MYMAX(stats.p99, stats.min), stats.max);
+		} else {
+			stats.min = stats.p50;
+			stats.max = stats.p99;
+		}
+
+		result.push_back(stats);
+	}
+}
+
+void ProbeRegistry::reset()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(u32 id = 0; id < m_names.size(); id++)
+		sumTotals(id, m_last[id]);
+
+	porting::atomicStore(&m_epoch, m_epoch + 1);
+}
+
+void ProbeRegistry::collectAverages(std::map<std::string, float> &result)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(u32 id = 0; id < m_names.size(); id++)
+	{
+		Totals totals;
+		sumTotals(id, totals);
+
+		Totals &last = m_last_averages[id];
+		u32 count = totals.count - last.count;
+		if(count != 0)
+			result[m_names[id]] = (float)(totals.sum - last.sum) / count;
+		last = totals;
+	}
+}
+
+u32 ProbeRegistry::getBucket(u32 value)
+{
+	if(value < PROBE_BUCKET_SUBDIV)
+		return value;
+
+	// Position of the highest set bit
+	u32 high = 0;
+	u32 v = value;
+	if(v >= 1 << 16) { v >>= 16; high += 16; }
+	if(v >= 1 << 8) { v >>= 8; high += 8; }
+	if(v >= 1 << 4) { v >>= 4; high += 4; }
+	if(v >= 1 << 2) { v >>= 2; high += 2; }
+	if(v >= 1 << 1) { high += 1; }
+
+	// The bits below the highest one select the bucket in the octave
+	u32 sub = (value >> (high - PROBE_BUCKET_SUBDIV_BITS))
+			& (PROBE_BUCKET_SUBDIV - 1);
+	return (high - PROBE_BUCKET_SUBDIV_BITS + 1) * PROBE_BUCKET_SUBDIV + sub;
+}
+
+u32 ProbeRegistry::getBucketValue(u32 bucket)
+{
+	if(bucket < PROBE_BUCKET_SUBDIV)
+		return bucket;
+
+	u32 octave = bucket / PROBE_BUCKET_SUBDIV - 1;
+	u32 sub = bucket % PROBE_BUCKET_SUBDIV;
+	return (PROBE_BUCKET_SUBDIV + sub) << octave;
+}
@@ -25,9 +25,148 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "jthread/jmutex.h"
 #include "jthread/jmutexautolock.h"
 #include <map>
+#include <vector>
 #include "util/timetaker.h"
 #include "util/numeric.h" // paging()
 #include "debug.h" // assert()
+#include "porting.h" // ThreadLocalKey, atomicLoad()
+
+/*
+	Probes
+
+	A cheaper way than ScopeProfiler to profile hot code. A probe is
+	registered once, into a function local static, and is then only an
+	index; samples go to a buffer of the sampling thread without locking
+	or looking up any name:
+
+		static ProbeId probe = g_probes.registerProbe("collisionMoveSimple (us)");
+		ScopeProbe sp(probe);
+
+	A Profiler given the registry prints min/avg/p50/p99/max of every
+	probe sampled since its last clear(). Percentiles come from a
+	histogram and are exact to PROBE_BUCKET_SUBDIV buckets per doubling.
+	Its graphGet() also returns the average of every probe sampled since
+	the previous graphGet().
+*/
+
+typedef u16 ProbeId;
+
+#define PROBE_MAX 256
+#define PROBE_INVALID 0xffff
+#define PROBE_BUCKET_SUBDIV_BITS 2
+#define PROBE_BUCKET_SUBDIV (1 << PROBE_BUCKET_SUBDIV_BITS)
+#define PROBE_BUCKETS (32 * PROBE_BUCKET_SUBDIV)
+
+/*
+	One probe in one thread. Only the owning thread writes it, with
+	porting::atomicStore(); the counters are cumulative and wrap around,
+	readers take differences. count is stored last and read first, so
+	that the buckets always hold at least count samples. min and max are
+	only valid if epoch is the registry's current one.
+*/
+struct ProbeSlot
+{
+	u32 count;
+	u32 sum;
+	u32 buckets[PROBE_BUCKETS];
+	u32 epoch;
+	u32 min;
+	u32 max;
+};
+
+struct ProbeStats
+{
+	std::string name;
+	u32 count;
+	u32 min;
+	u32 max;
+	float avg;
+	u32 p50;
+	u32 p99;
+};
+
+class ProbeRegistry
+{
+public:
+	ProbeRegistry();
+
+	// Returns the same id for the same name; PROBE_INVALID if full
+	ProbeId registerProbe(const std::string &name);
+
+	void sample(ProbeId id, u32 value);
+
+	// Probes sampled since the last reset()
+	void collect(std::vector<ProbeStats> &result);
+	void reset();
+
+	// Averages of the probes sampled since the last call
+	void collectAverages(std::map<std::string, float> &result);
+
+	static u32 getBucket(u32 value);
+	// Smallest value falling into the bucket
+	static u32 getBucketValue(u32 bucket);
+
+	// Slot sets in use or kept for new threads, at most one for each
+	// thread sampling at the same time
+	u32 getThreadSlotsCount();
+
+private:
+	struct Totals
+	{
+		u32 count;
+		u32 sum;
+		u32 buckets[PROBE_BUCKETS];
+	};
+
+	/*
+		The slots of a thread that sampled, created on use. When the
+		thread exits they are kept for the next new thread, so that the
+		totals never go back.
+	*/
+	struct ThreadSlots
+	{
+		ProbeRegistry *registry;
+		ProbeSlot *slots[PROBE_MAX];
+	};
+
+	ProbeSlot *createSlot(ProbeId id);
+	// Destructor of m_thread_slots
+	static void releaseThreadSlots(void *p);
+	void sumTotals(ProbeId id, Totals &totals);
+
+	// The ThreadSlots of the current thread
+	porting::ThreadLocalKey m_thread_slots;
+	// Guards everything but the slot contents
+	JMutex m_mutex;
+	std::vector<std::string> m_names;
+	std::vector<ThreadSlots*> m_threads;
+	// Those of m_threads whose thread has exited
+	std::vector<ThreadSlots*> m_free_threads;
+	// Totals at the last reset()
+	std::vector<Totals> m_last;
+	// Totals at the last collectAverages()
+	std::vector<Totals> m_last_averages;
+	// Written under m_mutex, read by the sampling threads
+	u32 m_epoch;
+};
+
+extern ProbeRegistry g_probes;
+
+class ScopeProbe
+{
+public:
+	ScopeProbe(ProbeId id):
+		m_id(id),
+		m_start(getTime(PRECISION_MICRO))
+	{}
+	~ScopeProbe()
+	{
+		g_probes.sample(m_id, getTime(PRECISION_MICRO) - m_start);
+	}
+private:
+	ProbeId m_id;
+	u32 m_start;
+};
 
 /*
 	Time profiler
@@ -36,7 +175,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class Profiler
 {
 public:
-	Profiler()
+	// Probes of the registry are printed and graphed with the other values
+	Profiler(ProbeRegistry *probes=NULL):
+		m_probes(probes)
 	{
 	}
 
@@ -95,6 +236,8 @@ class Profiler
 			i->second = 0;
 		}
 		m_avgcounts.clear();
+		if(m_probes)
+			m_probes->reset();
 	}
 
 	void print(std::ostream &o)
@@ -106,8 +249,13 @@ class Profiler
 	{
 		JMutexAutoLock lock(m_mutex);
 
+		std::vector<ProbeStats> probes;
+		if(m_probes)
+			m_probes->collect(probes);
+
 		u32 minindex, maxindex;
-		paging(m_data.size(), page, pagecount, minindex, maxindex);
+		paging(m_data.size() + probes.size(), page, pagecount,
+				minindex, maxindex);
 
 		for(std::map<std::string, float>::iterator
 				i = m_data.begin();
@@ -130,17 +278,28 @@ class Profiler
 				if(n->second >= 1)
 					avgcount = n->second;
 			}
-			o<<"  "<<name<<": ";
-			s32 clampsize = 40;
-			s32 space = clampsize - name.size();
-			for(s32 j=0; j<space; j++)
+			printName(o, name);
+			o<<(i->second / avgcount);
+			o<<std::endl;
+		}
+
+		for(std::vector<ProbeStats>::iterator
+				i = probes.begin();
+				i != probes.end(); ++i)
+		{
+			if(maxindex == 0)
+				break;
+			maxindex--;
+
+			if(minindex != 0)
 			{
-				if(j%2 == 0 && j < space - 1)
-					o<<"-";
-				else
-					o<<" ";
+				minindex--;
+				continue;
 			}
-			o<<(i->second / avgcount);
+
+			printName(o, i->name);
+			o<<"n="<<i->count<<" min="<<i->min<<" avg="<<i->avg
+					<<" p50="<<i->p50<<" p99="<<i->p99<<" max="<<i->max;
 			o<<std::endl;
 		}
 	}
@@ -162,6 +321,8 @@ class Profiler
 		JMutexAutoLock lock(m_mutex);
 		result = m_graphvalues;
 		m_graphvalues.clear();
+		if(m_probes)
+			m_probes->collectAverages(result);
 	}
 
 	void remove(const std::string& name)
@@ -172,6 +333,21 @@ class Profiler
 	}
 
 private:
+	void printName(std::ostream &o, const std::string &name)
+	{
+		o<<"  "<<name<<": ";
+		s32 clampsize = 40;
+		s32 space = clampsize - name.size();
+		for(s32 j=0; j<space; j++)
+		{
+			if(j%2 == 0 && j < space - 1)
+				o<<"-";
+			else
+				o<<" ";
+		}
+	}
+
+	ProbeRegistry *m_probes;
 	JMutex m_mutex;
 	std::map<std::string, float> m_data;
 	std::map<std::string, int> m_avgcounts;
@@ -271,6 +271,30 @@ int LuaVoxelManip::l_set_param2_data(lua_State *L)
 	return 0;
 }
 
+int LuaVoxelManip::l_get_data_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelBuffer::create_object(L, 1, VOXELBUFFER_CONTENT);
+}
+
+int LuaVoxelManip::l_get_light_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelBuffer::create_object(L, 1, VOXELBUFFER_LIGHT);
+}
+
+int LuaVoxelManip::l_get_param2_buffer(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+	return LuaVoxelBuffer::create_object(L, 1, VOXELBUFFER_PARAM2);
+}
+
 int LuaVoxelManip::l_update_map(lua_State *L)
 {
 	LuaVoxelManip *o = checkobject(L, 1);
@@ -396,5 +420,335 @@ const luaL_reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, set_light_data),
 	luamethod(LuaVoxelManip, get_param2_data),
 	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, get_data_buffer),
+	luamethod(LuaVoxelManip, get_light_buffer),
+	luamethod(LuaVoxelManip, get_param2_buffer),
+	{0,0}
+};
+
+/*
+  LuaVoxelBuffer
+ */
+
+inline u16 LuaVoxelBuffer::get(const MapNode &n, VoxelBufferField field)
+{
+	switch (field) {
+		case VOXELBUFFER_CONTENT:
+			return n.param0;
+		case VOXELBUFFER_LIGHT:
+			return n.param1;
+		default:
+			return n.param2;
+	}
+}
+
+inline void LuaVoxelBuffer::set(MapNode &n, VoxelBufferField field, u16 value)
+{
+	switch (field) {
+		case VOXELBUFFER_CONTENT:
+			n.param0 = value;
+			break;
+		case VOXELBUFFER_LIGHT:
+			n.param1 = value;
+			break;
+		default:
+			n.param2 = value;
+			break;
+	}
+}
+
+u32 LuaVoxelBuffer::getSize()
+{
+	ManualMapVoxelManipulator *vm = vmanip->vm;
+	if (vm->m_data == NULL)
+		return 0;
+	return vm->m_area.getVolume();
+}
+
+MapNode *LuaVoxelBuffer::getData()
+{
+	return vmanip->vm->m_data;
+}
+
+void LuaVoxelBuffer::readRange(lua_State *L, int narg, u32 *start, u32 *end)
+{
+	u32 size = getSize();
+	lua_Integer i1 = luaL_optinteger(L, narg, 1);
+	lua_Integer i2 = luaL_optinteger(L, narg + 1, size);
+	luaL_argcheck(L, i1 >= 1, narg, "index out of range");
+	luaL_argcheck(L, i2 <= (lua_Integer)size, narg + 1, "index out of range");
+	*start = i1 - 1;
+	*end = MYMAX(i2, i1 - 1);
+}
+
+// garbage collector
+int LuaVoxelBuffer::gc_object(lua_State *L)
+{
+	LuaVoxelBuffer *o = *(LuaVoxelBuffer **)(lua_touserdata(L, 1));
+	luaL_unref(L, LUA_REGISTRYINDEX, o->vmanip_ref);
+	delete o;
+
+	return 0;
+}
+
+// buffer[i]; anything but numbers looks up the methods
+int LuaVoxelBuffer::mt_index(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	if (lua_type(L, 2) != LUA_TNUMBER) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+	}
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	lua_Integer i = lua_tointeger(L, 2);
+	if (i < 1 || i > (lua_Integer)o->getSize()) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	lua_pushinteger(L, get(o->getData()[i - 1], o->field));
+	return 1;
+}
+
+// buffer[i] = value
+int LuaVoxelBuffer::mt_newindex(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	lua_Integer i = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, i >= 1 && i <= (lua_Integer)o->getSize(), 2,
+			"index out of range");
+
+	set(o->getData()[i - 1], o->field, luaL_checkinteger(L, 3));
+	return 0;
+}
+
+// #buffer
+int LuaVoxelBuffer::mt_len(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	lua_pushinteger(L, o->getSize());
+	return 1;
+}
+
+// size(self)
+int LuaVoxelBuffer::l_size(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	lua_pushinteger(L, o->getSize());
+	return 1;
+}
+
+// fill(self, value, [i1, i2])
+int LuaVoxelBuffer::l_fill(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	u16 value = luaL_checkinteger(L, 2);
+	u32 start, end;
+	o->readRange(L, 3, &start, &end);
+
+	MapNode *data = o->getData();
+	VoxelBufferField field = o->field;
+	for (u32 i = start; i != end; i++)
+		set(data[i], field, value);
+
+	return 0;
+}
+
+// replace(self, old_value, new_value, [i1, i2]) -> number replaced
+int LuaVoxelBuffer::l_replace(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	u16 old_value = luaL_checkinteger(L, 2);
+	u16 new_value = luaL_checkinteger(L, 3);
+	u32 start, end;
+	o->readRange(L, 4, &start, &end);
+
+	MapNode *data = o->getData();
+	VoxelBufferField field = o->field;
+	u32 count = 0;
+	for (u32 i = start; i != end; i++) {
+		if (get(data[i], field) == old_value) {
+			set(data[i], field, new_value);
+			count++;
+		}
+	}
+
+	lua_pushinteger(L, count);
+	return 1;
+}
+
+// copy_from(self, src, [dst_start, src_start, count])
+// src is a VoxelBuffer or an array
+int LuaVoxelBuffer::l_copy_from(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	lua_Integer size = o->getSize();
+	lua_Integer dst_start = luaL_optinteger(L, 3, 1);
+	lua_Integer src_start = luaL_optinteger(L, 4, 1);
+	luaL_argcheck(L, dst_start >= 1, 3, "index out of range");
+	luaL_argcheck(L, src_start >= 1, 4, "index out of range");
+
+	MapNode *data = o->getData();
+	VoxelBufferField field = o->field;
+
+	if (lua_istable(L, 2)) {
+		lua_Integer src_size = lua_objlen(L, 2);
+		lua_Integer count = luaL_optinteger(L, 5,
+				MYMIN(src_size - src_start + 1, size - dst_start + 1));
+		luaL_argcheck(L, count >= 0 &&
+				dst_start + count - 1 <= size &&
+				src_start + count - 1 <= src_size, 5, "count out of range");
+
+		for (lua_Integer i = 0; i != count; i++) {
+			lua_rawgeti(L, 2, src_start + i);
+			set(data[dst_start - 1 + i], field, lua_tointeger(L, -1));
+			lua_pop(L, 1);
+		}
+		return 0;
+	}
+
+	LuaVoxelBuffer *src = checkobject(L, 2);
+	lua_Integer src_size = src->getSize();
+	lua_Integer count = luaL_optinteger(L, 5,
+			MYMIN(src_size - src_start + 1, size - dst_start + 1));
+	luaL_argcheck(L, count >= 0 &&
+			dst_start + count - 1 <= size &&
+			src_start + count - 1 <= src_size, 5, "count out of range");
+
+	MapNode *src_data = src->getData() + src_start - 1;
+	MapNode *dst_data = data + dst_start - 1;
+	VoxelBufferField src_field = src->field;
+	if (src_data == dst_data && src_field == field)
+		return 0;
+	// Copy backwards if the source would be overwritten before it is read
+	if (dst_data > src_data && dst_data < src_data + count) {
+		for (lua_Integer i = count - 1; i >= 0; i--)
+			set(dst_data[i], field, get(src_data[i], src_field));
+	} else {
+		for (lua_Integer i = 0; i != count; i++)
+			set(dst_data[i], field, get(src_data[i], src_field));
+	}
+
+	return 0;
+}
+
+// to_table(self, [i1, i2]) -> array
+int LuaVoxelBuffer::l_to_table(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelBuffer *o = checkobject(L, 1);
+	u32 start, end;
+	o->readRange(L, 2, &start, &end);
+
+	MapNode *data = o->getData();
+	VoxelBufferField field = o->field;
+	lua_createtable(L, end - start, 0);
+	for (u32 i = start; i != end; i++) {
+		lua_pushinteger(L, get(data[i], field));
+		lua_rawseti(L, -2, i - start + 1);
+	}
+
+	return 1;
+}
+
+LuaVoxelBuffer::LuaVoxelBuffer(LuaVoxelManip *vmanip, int vmanip_ref,
+		VoxelBufferField field)
+{
+	this->vmanip     = vmanip;
+	this->vmanip_ref = vmanip_ref;
+	this->field      = field;
+}
+
+LuaVoxelBuffer::~LuaVoxelBuffer()
+{
+}
+
+int LuaVoxelBuffer::create_object(lua_State *L, int narg,
+		VoxelBufferField field)
+{
+	LuaVoxelManip *vmanip = LuaVoxelManip::checkobject(L, narg);
+	lua_pushvalue(L, narg);
+	int vmanip_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	LuaVoxelBuffer *o = new LuaVoxelBuffer(vmanip, vmanip_ref, field);
+	*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+LuaVoxelBuffer *LuaVoxelBuffer::checkobject(lua_State *L, int narg)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+
+	void *ud = luaL_checkudata(L, narg, className);
+	if (!ud)
+		luaL_typerror(L, narg, className);
+
+	return *(LuaVoxelBuffer **)ud;  // unbox pointer
+}
+
+void LuaVoxelBuffer::Register(lua_State *L)
+{
+	lua_newtable(L);
+	int methodtable = lua_gettop(L);
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushvalue(L, methodtable);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	// Numbers index the buffer, names the methods
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, methodtable);
+	lua_pushcclosure(L, mt_index, 1);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__newindex");
+	lua_pushcfunction(L, mt_newindex);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__len");
+	lua_pushcfunction(L, mt_len);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, gc_object);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+
+	luaL_openlib(L, 0, methods, 0);  // fill methodtable
+	lua_pop(L, 1);  // drop methodtable
+
+	// Created by VoxelManip:get_*_buffer()
+}
+
+const char LuaVoxelBuffer::className[] = "VoxelBuffer";
+const luaL_reg LuaVoxelBuffer::methods[] = {
+	luamethod(LuaVoxelBuffer, size),
+	luamethod(LuaVoxelBuffer, fill),
+	luamethod(LuaVoxelBuffer, replace),
+	luamethod(LuaVoxelBuffer, copy_from),
+	luamethod(LuaVoxelBuffer, to_table),
 	{0,0}
 };
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class Map;
 class MapBlock;
+class MapNode;
 class ManualMapVoxelManipulator;
 
 /*
@@ -33,6 +34,8 @@ class ManualMapVoxelManipulator;
  */
 class LuaVoxelManip : public ModApiBase {
 private:
+	friend class LuaVoxelBuffer;
+
 	ManualMapVoxelManipulator *vm;
 	std::map<v3s16, MapBlock *> modified_blocks;
 	bool is_mapgen_vm;
@@ -58,6 +61,10 @@ class LuaVoxelManip : public ModApiBase {
 	static int l_get_param2_data(lua_State *L);
 	static int l_set_param2_data(lua_State *L);
 
+	static int l_get_data_buffer(lua_State *L);
+	static int l_get_light_buffer(lua_State *L);
+	static int l_get_param2_buffer(lua_State *L);
+
 public:
 	LuaVoxelManip(ManualMapVoxelManipulator *mmvm, bool is_mapgen_vm);
 	LuaVoxelManip(Map *map);
@@ -72,4 +79,61 @@ class LuaVoxelManip : public ModApiBase {
 	static void Register(lua_State *L);
 };
 
+enum VoxelBufferField {
+	VOXELBUFFER_CONTENT,
+	VOXELBUFFER_LIGHT,
+	VOXELBUFFER_PARAM2
+};
+
+/*
+  VoxelBuffer
+
+  A view of one field of the nodes of a VoxelManip, without copying them.
+  Keeps the VoxelManip alive and always refers to its current data, so
+  that it stays valid across read_from_map().
+ */
+class LuaVoxelBuffer : public ModApiBase {
+private:
+	LuaVoxelManip *vmanip;
+	// Registry reference to the VoxelManip userdata
+	int vmanip_ref;
+	VoxelBufferField field;
+
+	static const char className[];
+	static const luaL_reg methods[];
+
+	static int gc_object(lua_State *L);
+	static int mt_index(lua_State *L);
+	static int mt_newindex(lua_State *L);
+	static int mt_len(lua_State *L);
+
+	static int l_size(lua_State *L);
+	static int l_fill(lua_State *L);
+	static int l_replace(lua_State *L);
+	static int l_copy_from(lua_State *L);
+	static int l_to_table(lua_State *L);
+
+	u32 getSize();
+	MapNode *getData();
+	// Reads the 1-based inclusive range [i1, i2] from the arguments at
+	// narg and narg + 1, defaulting to the whole buffer
+	void readRange(lua_State *L, int narg, u32 *start, u32 *end);
+
+	static inline u16 get(const MapNode &n, VoxelBufferField field);
+	static inline void set(MapNode &n, VoxelBufferField field, u16 value);
+
+public:
+	LuaVoxelBuffer(LuaVoxelManip *vmanip, int vmanip_ref,
+			VoxelBufferField field);
+	~LuaVoxelBuffer();
+
+	// Creates a LuaVoxelBuffer of the VoxelManip at narg and leaves it on
+	// top of stack
+	static int create_object(lua_State *L, int narg, VoxelBufferField field);
+
+	static LuaVoxelBuffer *checkobject(lua_State *L, int narg);
+
+	static void Register(lua_State *L);
+};
+
 #endif /* L_VMANIP_H_ */
@@ -341,6 +341,9 @@ Server::Server(
 	// Apply item aliases in the node definition manager
 	m_nodedef->updateAliases(m_itemdef);
 
+	// Precompute the node collision boxes
+	m_nodedef->updateCollisionBoxes();
+
 	// Load the mapgen params from global settings now after any
 	// initial overrides have been set by the mods
 	m_emerge->loadMapgenParams();
@@ -2739,6 +2742,7 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 		Player *player = m_env->getPlayer(loc.name.c_str());
 		if(!player)
 			return;
+		player->setModified(true);
 		PlayerSAO *playersao = player->getPlayerSAO();
 		if(!playersao)
 			return;
@@ -3639,7 +3643,7 @@ void Server::setBlockNotSent(v3s16 p)
 		i != clients.end(); ++i)
 	{
 		RemoteClient *client = m_clients.lockedGetClientNoEx(*i);
-		client->SetBlockNotSent(p);
+		client->SetBlockChanged(p);
 	}
 	m_clients.Unlock();
 }
@@ -3675,19 +3679,21 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 		Create a packet with the block in the right format
 	*/
 
+	// The bulk of the data is shared by all clients with the same
+	// serialization version and only compressed once
+	const std::string &blockdata = block->getNetworkSerialization(ver);
 	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
 	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	std::string netdata = os.str();
 
-	u32 replysize = 8 + blockdata.getSize();
+	u32 replysize = 8 + blockdata.size() + netdata.size();
 	SharedBuffer<u8> reply(replysize);
 	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
 	writeS16(&reply[2], p.X);
 	writeS16(&reply[4], p.Y);
 	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	memcpy(&reply[8], blockdata.c_str(), blockdata.size());
+	memcpy(&reply[8 + blockdata.size()], netdata.c_str(), netdata.size());
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
 			<<":  \tpacket size: "<<replysize<<std::endl;*/
@@ -3698,6 +3704,31 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 	m_clients.send(peer_id, 2, reply, true);
 }
 
+void Server::SendBlockDeltaNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v3s16 p = block->getPos();
+
+	// Like the block data, shared by all clients getting this delta
+	const std::string &deltadata = block->getNetworkDelta(ver);
+	std::ostringstream os(std::ios_base::binary);
+	block->serializeNetworkSpecific(os, net_proto_version);
+	std::string netdata = os.str();
+
+	u32 replysize = 8 + deltadata.size() + netdata.size();
+	SharedBuffer<u8> reply(replysize);
+	writeU16(&reply[0], TOCLIENT_BLOCKDELTA);
+	writeS16(&reply[2], p.X);
+	writeS16(&reply[4], p.Y);
+	writeS16(&reply[6], p.Z);
+	memcpy(&reply[8], deltadata.c_str(), deltadata.size());
+	memcpy(&reply[8 + deltadata.size()], netdata.c_str(), netdata.size());
+
+	// Same channel as the block data, so deltas never overtake it
+	m_clients.send(peer_id, 2, reply, true);
+}
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3737,12 +3768,16 @@ void Server::SendBlocks(float dtime)
 	// Lowest is most important.
 	std::sort(queue.begin(), queue.end());
 
+	static CachedSetting<s32> max_sends_total(g_settings,
+			"max_simultaneous_block_sends_server_total");
+
+	u32 delta_count = 0;
+
 	m_clients.Lock();
 	for(u32 i=0; i<queue.size(); i++)
 	{
 		//TODO: Calculate limit dynamically
-		if(total_sending >= g_settings->getS32
-				("max_simultaneous_block_sends_server_total"))
+		if(total_sending >= max_sends_total.get())
 			break;
 
 		PrioritySortedBlockTransfer q = queue[i];
@@ -3762,12 +3797,43 @@ void Server::SendBlocks(float dtime)
 		if(!client)
 			continue;
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version, client->net_proto_version);
+		u32 version = block->getNetworkVersion();
+		u32 client_version;
+		bool has_version = client->GetBlockVersion(q.pos, client_version);
+
+		if(has_version && client_version == version)
+		{
+			// Nothing the client would see has changed
+			client->SentBlock(q.pos);
+			client->GotBlock(q.pos);
+			continue;
+		}
+
+		if(has_version && client->net_proto_version >= 23 &&
+				block->canSendNetworkDelta(client_version))
+		{
+			SendBlockDeltaNoLock(q.peer_id, block,
+					client->serialization_version, client->net_proto_version);
+			delta_count++;
+		}
+		else
+		{
+			SendBlockNoLock(q.peer_id, block,
+					client->serialization_version, client->net_proto_version);
 
+			// Start recording changes from what the client has now,
+			// unless they are already recorded for others
+			if(!block->canSendNetworkDelta(version))
+				block->startNetworkChanges();
+		}
+
+		client->SetBlockVersion(q.pos, version);
 		client->SentBlock(q.pos);
 		total_sending++;
 	}
 	m_clients.Unlock();
+
+	g_profiler->avg("Server: block deltas sent", delta_count);
 }
 
 void Server::fillMediaCache()
@@ -4230,6 +4296,9 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 			JMutexAutoLock env_lock(m_env_mutex);
 			m_clients.DeleteClient(peer_id);
 		}
+
+		// Drop the blocks still queued for this client
+		m_emerge->removePeer(peer_id);
 	}
 
 	// Send leave chat message to all remaining clients
@@ -4715,6 +4784,7 @@ IShaderSource* Server::getShaderSource()
 }
 u16 Server::allocateUnknownNodeId(const std::string &name)
 {
+	JMutexAutoLock lock(m_unknown_node_id_mutex);
 	return m_nodedef->allocateDummy(name);
 }
 ISoundManager* Server::getSoundManager()
@@ -382,6 +382,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// Environment and Connection must be locked when called
 	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
+	// Sends only what changed since the client's version, see MapBlock
+	void SendBlockDeltaNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto_version);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -468,6 +470,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	ServerEnvironment *m_env;
 	JMutex m_env_mutex;
 
+	// Blocks can be deserialized by emerge threads without the envlock
+	JMutex m_unknown_node_id_mutex;
+
 	// server connection
 	con::Connection m_con;
 
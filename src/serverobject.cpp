@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include "inventory.h"
 #include "constants.h" // BS
+#include "environment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
@@ -29,6 +30,7 @@ ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	m_pending_deactivation(false),
 	m_static_exists(false),
 	m_static_block(1337,1337,1337),
+	m_indexed(false),
 	m_env(env),
 	m_base_position(pos)
 {
@@ -38,6 +40,13 @@ ServerActiveObject::~ServerActiveObject()
 {
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	if(m_indexed)
+		m_env->updateActiveObjectIndex(this);
+}
+
 ServerActiveObject* ServerActiveObject::create(u8 type,
 		ServerEnvironment *env, u16 id, v3f pos,
 		const std::string &data)
@@ -82,7 +82,8 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	// Also keeps the environment's active object index up to date
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
@@ -113,6 +114,16 @@ class ServerActiveObject : public ActiveObject
 			packet.
 	*/
 	virtual void step(float dtime, bool send_recommended){}
+
+	/*
+		Does the part of the next step() that only reads the environment,
+		like moving with collisionMoveSimple(), and keeps the result for
+		step(). If object step threads are enabled, this is called for
+		many objects concurrently before they are stepped, so it must not
+		modify anything but the object itself.
+		Returns false if there was nothing to do.
+	*/
+	virtual bool stepPhysics(float dtime){ return false; }
 	
 	/*
 		The return value of this is passed to the client-side object
@@ -219,6 +230,13 @@ class ServerActiveObject : public ActiveObject
 		a copy of the static data resides.
 	*/
 	v3s16 m_static_block;
+
+	/*
+		Whether the object is in the environment's active object index,
+		and the cell of the index it is in
+	*/
+	bool m_indexed;
+	v3s16 m_index_cell;
 	
 	/*
 		Queue of messages to be sent to the client
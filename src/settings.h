@@ -55,6 +55,36 @@ struct ValueSpec
 	const char *help;
 };
 
+class Settings;
+
+/*
+	A setting value that is parsed once and then kept up to date by
+	Settings whenever the setting changes. For code that reads a setting
+	so often that the lookup and parsing of Settings::get() shows up in
+	profiles. See CachedSetting.
+*/
+class CachedSettingBase
+{
+public:
+	CachedSettingBase(Settings *settings, const std::string &name):
+		m_settings(settings),
+		m_name(name)
+	{}
+	virtual ~CachedSettingBase() {}
+
+	const std::string & getName() const
+		{ return m_name; }
+
+protected:
+	// Called by Settings with its mutex locked; value is "" if not set
+	virtual void parse(const std::string &value) = 0;
+
+	Settings *m_settings;
+	std::string m_name;
+
+	friend class Settings;
+};
+
 class Settings
 {
 public:
@@ -62,6 +92,15 @@ class Settings
 	{
 	}
 
+	~Settings()
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		for(std::list<CachedSettingBase*>::iterator
+				i = m_cached.begin(); i != m_cached.end(); ++i)
+			(*i)->m_settings = NULL;
+	}
+
 	void writeLines(std::ostream &os)
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -91,7 +130,11 @@ class Settings
 	// remove a setting
 	bool remove(const std::string& name)
 	{
-		return m_settings.erase(name);
+		JMutexAutoLock lock(m_mutex);
+
+		bool removed = m_settings.erase(name);
+		updateCached(name);
+		return removed;
 	}
 
 
@@ -122,6 +165,7 @@ class Settings
 				<<value<<"\""<<std::endl;*/
 
 		m_settings[name] = value;
+		updateCached(name);
 
 		return true;
 	}
@@ -425,6 +469,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		updateCached(name);
 	}
 
 	void set(std::string name, const char *value)
@@ -432,6 +477,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		updateCached(name);
 	}
 
 
@@ -440,6 +486,26 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_defaults[name] = value;
+		updateCached(name);
+	}
+
+	/*
+		Registers a CachedSetting so that it is updated when its setting
+		changes, and sets its current value
+	*/
+	void addCached(CachedSettingBase *cached)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		m_cached.push_back(cached);
+		cached->parse(getRaw(cached->getName()));
+	}
+
+	void removeCached(CachedSettingBase *cached)
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		m_cached.remove(cached);
 	}
 
 	bool exists(std::string name)
@@ -787,6 +853,7 @@ class Settings
 
 		m_settings.clear();
 		m_defaults.clear();
+		updateCached();
 	}
 
 	void updateValue(Settings &other, const std::string &name)
@@ -799,6 +866,7 @@ class Settings
 		try{
 			std::string val = other.get(name);
 			m_settings[name] = val;
+			updateCached(name);
 		} catch(SettingNotFoundException &e){
 		}
 
@@ -815,6 +883,7 @@ class Settings
 
 		m_settings.insert(other.m_settings.begin(), other.m_settings.end());
 		m_defaults.insert(other.m_defaults.begin(), other.m_defaults.end());
+		updateCached();
 
 		return;
 	}
@@ -848,10 +917,101 @@ class Settings
 	}
 
 private:
+	/*
+		These expect m_mutex to be locked
+	*/
+	// Returns the value of a setting, or "" if it isn't set
+	std::string getRaw(const std::string &name)
+	{
+		std::map<std::string, std::string>::iterator n;
+		n = m_settings.find(name);
+		if(n != m_settings.end())
+			return n->second;
+		n = m_defaults.find(name);
+		if(n != m_defaults.end())
+			return n->second;
+		return "";
+	}
+
+	// Updates the cached settings of name
+	void updateCached(const std::string &name)
+	{
+		for(std::list<CachedSettingBase*>::iterator
+				i = m_cached.begin(); i != m_cached.end(); ++i)
+		{
+			if((*i)->getName() == name)
+				(*i)->parse(getRaw(name));
+		}
+	}
+
+	// Updates all cached settings
+	void updateCached()
+	{
+		for(std::list<CachedSettingBase*>::iterator
+				i = m_cached.begin(); i != m_cached.end(); ++i)
+			(*i)->parse(getRaw((*i)->getName()));
+	}
+
 	std::map<std::string, std::string> m_settings;
 	std::map<std::string, std::string> m_defaults;
 	// All methods that access m_settings/m_defaults directly should lock this.
 	JMutex m_mutex;
+	std::list<CachedSettingBase*> m_cached;
+};
+
+/*
+	Parsing of the types a CachedSetting can have, the same way as the
+	corresponding Settings::get*() methods
+*/
+inline void parseCachedSetting(const std::string &s, bool &value)
+	{ value = is_yes(s); }
+inline void parseCachedSetting(const std::string &s, float &value)
+	{ value = stof(s); }
+inline void parseCachedSetting(const std::string &s, u16 &value)
+	{ value = stoi(s, 0, 65535); }
+inline void parseCachedSetting(const std::string &s, s16 &value)
+	{ value = stoi(s, -32768, 32767); }
+inline void parseCachedSetting(const std::string &s, s32 &value)
+	{ value = stoi(s); }
+
+/*
+	Typed handle to a setting. get() only reads a member, as the value is
+	updated by Settings when the setting is changed.
+
+	Usually a function-local static, so that it is created after the
+	Settings object:
+
+		static CachedSetting<bool> only_peaceful_mobs(g_settings,
+				"only_peaceful_mobs");
+		if(only_peaceful_mobs.get())
+			...
+*/
+template<typename T>
+class CachedSetting : public CachedSettingBase
+{
+public:
+	CachedSetting(Settings *settings, const std::string &name):
+		CachedSettingBase(settings, name),
+		m_value()
+	{
+		m_settings->addCached(this);
+	}
+
+	~CachedSetting()
+	{
+		if(m_settings)
+			m_settings->removeCached(this);
+	}
+
+	T get() const
+		{ return m_value; }
+
+protected:
+	void parse(const std::string &value)
+		{ parseCachedSetting(value, m_value); }
+
+private:
+	T m_value;
 };
 
 #endif
@@ -46,6 +46,11 @@ typedef int socklen_t;
 typedef int socket_t;
 #endif
 
+// sendmmsg and recvmmsg exist since Linux 3.0 and glibc 2.14
+#if defined(__linux__) && !defined(__ANDROID__) && defined(MSG_WAITFORONE)
+	#define HAVE_MMSG 1
+#endif
+
 #include "constants.h"
 #include "debug.h"
 #include "settings.h"
@@ -528,6 +533,171 @@ int UDPSocket::Receive(Address & sender, void * data, int size)
 	return received;
 }
 
+int UDPSocket::SendBatch(const UDPPacket *packets, int count)
+{
+#ifdef HAVE_MMSG
+	if(!INTERNET_SIMULATOR && !socket_enable_debug_output)
+	{
+		// Kept small enough to live on the stack
+		const int max_batch = 64;
+		struct mmsghdr msgs[max_batch];
+		struct iovec iovs[max_batch];
+		union
+		{
+			struct sockaddr_in  ipv4;
+			struct sockaddr_in6 ipv6;
+		} addresses[max_batch];
+
+		int done = 0;
+		int sent_count = 0;
+		while(done < count)
+		{
+			int n = MYMIN(count - done, max_batch);
+			for(int i = 0; i < n; i++)
+			{
+				const UDPPacket &packet = packets[done + i];
+				// End the batch before a packet that can't be sent
+				if(packet.address.getFamily() != m_addr_family)
+				{
+					n = i;
+					break;
+				}
+
+				memset(&msgs[i], 0, sizeof(msgs[i]));
+				iovs[i].iov_base = packet.data;
+				iovs[i].iov_len = packet.size;
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_name = &addresses[i];
+				if(m_addr_family == AF_INET6)
+				{
+					addresses[i].ipv6 = packet.address.getAddress6();
+					addresses[i].ipv6.sin6_port =
+							htons(packet.address.getPort());
+					msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+				}
+				else
+				{
+					addresses[i].ipv4 = packet.address.getAddress();
+					addresses[i].ipv4.sin_port =
+							htons(packet.address.getPort());
+					msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				}
+			}
+
+			if(n == 0)
+			{
+				// Address family mismatch
+				done++;
+				continue;
+			}
+
+			int sent = sendmmsg(m_handle, msgs, n, 0);
+			if(sent < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				// The first remaining packet failed; go on after it
+				done++;
+				continue;
+			}
+			done += sent;
+			sent_count += sent;
+		}
+		return sent_count;
+	}
+#endif
+
+	int sent_count = 0;
+	for(int i = 0; i < count; i++)
+	{
+		try
+		{
+			Send(packets[i].address, packets[i].data, packets[i].size);
+			sent_count++;
+		}
+		catch(SendFailedException &e)
+		{
+		}
+	}
+	return sent_count;
+}
+
+int UDPSocket::ReceiveBatch(UDPPacket *packets, int count)
+{
+	if(count <= 0)
+		return 0;
+
+#ifdef HAVE_MMSG
+	if(!socket_enable_debug_output)
+	{
+		// Return on timeout
+		if(WaitData(m_timeout_ms) == false)
+			return 0;
+
+		const int max_batch = 64;
+		struct mmsghdr msgs[max_batch];
+		struct iovec iovs[max_batch];
+		union
+		{
+			struct sockaddr_in  ipv4;
+			struct sockaddr_in6 ipv6;
+		} addresses[max_batch];
+
+		int n = MYMIN(count, max_batch);
+		for(int i = 0; i < n; i++)
+		{
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			memset(&addresses[i], 0, sizeof(addresses[i]));
+			iovs[i].iov_base = packets[i].data;
+			iovs[i].iov_len = packets[i].size;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+		}
+
+		int received = recvmmsg(m_handle, msgs, n, MSG_DONTWAIT, NULL);
+		if(received < 0)
+			return 0;
+
+		for(int i = 0; i < received; i++)
+		{
+			packets[i].size = msgs[i].msg_len;
+			if(m_addr_family == AF_INET6)
+			{
+				IPv6AddressBytes bytes;
+				memcpy(bytes.bytes, addresses[i].ipv6.sin6_addr.s6_addr, 16);
+				packets[i].address = Address(&bytes,
+						ntohs(addresses[i].ipv6.sin6_port));
+			}
+			else
+			{
+				packets[i].address = Address(
+						ntohl(addresses[i].ipv4.sin_addr.s_addr),
+						ntohs(addresses[i].ipv4.sin_port));
+			}
+		}
+		return received;
+	}
+#endif
+
+	int received_count = 0;
+	while(received_count < count)
+	{
+		// Only wait for the first packet
+		if(received_count > 0 && WaitData(0) == false)
+			break;
+		UDPPacket &packet = packets[received_count];
+		int received = Receive(packet.address, packet.data, packet.size);
+		if(received < 0)
+			break;
+		packet.size = received;
+		received_count++;
+	}
+	return received_count;
+}
+
 int UDPSocket::GetHandle()
 {
 	return m_handle;
@@ -110,6 +110,17 @@ class Address
 	u16 m_port; // Port is separate from sockaddr structures
 };
 
+/*
+	One datagram of a batched send or receive. For receiving, size is the
+	size of the buffer at data and is set to the size of the datagram.
+*/
+struct UDPPacket
+{
+	Address address;
+	u8 *data;
+	int size;
+};
+
 class UDPSocket
 {
 public:
@@ -121,6 +132,14 @@ class UDPSocket
 	void Send(const Address & destination, const void * data, int size);
 	// Returns -1 if there is no data
 	int Receive(Address & sender, void * data, int size);
+	/*
+		Send or receive many datagrams with a single system call where
+		the system has one (sendmmsg/recvmmsg); elsewhere they are looped.
+		SendBatch returns the number of packets sent, ReceiveBatch the
+		number received, after waiting for the first one like Receive.
+	*/
+	int SendBatch(const UDPPacket *packets, int count);
+	int ReceiveBatch(UDPPacket *packets, int count);
 	int GetHandle(); // For debugging purposes only
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
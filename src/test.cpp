@@ -33,17 +33,26 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblockindex.h"
+#include "profiler.h"
+#include "jthread/jthread.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
 #include "filesys.h"
 #include "voxelalgorithms.h"
+#include "mapgen.h"
+#include "environment.h"
+#include "emerge.h"
+#include "gamedef.h"
 #include "inventory.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
+#include "util/directiontables.h"
 #include "noise.h" // PseudoRandom used for random data for compression
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
 #include <algorithm>
+#include <cstring>
 
 /*
 	Asserts that the exception occurs
@@ -137,6 +146,33 @@ void define_some_nodes(IWritableItemDefManager *idef, IWritableNodeDefManager *n
 	CONTENT_TORCH = ndef->set(f.name, f);
 }
 
+/*
+	Definitions for the tests that need a map
+*/
+
+class TestGameDef: public IGameDef
+{
+public:
+	TestGameDef(IItemDefManager *idef, IWritableNodeDefManager *ndef):
+		m_idef(idef),
+		m_ndef(ndef)
+	{}
+
+	IItemDefManager* getItemDefManager() { return m_idef; }
+	INodeDefManager* getNodeDefManager() { return m_ndef; }
+	ICraftDefManager* getCraftDefManager() { return NULL; }
+	ITextureSource* getTextureSource() { return NULL; }
+	IShaderSource* getShaderSource() { return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name)
+	{ return m_ndef->allocateDummy(name); }
+	ISoundManager* getSoundManager() { return NULL; }
+	MtEventManager* getEventManager() { return NULL; }
+
+private:
+	IItemDefManager *m_idef;
+	IWritableNodeDefManager *m_ndef;
+};
+
 struct TestBase
 {
 	bool test_failed;
@@ -413,6 +449,19 @@ struct TestSettings: public TestBase
 		UASSERT(fabs(s.getV3F("coord2").X - 1.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Y - 2.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Z - 3.3) < 0.001);
+		// Test cached settings following changes
+		CachedSetting<s16> leet(&s, "leet");
+		CachedSetting<bool> flag(&s, "flag");
+		UASSERT(leet.get() == 1337);
+		UASSERT(flag.get() == false);
+		s.setDefault("flag", "true");
+		UASSERT(flag.get() == true);
+		s.set("flag", "false");
+		s.parseConfigLine("leet = 42");
+		UASSERT(flag.get() == false);
+		UASSERT(leet.get() == 42);
+		s.remove("flag");
+		UASSERT(flag.get() == true);
 	}
 };
 
@@ -549,6 +598,75 @@ struct TestNodedefSerialization: public TestBase
 	}
 };
 
+struct TestNodedefCollisionBoxes: public TestBase
+{
+	void Run()
+	{
+		IWritableNodeDefManager *ndef = createNodeDefManager();
+
+		ContentFeatures f;
+		f.name = "test:slab";
+		f.param_type_2 = CPT2_FACEDIR;
+		f.node_box.type = NODEBOX_FIXED;
+		f.node_box.fixed.push_back(aabb3f(-BS/2, -BS/2, -BS/2, BS/2, 0, BS/4));
+		f.groups["bouncy"] = 70;
+		content_t c_slab = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:sign";
+		f.param_type_2 = CPT2_WALLMOUNTED;
+		f.node_box.type = NODEBOX_WALLMOUNTED;
+		content_t c_sign = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:snow";
+		f.param_type_2 = CPT2_LEVELED;
+		f.leveled = 16;
+		f.node_box.type = NODEBOX_LEVELED;
+		f.node_box.fixed.push_back(aabb3f(-BS/2, -BS/2, -BS/2, BS/2, 0, BS/2));
+		content_t c_snow = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:stone";
+		content_t c_stone = ndef->set(f.name, f);
+
+		f = ContentFeatures();
+		f.name = "test:grass";
+		f.walkable = false;
+		content_t c_grass = ndef->set(f.name, f);
+
+		UASSERT(ndef->get(c_slab).getCollisionBoxes(0) == NULL);
+		ndef->updateCollisionBoxes();
+
+		UASSERT(ndef->get(c_slab).collision_boxes.size() == 24);
+		UASSERT(ndef->get(c_slab).collision_bouncy == 70);
+		UASSERT(ndef->get(c_sign).collision_boxes.size() == 6);
+		UASSERT(ndef->get(c_snow).collision_boxes.size() == 256);
+
+		// The same boxes as MapNode::getNodeBoxes() for every param2
+		content_t shaped[] = {c_slab, c_sign, c_snow};
+		for(u32 i = 0; i < sizeof(shaped) / sizeof(shaped[0]); i++)
+		for(u32 param2 = 0; param2 < 256; param2++)
+		{
+			MapNode n(shaped[i], 0, param2);
+			std::vector<aabb3f> boxes = n.getNodeBoxes(ndef);
+			const std::vector<aabb3f> *cached =
+					ndef->get(shaped[i]).getCollisionBoxes(param2);
+			UASSERT(cached != NULL);
+			UASSERT(*cached == boxes);
+		}
+
+		const ContentFeatures &f_stone = ndef->get(c_stone);
+		UASSERT(f_stone.collision_boxes.size() == 1);
+		UASSERT(f_stone.collision_bouncy == 0);
+		UASSERT(f_stone.getCollisionBoxes(5)->size() == 1);
+
+		UASSERT(ndef->get(c_grass).getCollisionBoxes(0)->empty());
+
+		delete ndef;
+	}
+};
+
 struct TestCompress: public TestBase
 {
 	void Run()
@@ -927,6 +1045,141 @@ struct TestVoxelAlgorithms: public TestBase
 	}
 };
 
+struct TestMapgenLighting: public TestBase
+{
+	/*
+		The recursive lighting Mapgen::calcLighting() used before
+	*/
+	static void lightSpreadRecursive(ManualMapVoxelManipulator *vm,
+			INodeDefManager *ndef, VoxelArea &a, v3s16 p, u8 light)
+	{
+		if (light <= 1 || !a.contains(p))
+			return;
+
+		u32 vi = vm->m_area.index(p);
+		MapNode &nn = vm->m_data[vi];
+
+		light--;
+		if (light <= nn.param1 || !ndef->get(nn).light_propagates)
+			return;
+
+		nn.param1 = light;
+
+		lightSpreadRecursive(vm, ndef, a, p + v3s16(0, 0, 1), light);
+		lightSpreadRecursive(vm, ndef, a, p + v3s16(0, 1, 0), light);
+		lightSpreadRecursive(vm, ndef, a, p + v3s16(1, 0, 0), light);
+		lightSpreadRecursive(vm, ndef, a, p - v3s16(0, 0, 1), light);
+		lightSpreadRecursive(vm, ndef, a, p - v3s16(0, 1, 0), light);
+		lightSpreadRecursive(vm, ndef, a, p - v3s16(1, 0, 0), light);
+	}
+
+	static void calcLightingRecursive(ManualMapVoxelManipulator *vm,
+			INodeDefManager *ndef, int water_level, v3s16 nmin, v3s16 nmax)
+	{
+		VoxelArea a(nmin, nmax);
+		bool block_is_underground = (water_level >= nmax.Y);
+
+		v3s16 em = vm->m_area.getExtent();
+		for (int z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++) {
+			for (int x = a.MinEdge.X; x <= a.MaxEdge.X; x++) {
+				u32 i = vm->m_area.index(x, a.MaxEdge.Y + 1, z);
+				if (vm->m_data[i].getContent() == CONTENT_IGNORE) {
+					if (block_is_underground)
+						continue;
+				} else if ((vm->m_data[i].param1 & 0x0F) != LIGHT_SUN) {
+					continue;
+				}
+				vm->m_area.add_y(em, i, -1);
+
+				for (int y = a.MaxEdge.Y; y >= a.MinEdge.Y; y--) {
+					MapNode &n = vm->m_data[i];
+					if (!ndef->get(n).sunlight_propagates)
+						break;
+					n.param1 = LIGHT_SUN;
+					vm->m_area.add_y(em, i, -1);
+				}
+			}
+		}
+
+		for (int z = a.MinEdge.Z; z <= a.MaxEdge.Z; z++) {
+			for (int y = a.MinEdge.Y; y <= a.MaxEdge.Y; y++) {
+				u32 i = vm->m_area.index(a.MinEdge.X, y, z);
+				for (int x = a.MinEdge.X; x <= a.MaxEdge.X; x++, i++) {
+					MapNode &n = vm->m_data[i];
+					if (n.getContent() == CONTENT_IGNORE ||
+						!ndef->get(n).light_propagates)
+						continue;
+
+					u8 light_produced = ndef->get(n).light_source & 0x0F;
+					if (light_produced)
+						n.param1 = light_produced;
+
+					u8 light = n.param1 & 0x0F;
+					if (light) {
+						v3s16 p(x, y, z);
+						for (u32 d = 0; d < 6; d++)
+							lightSpreadRecursive(vm, ndef, a,
+								p + g_6dirs[d], light - 1);
+					}
+				}
+			}
+		}
+	}
+
+	void Run(INodeDefManager *ndef)
+	{
+		v3s16 nmin(0, 0, 0);
+		v3s16 nmax(39, 39, 39);
+		VoxelArea area(nmin - v3s16(1, 1, 1), nmax + v3s16(1, 1, 1));
+		PseudoRandom pr(98765);
+
+		for (u32 round = 0; round < 4; round++)
+		{
+			/*
+				Random caves of air in stone, with torches and random
+				light already on some nodes
+			*/
+			ManualMapVoxelManipulator vm(NULL);
+			vm.addArea(area);
+			u32 stone_chance = 1 + round;
+			for (s32 i = 0; i < area.getVolume(); i++)
+			{
+				MapNode n(pr.range(0, 3) < (s32)stone_chance ?
+						CONTENT_STONE : CONTENT_AIR);
+				if (pr.range(0, 199) == 0)
+					n = MapNode(CONTENT_TORCH);
+				if (pr.range(0, 9) == 0)
+					n.param1 = pr.range(0, 255);
+				vm.m_data[i] = n;
+				vm.m_flags[i] = 0;
+			}
+			// Sometimes there is no sunlight from above
+			if (round == 3) {
+				for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+				for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++)
+					vm.m_data[area.index(x, area.MaxEdge.Y, z)] =
+							MapNode(CONTENT_IGNORE);
+			}
+
+			ManualMapVoxelManipulator expected(NULL);
+			expected.addArea(area);
+			std::copy(vm.m_data, vm.m_data + area.getVolume(),
+					expected.m_data);
+
+			Mapgen mapgen;
+			mapgen.vm = &vm;
+			mapgen.ndef = ndef;
+			mapgen.water_level = round == 3 ? 1000 : -1000;
+			calcLightingRecursive(&expected, ndef, mapgen.water_level,
+					nmin, nmax);
+			mapgen.calcLighting(nmin, nmax);
+
+			for (s32 i = 0; i < area.getVolume(); i++)
+				UASSERT(vm.m_data[i].param1 == expected.m_data[i].param1);
+		}
+	}
+};
+
 struct TestInventory: public TestBase
 {
 	void Run(IItemDefManager *idef)
@@ -1354,6 +1607,200 @@ struct TestMapSector: public TestBase
 };
 #endif
 
+struct TestReadChunkArea: public TestBase
+{
+	/*
+		The emerge threads read the area of a chunk to generate without
+		the envlock, between two sections holding it. Blocks that were in
+		memory during the first section aren't read; if they are unloaded
+		before the second one, the area has to be loaded again.
+	*/
+	void Run(IItemDefManager *idef, IWritableNodeDefManager *ndef)
+	{
+		std::string dir = fs::TempPath() + DIR_DELIM + "mttest_readarea";
+		fs::RecursiveDelete(dir);
+		UASSERT(fs::CreateDir(dir));
+		{
+			std::ofstream os((dir + DIR_DELIM + "world.mt").c_str());
+			os<<"backend = dummy"<<std::endl;
+		}
+
+		TestGameDef gamedef(idef, ndef);
+		{
+			EmergeManager emerge(&gamedef);
+			ServerMap map(dir, &gamedef, &emerge);
+
+			v3s16 bp_neighbor(0,0,0);
+			v3s16 bp_other(1,0,0);
+			v3s16 p(3,4,5);
+
+			// A neighbor that has been saved and unloaded before
+			MapBlock *block = map.createBlock(bp_neighbor);
+			MapNode n(CONTENT_STONE);
+			block->setNode(p, n);
+			map.timerUpdate(1.0, 0.0);
+			UASSERT(map.getBlockNoCreateNoEx(bp_neighbor) == NULL);
+
+			// Read without any unloading in the meantime
+			std::vector<v3s16> positions;
+			positions.push_back(bp_neighbor);
+			positions.push_back(bp_other);
+			std::vector<MapBlock*> blocks;
+			u32 unload_count = map.getUnloadCount();
+			bool all_read = map.readBlocks(positions, blocks);
+			UASSERT(all_read);
+			UASSERT(blocks[0] != NULL);
+			UASSERT(blocks[1] == NULL);
+			UASSERT(map.insertReadArea(blocks, all_read, unload_count));
+			block = map.getBlockNoCreateNoEx(bp_neighbor);
+			UASSERT(block != NULL);
+			UASSERT(block->getNodeNoEx(p).getContent() == CONTENT_STONE);
+
+			// The neighbor is in memory in the first section, so it isn't
+			// read, and is unloaded before the second section
+			unload_count = map.getUnloadCount();
+			positions.clear();
+			positions.push_back(bp_other);
+			map.timerUpdate(1.0, 0.0);
+			UASSERT(map.getBlockNoCreateNoEx(bp_neighbor) == NULL);
+			all_read = map.readBlocks(positions, blocks);
+			UASSERT(all_read);
+			UASSERT(!map.insertReadArea(blocks, all_read, unload_count));
+
+			// Loading the area brings it back
+			block = map.loadBlock(bp_neighbor);
+			UASSERT(block != NULL);
+			UASSERT(block->getNodeNoEx(p).getContent() == CONTENT_STONE);
+		}
+
+		fs::RecursiveDelete(dir);
+	}
+};
+
+struct TestMapBlockDelta: public TestBase
+{
+	// Whether the nodes of a are the same as those of b
+	bool nodesEqual(MapBlock &a, MapBlock &b)
+	{
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			if(!(a.getNodeNoCheck(x,y,z) == b.getNodeNoCheck(x,y,z)))
+				return false;
+		}
+		return true;
+	}
+
+	// What a client holding data would have after applying delta
+	void applyDelta(MapBlock &block, const std::string &data,
+			const std::string &delta, u8 ver)
+	{
+		std::istringstream is(data, std::ios_base::binary);
+		block.deSerialize(is, ver, false);
+		std::istringstream is2(delta, std::ios_base::binary);
+		block.deSerializeNetworkDelta(is2, ver);
+	}
+
+	void Run(IItemDefManager *idef, IWritableNodeDefManager *ndef)
+	{
+		TestGameDef gamedef(idef, ndef);
+		Map map(dout_server, &gamedef);
+		u8 ver = SER_FMT_VER_HIGHEST_WRITE;
+		v3s16 bp(0,0,0);
+
+		// Stone below, air above with a stone roof in one corner
+		MapBlock block(&map, bp, &gamedef);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			bool roof = y == 12 && x >= 12 && z >= 12;
+			MapNode n(y < 8 || roof ? CONTENT_STONE : CONTENT_AIR);
+			block.setNodeNoCheck(x, y, z, n);
+		}
+		std::set<v3s16> light_sources;
+		block.propagateSunlight(light_sources);
+
+		// The version a client got the whole block at
+		u32 base_version = block.getNetworkVersion();
+		std::string base_data = block.getNetworkSerialization(ver);
+		block.startNetworkChanges();
+		UASSERT(block.canSendNetworkDelta(base_version));
+
+		// Dig a shaft for the sunlight and place some nodes
+		for(s16 y=0; y<8; y++)
+		{
+			MapNode n(CONTENT_AIR);
+			block.setNode(v3s16(4,y,4), n);
+		}
+		MapNode torch(CONTENT_TORCH, 0, 3);
+		block.setNodeNoCheck(v3s16(10,8,10), torch);
+		u32 mid_version = block.getNetworkVersion();
+		UASSERT(mid_version != base_version);
+		std::string mid_data = block.getNetworkSerialization(ver);
+
+		// Opening the roof lights the nodes below it without setting them
+		MapNode grass(CONTENT_GRASS);
+		block.setNode(v3s16(0,7,0), grass);
+		MapNode air(CONTENT_AIR);
+		block.setNode(v3s16(13,12,13), air);
+		UASSERT(block.getNodeNoCheck(13,8,13).getLight(LIGHTBANK_DAY, ndef)
+				!= LIGHT_SUN);
+		block.propagateSunlight(light_sources);
+		UASSERT(block.getNodeNoCheck(4,0,4).getLight(LIGHTBANK_DAY, ndef)
+				== LIGHT_SUN);
+		UASSERT(block.getNodeNoCheck(13,8,13).getLight(LIGHTBANK_DAY, ndef)
+				== LIGHT_SUN);
+		u32 version = block.getNetworkVersion();
+		UASSERT(version != mid_version);
+
+		// Both clients are brought up to date by the same delta
+		UASSERT(block.canSendNetworkDelta(base_version));
+		UASSERT(block.canSendNetworkDelta(mid_version));
+		std::string delta = block.getNetworkDelta(ver);
+		{
+			MapBlock copy(&map, bp, &gamedef);
+			applyDelta(copy, base_data, delta, ver);
+			UASSERT(nodesEqual(copy, block));
+		}
+		{
+			MapBlock copy(&map, bp, &gamedef);
+			applyDelta(copy, mid_data, delta, ver);
+			UASSERT(nodesEqual(copy, block));
+		}
+
+		// Dropping the unused cached data keeps the version and the data
+		block.stepNetworkCache(BLOCK_NETWORK_CACHE_TIMEOUT + 1);
+		UASSERT(block.getNetworkVersion() == version);
+		UASSERT(block.canSendNetworkDelta(base_version));
+		UASSERT(block.getNetworkDelta(ver) == delta);
+
+		// Versions from before the changes were recorded are refused
+		UASSERT(!block.canSendNetworkDelta(base_version - 1));
+		block.startNetworkChanges();
+		UASSERT(block.canSendNetworkDelta(version));
+		UASSERT(!block.canSendNetworkDelta(mid_version));
+
+		// A block unloaded and loaded again gets a new version, so a
+		// client holding one from before isn't sent a delta
+		std::ostringstream os(std::ios_base::binary);
+		block.serialize(os, ver, true);
+		MapBlock loaded(&map, bp, &gamedef);
+		std::istringstream is(os.str(), std::ios_base::binary);
+		loaded.deSerialize(is, ver, true);
+		UASSERT(nodesEqual(loaded, block));
+		u32 loaded_version = loaded.getNetworkVersion();
+		UASSERT(loaded_version != version);
+		UASSERT(loaded_version != mid_version);
+		UASSERT(loaded_version != base_version);
+		UASSERT(!loaded.canSendNetworkDelta(version));
+		loaded.startNetworkChanges();
+		UASSERT(loaded.canSendNetworkDelta(loaded_version));
+		UASSERT(!loaded.canSendNetworkDelta(version));
+	}
+};
+
 struct TestCollision: public TestBase
 {
 	void Run()
@@ -1501,6 +1948,551 @@ struct TestCollision: public TestBase
 	}
 };
 
+struct TestObjectCollisionGrid: public TestBase
+{
+	class BoxObject: public ActiveObject
+	{
+	public:
+		BoxObject(u16 id, const aabb3f &box_):
+			ActiveObject(id),
+			box(box_),
+			collides(true)
+		{}
+		u8 getType() const
+			{ return ACTIVEOBJECT_TYPE_INVALID; }
+		bool getCollisionBox(aabb3f *toset)
+			{ *toset = box; return true; }
+		bool collideWithObjects()
+			{ return collides; }
+
+		aabb3f box;
+		bool collides;
+	};
+
+	// Every object touching box, the way the grid replaces
+	void getObjectsInBoxSlow(std::vector<BoxObject*> &objects,
+			const aabb3f &box, std::vector<ActiveObject*> &dst)
+	{
+		for(u32 i = 0; i < objects.size(); i++)
+		{
+			const aabb3f &b = objects[i]->box;
+			if(b.MinEdge.X <= box.MaxEdge.X && b.MaxEdge.X >= box.MinEdge.X &&
+					b.MinEdge.Y <= box.MaxEdge.Y && b.MaxEdge.Y >= box.MinEdge.Y &&
+					b.MinEdge.Z <= box.MaxEdge.Z && b.MaxEdge.Z >= box.MinEdge.Z)
+				dst.push_back(objects[i]);
+		}
+	}
+
+	aabb3f getSweepBox(BoxObject *obj)
+	{
+		aabb3f box = obj->box;
+		box.MinEdge -= v3f(BS/2, BS/2, BS/2);
+		box.MaxEdge += v3f(BS/2, BS/2, BS/2);
+		return box;
+	}
+
+	void Run()
+	{
+		/*
+			1000 mobs crowded in a pen of 16x16 nodes
+		*/
+		ObjectCollisionGrid grid;
+		std::vector<BoxObject*> objects;
+		PseudoRandom pr(2468);
+		for(u16 id = 1; id <= 1000; id++)
+		{
+			v3f pos(pr.range(-8*BS, 8*BS), pr.range(0, BS), pr.range(-8*BS, 8*BS));
+			BoxObject *obj = new BoxObject(id, aabb3f(
+					pos - v3f(0.4*BS, 0, 0.4*BS), pos + v3f(0.4*BS, BS, 0.4*BS)));
+			objects.push_back(obj);
+			grid.update(obj);
+		}
+		UASSERT(grid.size() == objects.size());
+
+		// The same objects as testing every box, each only once
+		std::vector<ActiveObject*> found;
+		std::vector<ActiveObject*> expected;
+		for(u32 i = 0; i < objects.size(); i++)
+		{
+			aabb3f box = getSweepBox(objects[i]);
+			found.clear();
+			expected.clear();
+			grid.getObjectsInBox(box, found);
+			getObjectsInBoxSlow(objects, box, expected);
+			std::sort(found.begin(), found.end());
+			std::sort(expected.begin(), expected.end());
+			UASSERT(found == expected);
+		}
+
+		// Moved, huge, non-colliding and removed objects
+		BoxObject *obj = objects[0];
+		obj->box.MinEdge += v3f(100*BS, 0, 0);
+		obj->box.MaxEdge += v3f(100*BS, 0, 0);
+		grid.update(obj);
+		found.clear();
+		grid.getObjectsInBox(getSweepBox(obj), found);
+		UASSERT(found.size() == 1 && found[0] == obj);
+
+		obj->box = aabb3f(-50*BS, -50*BS, -50*BS, 50*BS, 50*BS, 50*BS);
+		grid.update(obj);
+		found.clear();
+		grid.getObjectsInBox(aabb3f(40*BS, 40*BS, 40*BS, 41*BS, 41*BS, 41*BS),
+				found);
+		UASSERT(found.size() == 1 && found[0] == obj);
+
+		obj->collides = false;
+		grid.update(obj);
+		UASSERT(grid.size() == objects.size() - 1);
+		found.clear();
+		grid.getObjectsInBox(aabb3f(40*BS, 40*BS, 40*BS, 41*BS, 41*BS, 41*BS),
+				found);
+		UASSERT(found.empty());
+
+		grid.remove(objects[1]->getId());
+		UASSERT(grid.size() == objects.size() - 2);
+		found.clear();
+		grid.getObjectsInBox(getSweepBox(objects[1]), found);
+		UASSERT(std::find(found.begin(), found.end(), objects[1]) == found.end());
+
+		obj->collides = true;
+		obj->box = objects[2]->box;
+		grid.update(obj);
+		grid.update(objects[1]);
+		UASSERT(grid.size() == objects.size());
+
+		/*
+			Benchmark against testing every box
+		*/
+		u32 found_grid = 0;
+		u32 found_slow = 0;
+		u32 t0 = porting::getTimeUs();
+		for(u32 r = 0; r < 10; r++)
+		for(u32 i = 0; i < objects.size(); i++)
+		{
+			found.clear();
+			grid.getObjectsInBox(getSweepBox(objects[i]), found);
+			found_grid += found.size();
+		}
+		u32 t1 = porting::getTimeUs();
+		for(u32 r = 0; r < 10; r++)
+		for(u32 i = 0; i < objects.size(); i++)
+		{
+			found.clear();
+			getObjectsInBoxSlow(objects, getSweepBox(objects[i]), found);
+			found_slow += found.size();
+		}
+		u32 t2 = porting::getTimeUs();
+		UASSERT(found_grid == found_slow);
+		infostream<<"TestObjectCollisionGrid: "<<objects.size() * 10
+				<<" queries among "<<objects.size()<<" clustered objects: grid "
+				<<(t1 - t0)<<"us, every box "<<(t2 - t1)<<"us"<<std::endl;
+
+		for(u32 i = 0; i < objects.size(); i++)
+			delete objects[i];
+	}
+};
+
+struct TestActiveBlockList: public TestBase
+{
+	void Run()
+	{
+		ActiveBlockList list;
+		std::set<v3s16> old_list;
+		PseudoRandom pr(1234);
+		std::list<v3s16> positions;
+		for(u32 i = 0; i < 4; i++)
+			positions.push_back(v3s16(pr.range(-5, 5), 0, pr.range(-5, 5)));
+
+		for(u32 step = 0; step < 50; step++)
+		{
+			// Move players around, sometimes far or onto each other
+			for(std::list<v3s16>::iterator i = positions.begin();
+					i != positions.end(); ++i)
+			{
+				if(pr.range(0, 9) == 0)
+					*i = v3s16(pr.range(-20, 20), 0, 0);
+				else
+					*i += v3s16(pr.range(-1, 1), pr.range(-1, 1), 0);
+			}
+			if(step % 10 == 5)
+				list.m_forceloaded_list.insert(v3s16(step, 100, 0));
+			if(step % 20 == 15)
+				list.m_forceloaded_list.clear();
+			s16 radius = step < 25 ? 2 : 1;
+
+			std::set<v3s16> removed;
+			std::set<v3s16> added;
+			list.update(positions, radius, removed, added);
+
+			// Compare to the set of blocks around the positions
+			std::set<v3s16> expected = list.m_forceloaded_list;
+			for(std::list<v3s16>::iterator i = positions.begin();
+					i != positions.end(); ++i)
+			{
+				v3s16 p;
+				for(p.X=i->X-radius; p.X<=i->X+radius; p.X++)
+				for(p.Y=i->Y-radius; p.Y<=i->Y+radius; p.Y++)
+				for(p.Z=i->Z-radius; p.Z<=i->Z+radius; p.Z++)
+					expected.insert(p);
+			}
+			UASSERT(list.m_list == expected);
+
+			// The reported changes have to lead from the old list to it
+			for(std::set<v3s16>::iterator i = removed.begin();
+					i != removed.end(); ++i)
+			{
+				UASSERT(old_list.find(*i) != old_list.end());
+				old_list.erase(*i);
+			}
+			for(std::set<v3s16>::iterator i = added.begin();
+					i != added.end(); ++i)
+			{
+				UASSERT(old_list.find(*i) == old_list.end());
+				old_list.insert(*i);
+			}
+			UASSERT(old_list == expected);
+		}
+	}
+};
+
+struct TestNoise: public TestBase
+{
+	void Run()
+	{
+		// Values of the lattice hash in the original optimized builds,
+		// which did not mask the result to 31 bits
+		UASSERT(noise2d(0, 0, 0) == -0.281790972f);
+		UASSERT(noise2d(12345, -6789, 42) == -0.573043823f);
+		UASSERT(noise3d(-100, 200, -300, 1337) == 1.00969803f);
+		UASSERT(noise3d(31000, -31000, 17, -5) == -0.673676729f);
+
+		/*
+			All kernels have to give the same results as the scalar ones.
+			The map sizes are not multiples of the vector widths.
+		*/
+		NoiseParams np2d(0, 1, v3f(250, 250, 250), 5934, 5, 0.6);
+		NoiseParams np3d(0, 1, v3f(48, 24, 48), 3454, 4, 0.5);
+		Noise noise2d_map(&np2d, 1234, 83, 81);
+		Noise noise3d_map(&np3d, -77, 83, 82, 81);
+		u32 size2d = 83 * 81;
+		u32 size3d = 83 * 82 * 81;
+
+		UASSERT(setNoiseKernels(NOISE_KERNELS_SCALAR));
+		std::vector<float> expected2d(size2d);
+		std::vector<float> expected3d(size3d);
+		memcpy(&expected2d[0], noise2d_map.perlinMap2D(-1280.5, 3344.25),
+			size2d * sizeof(float));
+		memcpy(&expected3d[0], noise3d_map.perlinMap3D(640.3, -33, -96),
+			size3d * sizeof(float));
+
+		// The same maps as before the kernels; not exactly, as -ffast-math
+		// may order the float operations differently
+		UASSERT(fabs(expected2d[0] - 1.11636591) < 0.0001);
+		UASSERT(fabs(expected2d[3000] - 1.60283184) < 0.0001);
+		UASSERT(fabs(expected2d[6660] - 3.63677406) < 0.0001);
+		UASSERT(fabs(expected2d[6722] - 2.32052732) < 0.0001);
+		UASSERT(fabs(expected3d[0] - 0.267593056) < 0.0001);
+		UASSERT(fabs(expected3d[200000] - 2.0336895) < 0.0001);
+		UASSERT(fabs(expected3d[551285] - 3.59791112) < 0.0001);
+
+		const char *names[3] = {"scalar", "SSE2", "AVX2"};
+		for(u32 set = NOISE_KERNELS_SCALAR; set <= NOISE_KERNELS_AVX2; set++)
+		{
+			if(!setNoiseKernels((NoiseKernelSet)set))
+				continue;
+			u32 t0 = porting::getTimeUs();
+			for(u32 i = 0; i < 10; i++)
+				noise2d_map.perlinMap2D(-1280.5, 3344.25);
+			u32 t1 = porting::getTimeUs();
+			for(u32 i = 0; i < 10; i++)
+				noise3d_map.perlinMap3D(640.3, -33, -96);
+			u32 t2 = porting::getTimeUs();
+			UASSERT(memcmp(noise2d_map.result, &expected2d[0],
+					size2d * sizeof(float)) == 0);
+			UASSERT(memcmp(noise3d_map.result, &expected3d[0],
+					size3d * sizeof(float)) == 0);
+			infostream<<"TestNoise: "<<names[set]<<" kernels: 10 2D maps "
+					<<(t1 - t0)<<"us, 10 3D maps "<<(t2 - t1)<<"us"
+					<<std::endl;
+		}
+
+		// Back to the fastest ones
+		if(!setNoiseKernels(NOISE_KERNELS_AVX2) &&
+				!setNoiseKernels(NOISE_KERNELS_SSE2))
+			setNoiseKernels(NOISE_KERNELS_SCALAR);
+	}
+};
+
+struct TestMapBlockIndex: public TestBase
+{
+	/*
+		The sector layout MapBlockIndex replaced: a map of sectors,
+		each a map of blocks, with the last used sector cached
+	*/
+	struct SectorLayout
+	{
+		std::map<v2s16, std::map<s16, MapBlock*> > sectors;
+		std::map<s16, MapBlock*> *cache;
+		v2s16 cache_p;
+
+		SectorLayout(): cache(NULL) {}
+
+		MapBlock *find(v3s16 p)
+		{
+			v2s16 p2d(p.X, p.Z);
+			if(cache == NULL || cache_p != p2d){
+				std::map<v2s16, std::map<s16, MapBlock*> >::iterator
+						i = sectors.find(p2d);
+				if(i == sectors.end())
+					return NULL;
+				cache = &i->second;
+				cache_p = p2d;
+			}
+			std::map<s16, MapBlock*>::iterator i = cache->find(p.Y);
+			if(i == cache->end())
+				return NULL;
+			return i->second;
+		}
+	};
+
+	void Run()
+	{
+		// The blocks are never dereferenced, only compared
+		static char blocks[3000];
+		MapBlockIndex index;
+		std::map<v3s16, MapBlock*> expected;
+		PseudoRandom pr(4321);
+
+		// Insert and remove in a small area to get long probe sequences
+		for(u32 i = 0; i < 20000; i++)
+		{
+			v3s16 p(pr.range(-10, 10), pr.range(-10, 10), pr.range(-10, 10));
+			if(pr.range(0, 2) == 0){
+				index.remove(p);
+				expected.erase(p);
+			} else {
+				MapBlock *block = (MapBlock*)&blocks[pr.range(0, 2999)];
+				index.insert(p, block);
+				expected[p] = block;
+			}
+			if(i % 1000 == 0){
+				UASSERT(index.size() == expected.size());
+				v3s16 q;
+				for(q.X=-11; q.X<=11; q.X++)
+				for(q.Y=-11; q.Y<=11; q.Y++)
+				for(q.Z=-11; q.Z<=11; q.Z++)
+				{
+					std::map<v3s16, MapBlock*>::iterator
+							j = expected.find(q);
+					UASSERT(index.find(q) ==
+							(j == expected.end() ? NULL : j->second));
+				}
+			}
+		}
+		index.clear();
+		UASSERT(index.size() == 0);
+		UASSERT(index.find(expected.begin()->first) == NULL);
+
+		/*
+			Benchmark against the sector layout, with lookups of random
+			blocks and of neighboring blocks in turn
+		*/
+		SectorLayout sectors;
+		v3s16 p;
+		u32 n = 0;
+		for(p.X=-20; p.X<20; p.X++)
+		for(p.Y=-5; p.Y<5; p.Y++)
+		for(p.Z=-20; p.Z<20; p.Z++)
+		{
+			MapBlock *block = (MapBlock*)&blocks[n++ % 3000];
+			index.insert(p, block);
+			sectors.sectors[v2s16(p.X, p.Z)][p.Y] = block;
+		}
+		std::vector<v3s16> random_positions;
+		for(u32 i = 0; i < 100000; i++)
+			random_positions.push_back(v3s16(pr.range(-22, 22),
+					pr.range(-6, 6), pr.range(-22, 22)));
+		std::vector<v3s16> coherent_positions;
+		for(p.X=-20; p.X<20; p.X++)
+		for(p.Z=-20; p.Z<20; p.Z++)
+		for(p.Y=-5; p.Y<5; p.Y++)
+		for(u32 i = 0; i < 6; i++)
+			coherent_positions.push_back(p + g_6dirs[i]);
+
+		std::vector<v3s16> *sets[2] = {&random_positions, &coherent_positions};
+		const char *set_names[2] = {"random", "coherent"};
+		for(u32 s = 0; s < 2; s++)
+		{
+			std::vector<v3s16> &positions = *sets[s];
+			u32 found_index = 0;
+			u32 found_sectors = 0;
+			u32 t0 = porting::getTimeUs();
+			for(u32 r = 0; r < 10; r++)
+			for(u32 i = 0; i < positions.size(); i++)
+				found_index += index.find(positions[i]) != NULL;
+			u32 t1 = porting::getTimeUs();
+			for(u32 r = 0; r < 10; r++)
+			for(u32 i = 0; i < positions.size(); i++)
+				found_sectors += sectors.find(positions[i]) != NULL;
+			u32 t2 = porting::getTimeUs();
+			UASSERT(found_index == found_sectors);
+			infostream<<"TestMapBlockIndex: "<<positions.size() * 10
+					<<" "<<set_names[s]<<" lookups: index "<<(t1 - t0)
+					<<"us, sectors "<<(t2 - t1)<<"us"<<std::endl;
+		}
+	}
+};
+
+struct TestProbes: public TestBase
+{
+	class SampleThread: public JThread
+	{
+	public:
+		ProbeId probe;
+		u32 offset;
+
+		void * Thread()
+		{
+			ThreadStarted();
+			for(u32 i = 1; i <= 1000; i++)
+				g_probes.sample(probe, i + offset);
+			return NULL;
+		}
+	};
+
+	const ProbeStats *find(const std::vector<ProbeStats> &stats,
+			const std::string &name)
+	{
+		for(u32 i = 0; i < stats.size(); i++)
+			if(stats[i].name == name)
+				return &stats[i];
+		return NULL;
+	}
+
+	void Run()
+	{
+		// Buckets cover all values in order
+		u32 last_bucket = 0;
+		for(u32 v = 0; v < 100000; v++)
+		{
+			u32 b = ProbeRegistry::getBucket(v);
+			UASSERT(b == last_bucket || b == last_bucket + 1);
+			UASSERT(ProbeRegistry::getBucketValue(b) <= v);
+			UASSERT(ProbeRegistry::getBucketValue(b + 1) > v);
+			last_bucket = b;
+		}
+		UASSERT(ProbeRegistry::getBucket(0xffffffff) < PROBE_BUCKETS);
+
+		ProbeId probe = g_probes.registerProbe("TestProbes");
+		UASSERT(probe != PROBE_INVALID);
+		UASSERT(g_probes.registerProbe("TestProbes") == probe);
+		g_probes.reset();
+
+		// Samples of this and two other threads are summed up
+		SampleThread threads[2];
+		for(u32 i = 0; i < 2; i++){
+			threads[i].probe = probe;
+			threads[i].offset = i * 1000;
+			threads[i].Start();
+		}
+		for(u32 i = 1; i <= 1000; i++)
+			g_probes.sample(probe, i + 2000);
+		for(u32 i = 0; i < 2; i++)
+			threads[i].Wait();
+
+		std::vector<ProbeStats> stats;
+		g_probes.collect(stats);
+		const ProbeStats *s = find(stats, "TestProbes");
+		UASSERT(s != NULL);
+		UASSERT(s->count == 3000);
+		UASSERT(s->min == 1);
+		UASSERT(s->max == 3000);
+		UASSERT(fabs(s->avg - 1500.5) < 0.01);
+		// Exact to the bucket width, a fifth of the value
+		UASSERT(s->p50 <= 1500 && s->p50 >= 1500 * 4 / 5);
+		UASSERT(s->p99 <= 2970 && s->p99 >= 2970 * 4 / 5);
+
+		// Threads started later reuse the slots of the exited ones, so
+		// there are never more than threads sampling at the same time.
+		// Their samples are seen consistently while they run.
+		u32 slots_count = g_probes.getThreadSlotsCount();
+		for(u32 round = 0; round < 10; round++)
+		{
+			g_probes.reset();
+			SampleThread more_threads[2];
+			for(u32 i = 0; i < 2; i++){
+				more_threads[i].probe = probe;
+				more_threads[i].offset = i * 1000;
+				more_threads[i].Start();
+			}
+			u32 last_count = 0;
+			while(more_threads[0].IsRunning() ||
+					more_threads[1].IsRunning())
+			{
+				stats.clear();
+				g_probes.collect(stats);
+				s = find(stats, "TestProbes");
+				if(s == NULL)
+					continue;
+				UASSERT(s->count >= last_count && s->count <= 2000);
+				UASSERT(s->p50 >= 1 && s->p99 >= s->p50);
+				last_count = s->count;
+			}
+			for(u32 i = 0; i < 2; i++)
+				more_threads[i].Wait();
+			stats.clear();
+			g_probes.collect(stats);
+			s = find(stats, "TestProbes");
+			UASSERT(s != NULL && s->count == 2000);
+		}
+		UASSERT(g_probes.getThreadSlotsCount() <= slots_count + 2);
+
+		// Only what was sampled since
+		g_probes.reset();
+		g_probes.sample(probe, 7);
+		stats.clear();
+		g_probes.collect(stats);
+		s = find(stats, "TestProbes");
+		UASSERT(s != NULL);
+		UASSERT(s->count == 1);
+		UASSERT(s->min == 7 && s->max == 7 && s->p50 == 7 && s->p99 == 7);
+		g_probes.reset();
+		stats.clear();
+		g_probes.collect(stats);
+		UASSERT(find(stats, "TestProbes") == NULL);
+
+		// Graphed as the average since the previous graphGet()
+		Profiler graph_profiler(&g_probes);
+		Profiler::GraphValues values;
+		graph_profiler.graphGet(values);
+		g_probes.sample(probe, 10);
+		g_probes.sample(probe, 20);
+		values.clear();
+		graph_profiler.graphGet(values);
+		UASSERT(values.count("TestProbes") == 1);
+		UASSERT(fabs(values["TestProbes"] - 15) < 0.01);
+		values.clear();
+		graph_profiler.graphGet(values);
+		UASSERT(values.count("TestProbes") == 0);
+		g_probes.reset();
+
+		/*
+			Benchmark against Profiler::avg()
+		*/
+		Profiler profiler;
+		u32 t0 = porting::getTimeUs();
+		for(u32 i = 0; i < 1000000; i++)
+			g_probes.sample(probe, i);
+		u32 t1 = porting::getTimeUs();
+		for(u32 i = 0; i < 1000000; i++)
+			profiler.avg("TestProbes", i);
+		u32 t2 = porting::getTimeUs();
+		g_probes.reset();
+		infostream<<"TestProbes: 1000000 samples: probe "<<(t1 - t0)
+				<<"us, Profiler::avg() "<<(t2 - t1)<<"us"<<std::endl;
+	}
+};
+
 struct TestSocket: public TestBase
 {
 	void Run()
@@ -1610,6 +2602,288 @@ struct TestConnection: public TestBase
 		UASSERT(readU8(&p2[3]) == data1[0]);
 	}
 
+	// A reliable packet carrying its seqnum without wrapping around
+	con::BufferedPacket makeTestPacket(u32 seqnum)
+	{
+		SharedBuffer<u8> data(4);
+		writeU32(*data, seqnum);
+		SharedBuffer<u8> reliable = con::makeReliablePacket(data, (u16)seqnum);
+		Address a(127,0,0,1, 10);
+		return con::makePacket(a, reliable, 0x12345678, 1, 0);
+	}
+
+	void TestReliablePacketBuffer()
+	{
+		/*
+			Run both ends of a lossy, reordering link through the
+			reliable buffers, with seqnums wrapping around
+		*/
+		PseudoRandom pr(1234);
+
+		// Sender: packets stay buffered until they are acked
+		{
+			con::ReliablePacketBuffer buf;
+			std::set<u32> inflight; // seqnums without wrapping
+			std::vector<u32> inflight_list;
+			u32 next = SEQNUM_INITIAL;
+			for(u32 step = 0; step < 200000; step++)
+			{
+				u16 base = (u16)next - 0x4000;
+				int action = pr.range(0, 9);
+				if(action < 4 && inflight.size() < 1000)
+				{
+					con::BufferedPacket p = makeTestPacket(next);
+					buf.insert(p, base);
+					inflight.insert(next);
+					inflight_list.push_back(next);
+					next++;
+				}
+				else if(action < 6 && !inflight_list.empty())
+				{
+					// The ack got lost; the packet is sent again and
+					// must not be buffered twice
+					u32 i = pr.next() % inflight_list.size();
+					u32 s = inflight_list[i];
+					con::BufferedPacket p = makeTestPacket(s);
+					buf.insert(p, base);
+				}
+				else if(!inflight_list.empty())
+				{
+					u32 i = pr.next() % inflight_list.size();
+					u32 s = inflight_list[i];
+					con::BufferedPacket p = buf.popSeqnum((u16)s);
+					UASSERT(readU32(&p.data[BASE_HEADER_SIZE + 3]) == s);
+					UASSERT(!buf.containsPacket((u16)s));
+					inflight_list[i] = inflight_list.back();
+					inflight_list.pop_back();
+					inflight.erase(s);
+				}
+
+				UASSERT(buf.size() == inflight.size());
+				u16 first;
+				UASSERT(buf.getFirstSeqnum(first) == !inflight.empty());
+				if(!inflight.empty())
+					UASSERT(first == (u16)*inflight.begin());
+
+				if(step % 1000 == 0)
+				{
+					buf.incrementTimeouts(1.0);
+					std::list<con::BufferedPacket> timed_outs =
+							buf.getTimedOuts(0.5, 100000);
+					UASSERT(timed_outs.size() == inflight.size());
+					std::set<u32>::iterator j = inflight.begin();
+					for(std::list<con::BufferedPacket>::iterator
+							i = timed_outs.begin();
+							i != timed_outs.end(); ++i, ++j)
+						UASSERT(readU32(&i->data[BASE_HEADER_SIZE + 3]) == *j);
+				}
+			}
+		}
+
+		// Receiver: packets arriving early wait for the missing ones
+		{
+			con::ReliablePacketBuffer buf;
+			std::vector<u32> network; // resent until delivered
+			u32 next_send = SEQNUM_INITIAL;
+			u32 next_expected = SEQNUM_INITIAL;
+			while(next_expected < SEQNUM_INITIAL + 100000)
+			{
+				if(network.size() < 200)
+					network.push_back(next_send++);
+
+				u32 i = pr.next() % network.size();
+				u32 s = network[i];
+				// Lost packets stay in flight and are tried again later
+				if(pr.range(0, 9) < 3)
+					continue;
+				// Sometimes the packet arrives twice
+				if(pr.range(0, 9) != 0)
+				{
+					network[i] = network.back();
+					network.pop_back();
+				}
+
+				if(s < next_expected)
+					continue;
+				if(s > next_expected)
+				{
+					con::BufferedPacket p = makeTestPacket(s);
+					buf.insert(p, (u16)next_expected);
+					continue;
+				}
+
+				next_expected++;
+				u16 first;
+				while(buf.getFirstSeqnum(first) && first == (u16)next_expected)
+				{
+					con::BufferedPacket p = buf.popFirst();
+					UASSERT(readU32(&p.data[BASE_HEADER_SIZE + 3]) ==
+							next_expected);
+					next_expected++;
+				}
+			}
+		}
+	}
+
+	void TestCongestionControl()
+	{
+		/*
+			Drive a channel's window through slow start, loss and a
+			queue building up on the path
+		*/
+		con::Channel channel;
+		channel.setWindowSize(0x40);
+
+		// no rtt measured yet: only the window limits sending
+		channel.UpdateSendCredit(0.01);
+		for(u32 i = 0; i < 0x40; i++)
+			UASSERT(channel.takeSendCredit());
+		UASSERT(!channel.takeSendCredit());
+
+		// slow start: a fully used window doubles once per round trip
+		channel.UpdateRTT(0.1);
+		for(u32 i = 0; i < 3; i++) {
+			u32 window = channel.getWindowSize();
+			channel.UpdateBytesSent(window * 500, window);
+			channel.UpdateTimers(0.1);
+			UASSERT(channel.getWindowSize() == window * 2);
+		}
+
+		// an idle window does not grow
+		u32 window = channel.getWindowSize();
+		channel.UpdateBytesSent(500, 1);
+		channel.UpdateTimers(0.1);
+		UASSERT(channel.getWindowSize() == window);
+
+		// loss halves it and ends slow start
+		channel.UpdateBytesSent(window * 400, window * 8 / 10);
+		channel.UpdatePacketLossCounter(window * 2 / 10);
+		channel.UpdateTimers(0.1);
+		UASSERT(channel.getWindowSize() == window / 2);
+		window = channel.getWindowSize();
+		channel.UpdateBytesSent(window * 500, window);
+		channel.UpdateTimers(0.1);
+		UASSERT(channel.getWindowSize() > window);
+		UASSERT(channel.getWindowSize() < window * 2);
+
+		// rising round trip times shrink it before anything is lost
+		for(u32 i = 0; i < 20; i++)
+			channel.UpdateRTT(0.5);
+		window = channel.getWindowSize();
+		channel.UpdateBytesSent(window * 500, window);
+		channel.UpdateTimers(0.5);
+		UASSERT(channel.getWindowSize() < window);
+
+		// pacing spreads the window over one round trip
+		window = channel.getWindowSize();
+		float rtt = channel.getSmoothedRTT();
+		UASSERT(fabs(channel.getSendRate() - window / rtt) < 1.0);
+		while(channel.takeSendCredit());
+		channel.UpdateSendCredit(rtt / 4);
+		u32 sent = 0;
+		while(channel.takeSendCredit())
+			sent++;
+		UASSERT(sent + 1 >= window / 4 && sent <= window / 4);
+	}
+
+	void TestBatchedSocket()
+	{
+		/*
+			Send datagrams over loopback in batches and one at a time,
+			check that they arrive intact and compare the throughput
+		*/
+		const int port = 30002;
+		const int batch = 32;
+		const int packet_size = 200;
+		const int rounds = 500;
+
+		UDPSocket sender_socket(false);
+		sender_socket.Bind(Address(0,0,0,0, 0));
+		UDPSocket receiver_socket(false);
+		receiver_socket.Bind(Address(0,0,0,0, port));
+		receiver_socket.setTimeoutMs(100);
+		Address dest(127,0,0,1, port);
+
+		std::vector<u8> senddata(batch * packet_size);
+		std::vector<u8> recvdata(batch * 1500);
+		UDPPacket packets[batch];
+		UDPPacket received[batch];
+
+		u32 time_batched = 0;
+		u32 time_single = 0;
+		for(int mode = 0; mode < 2; mode++)
+		{
+			bool batched = (mode == 0);
+			u32 t0 = porting::getTimeMs();
+			for(int r = 0; r < rounds; r++)
+			{
+				for(int i = 0; i < batch; i++)
+				{
+					packets[i].address = dest;
+					packets[i].data = &senddata[i * packet_size];
+					packets[i].size = packet_size;
+					writeU32(packets[i].data, r * batch + i);
+				}
+				if(batched)
+				{
+					UASSERT(sender_socket.SendBatch(packets, batch) == batch);
+				}
+				else
+				{
+					for(int i = 0; i < batch; i++)
+						sender_socket.Send(dest, packets[i].data, packet_size);
+				}
+
+				// Read the round back before the socket buffer fills up
+				int count = 0;
+				while(count < batch)
+				{
+					int n;
+					if(batched)
+					{
+						for(int i = 0; i < batch - count; i++)
+						{
+							received[i].data = &recvdata[i * 1500];
+							received[i].size = 1500;
+						}
+						n = receiver_socket.ReceiveBatch(received,
+								batch - count);
+					}
+					else
+					{
+						received[0].data = &recvdata[0];
+						n = receiver_socket.Receive(received[0].address,
+								received[0].data, 1500);
+						if(n >= 0)
+						{
+							received[0].size = n;
+							n = 1;
+						}
+					}
+					UASSERT(n > 0);
+					for(int i = 0; i < n; i++)
+					{
+						UASSERT(received[i].size == packet_size);
+						UASSERT(readU32(received[i].data) ==
+								(u32)(r * batch + count + i));
+						UASSERT(received[i].address.getAddress().sin_addr.s_addr
+								== dest.getAddress().sin_addr.s_addr);
+					}
+					count += n;
+				}
+			}
+			u32 t = porting::getTimeMs() - t0;
+			if(batched)
+				time_batched = t;
+			else
+				time_single = t;
+		}
+
+		infostream<<"TestConnection: "<<rounds * batch<<" datagrams over "
+				"loopback: batched "<<time_batched<<"ms, one at a time "
+				<<time_single<<"ms"<<std::endl;
+	}
+
 	struct Handler : public con::PeerHandler
 	{
 		Handler(const char *a_name)
@@ -1644,6 +2918,9 @@ struct TestConnection: public TestBase
 		DSTACK("TestConnection::Run");
 
 		TestHelpers();
+		TestReliablePacketBuffer();
+		TestCongestionControl();
+		TestBatchedSocket();
 
 		/*
 			Test some real connections
@@ -2006,13 +3283,22 @@ void run_tests()
 	TEST(TestCompress);
 	TEST(TestSerialization);
 	TEST(TestNodedefSerialization);
+	TEST(TestNodedefCollisionBoxes);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
+	TESTPARAMS(TestMapgenLighting, ndef);
 	TESTPARAMS(TestInventory, idef);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
+	TESTPARAMS(TestReadChunkArea, idef, ndef);
+	TESTPARAMS(TestMapBlockDelta, idef, ndef);
 	TEST(TestCollision);
+	TEST(TestObjectCollisionGrid);
+	TEST(TestActiveBlockList);
+	TEST(TestMapBlockIndex);
+	TEST(TestProbes);
+	TEST(TestNoise);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
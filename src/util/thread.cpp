@@ -0,0 +1,130 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "thread.h"
+#include "../log.h"
+#include "../debug.h"
+
+class WorkerPoolThread : public JThread
+{
+public:
+	WorkerPoolThread(WorkerPool *pool, u16 worker, const std::string &name):
+		JThread(),
+		m_pool(pool),
+		m_worker(worker),
+		m_name(name)
+	{
+	}
+
+	void * Thread();
+
+	// Posted once for every batch and once more for stopping
+	JSemaphore m_start;
+
+private:
+	WorkerPool *m_pool;
+	u16 m_worker;
+	std::string m_name;
+};
+
+void * WorkerPoolThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread(m_name);
+
+	DSTACK(__FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for(;;)
+	{
+		m_start.Wait();
+		if(StopRequested())
+			break;
+		m_pool->work(m_worker);
+		m_pool->m_done.Post();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+	return NULL;
+}
+
+WorkerPool::WorkerPool(u16 num_threads, const std::string &name):
+	m_jobs(NULL),
+	m_job_count(0),
+	m_next_job(0)
+{
+	for(u16 i = 0; i < num_threads; i++)
+	{
+		WorkerPoolThread *thread = new WorkerPoolThread(this, i + 1, name);
+		m_threads.push_back(thread);
+		thread->Start();
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for(std::vector<WorkerPoolThread*>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i)
+	{
+		(*i)->Stop();
+		(*i)->m_start.Post();
+		(*i)->Wait();
+		delete *i;
+	}
+}
+
+void WorkerPool::run(ParallelJobList *jobs)
+{
+	{
+		JMutexAutoLock lock(m_jobs_mutex);
+		m_jobs = jobs;
+		m_job_count = jobs->getJobCount();
+		m_next_job = 0;
+	}
+
+	for(std::vector<WorkerPoolThread*>::iterator
+			i = m_threads.begin(); i != m_threads.end(); ++i)
+		(*i)->m_start.Post();
+
+	work(0);
+
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_done.Wait();
+
+	JMutexAutoLock lock(m_jobs_mutex);
+	m_jobs = NULL;
+}
+
+void WorkerPool::work(u16 worker)
+{
+	for(;;)
+	{
+		u32 i;
+		{
+			JMutexAutoLock lock(m_jobs_mutex);
+			if(m_next_job >= m_job_count)
+				return;
+			i = m_next_job++;
+		}
+		m_jobs->runJob(i, worker);
+	}
+}
@@ -24,7 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../jthread/jthread.h"
 #include "../jthread/jmutex.h"
 #include "../jthread/jmutexautolock.h"
+#include "../jthread/jsemaphore.h"
+#include "container.h"
 #include "porting.h"
+#include <string>
+#include <vector>
 
 template<typename T>
 class MutexedVariable
@@ -208,5 +212,58 @@ class RequestQueue
 	MutexedQueue< GetRequest<Key, T, Caller, CallerData> > m_queue;
 };
 
+/*
+	A batch of independent jobs that can be run by a WorkerPool.
+*/
+class ParallelJobList
+{
+public:
+	virtual ~ParallelJobList() {}
+
+	virtual u32 getJobCount() = 0;
+
+	/*
+		Called concurrently from several threads, each job index exactly
+		once. worker is in [0, WorkerPool::getWorkerCount()) and can be
+		used to index per-worker scratch data; worker 0 is the thread that
+		called WorkerPool::run().
+	*/
+	virtual void runJob(u32 i, u16 worker) = 0;
+};
+
+class WorkerPoolThread;
+
+/*
+	A fixed set of threads that run ParallelJobLists.
+
+	run() hands the jobs to the threads, takes part in the work itself and
+	returns when every job is done, so the caller can rely on the jobs not
+	running concurrently with anything it does before or after.
+*/
+class WorkerPool
+{
+public:
+	WorkerPool(u16 num_threads, const std::string &name);
+	~WorkerPool();
+
+	// Number of threads running jobs, including the calling thread
+	u16 getWorkerCount()
+		{ return m_threads.size() + 1; }
+
+	void run(ParallelJobList *jobs);
+
+private:
+	friend class WorkerPoolThread;
+
+	void work(u16 worker);
+
+	std::vector<WorkerPoolThread*> m_threads;
+	JSemaphore m_done;
+	JMutex m_jobs_mutex;
+	ParallelJobList *m_jobs;
+	u32 m_job_count;
+	u32 m_next_job;
+};
+
 #endif
 